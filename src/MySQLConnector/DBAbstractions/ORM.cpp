@@ -2,20 +2,25 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <map>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <openssl/evp.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <dirent.h>
+#include <limits.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
-#include <thread>
-#include <chrono>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <mutex>
 
 #include "ORM.h"
+#include "ScanEngine/ScanEngine.h"
 #include "LightLinkedList.h"
 #include "PriorityQueue.h"
 #include "StringBuilder.h"
@@ -30,100 +35,14 @@ using namespace std;
 
 static std::map<uid_t, char*> uid_str_table;
 static std::map<gid_t, char*> gid_str_table;
+static std::mutex             id_str_mutex;   // Guards both tables. Workers share them.
 
-static PriorityQueue<LinkedList<ORMFileData*>*> _disk_thread_queues;
-static PriorityQueue<ORMFileData*>              _databi_thread_queues;
+static SlabAllocator _entry_slab(ENTRY_SLAB_BLOCK_SIZE);
 
-const int THREAD_COUNT_DISK_MAX = 4; // How many disk threads should we allow?
-const int THREAD_COUNT_DB_MAX   = 1; // How many disk threads should we allow?
-const int MAX_QUERY_LENGTH      = 40000; //
+const unsigned int CHUNK_QUERY_LENGTH = 40000;   // Upper bound on a batched INSERT of chunks.
 
 
 
-/**
-* Does longer-running disk access.
-*/
-void worker_thread_deep_disk(FSOCounts* stats, LinkedList<StringBuilder*>* logs) {
-  while (1) {
-    LinkedList<ORMFileData*>* wq = _disk_thread_queues.dequeue();
-    if (wq) {
-      ORMFileData* cur = wq->remove();
-      while (cur) {
-        cur->closelyExamine(stats, logs);
-        cur = wq->remove();
-      }
-      delete wq;
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-  }
-}
-
-
-/**
-* No memory management is to be done by the thread. Only the main thread frees memory.
-* Writes the def to the database.
-*/
-void worker_thread_db_write() {
-  LibrarianDB* _db = LibrarianDB::getInstance();
-  while (1) {
-    ORMFileData* cur = _databi_thread_queues.dequeue();
-    if (cur) {
-      if (cur->dirty()) {
-        LinkedList<ORMFileData*> objs_in_query;
-        StringBuilder insert_query;
-        cur->generateInsertQuery(&insert_query, nullptr);
-
-        while ((nullptr != cur) && (insert_query.length() < MAX_QUERY_LENGTH)) {
-          objs_in_query.insertAtHead(cur);
-          if (objs_in_query.size() > 1) {
-            insert_query.concat(",\n");
-          }
-          cur->generateInsertQuery(nullptr, &insert_query);
-          //printf("insert_query size = %d       _databi_thread_queues size = %d        objs_in_query size = %d\n", insert_query.length(), _databi_thread_queues.size(), objs_in_query.size());
-          cur = _databi_thread_queues.dequeue();
-        }
-        insert_query.concat(";");
-        //printf("%s\n", insert_query.string());
-        if (objs_in_query.size() > 0) {
-          if (1 == _db->r_query(insert_query.string())) {
-            while (objs_in_query.size() > 0) {
-              cur = objs_in_query.remove();
-              if (cur) {
-                cur->markClean();
-                //printf("DELETE from success case\n");
-                delete cur;
-              }
-            }
-          }
-          else {
-            c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save record to database.");
-            printf("%s\n", (char*) insert_query.string());
-          }
-        }
-      }
-      else {
-        //printf("DELETE from else case\n");
-        delete cur;
-      }
-    }
-    else {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    }
-  }
-}
-
-
-
-void ORMFileData::ship_db_thread(FSOCounts* stats, LinkedList<StringBuilder*>* logs) {
-  new std::thread(worker_thread_db_write);
-  new std::thread(worker_thread_deep_disk, stats, logs);
-  new std::thread(worker_thread_deep_disk, stats, logs);
-  new std::thread(worker_thread_deep_disk, stats, logs);
-  new std::thread(worker_thread_deep_disk, stats, logs);
-  new std::thread(worker_thread_deep_disk, stats, logs);
-  new std::thread(worker_thread_deep_disk, stats, logs);
-}
-
 
 void FSOCounts::tally(ORMFileData* o) {
   if (o->isFile()) {
@@ -148,16 +67,35 @@ void FSOCounts::progressPrint() {
 
 
 
+/*
+* Entries are made by the directory readers, and retired in batches by the DB
+*   writer. Allocating them from per-thread slabs keeps the workers out of each
+*   other's way in the heap, and frees memory in the same batches.
+*/
+void* ORMFileData::operator new(size_t len) noexcept {
+  return _entry_slab.alloc(len);
+}
+
+
+void ORMFileData::operator delete(void* ptr) {
+  _entry_slab.release(ptr);
+}
+
+
+size_t ORMFileData::slabBytesHeld() {
+  return _entry_slab.bytesHeld();
+}
+
+
+
 ORMFileData::ORMFileData(uint32_t dvid, char* p) : _dh_ver(dvid) {
   memset(_hash, 0, 32);
   memset(_mode, 0, sizeof(_mode));
   char* trimmed = trim(p);
   size_t path_len = strlen(trimmed);
   if (path_len) {
-    _path = (char*) malloc(path_len+1);
-    if (_path) {
-      memcpy(_path, trimmed, path_len);
-      *(_path + path_len) = '\0';
+    _node = PathArena::make(nullptr, trimmed, path_len);
+    if (_node) {
       _fill_from_stat();
     }
   }
@@ -165,146 +103,695 @@ ORMFileData::ORMFileData(uint32_t dvid, char* p) : _dh_ver(dvid) {
 
 
 
+/*
+* Constructor for entries discovered by dive(). The type is taken provisionally
+*   from the dirent, and the stat is left to whichever worker examines us, so
+*   that the directory reader never blocks on metadata.
+* Our name is stored once, linked to the node of the directory that holds us.
+* If a parent handle is given, we hold a reference to it until we are examined,
+*   and resolve our name against it rather than walking the full path.
+* A structure-only scan skips the stat entirely, unless the filesystem did not
+*   report a type in the dirent, or we are a directory and need our device to
+*   know whether we are a mount point.
+*/
+ORMFileData::ORMFileData(uint32_t dvid, PathNode* dir_node, const char* name, size_t name_len, uint8_t d_type, ScanDirHandle* parent, ScanDepth depth) : _dh_ver(dvid) {
+  memset(_hash, 0, 32);
+  memset(_mode, 0, sizeof(_mode));
+  _node = PathArena::make(dir_node, name, name_len);
+  if (_node) {
+    if (parent) {
+      parent->take();
+      _parent = parent;
+    }
+    _is_dir  = (DT_DIR == d_type);
+    _is_file = (DT_REG == d_type);
+    _is_link = (DT_LNK == d_type);
+    _tier    = (DT_UNKNOWN == d_type) ? ScanDepth::NONE : ScanDepth::STRUCTURE;
+    _stat_pending = ((ScanDepth::STRUCTURE != depth) || (DT_UNKNOWN == d_type));
+    if (_is_dir && ScanScheduler::getInstance()->options()->one_fs) {
+      _stat_pending = true;
+    }
+  }
+}
+
+
+
+/*
+* Constructor for an object whose node is already built, as when a scan is
+*   resumed or a watch sees a change. We take over the caller's reference to
+*   the node. A resumed directory was left unread by a checkpoint. Its row was
+*   written before the checkpoint, so it is only here to be read.
+*/
+ORMFileData::ORMFileData(uint32_t dvid, PathNode* node, bool resumed) : _dh_ver(dvid), _node(node), _resumed(resumed) {
+  memset(_hash, 0, 32);
+  memset(_mode, 0, sizeof(_mode));
+  if (_node) {
+    _fill_from_stat();
+  }
+}
+
+
 ORMFileData::~ORMFileData() {
   if (_need_db_write) {
     //StringBuilder insert_query;
     //generateInsertQuery(&insert_query);
   }
+  _release_parent();
 
-  if (_path) {
-    free(_path);
-    _path = nullptr;
+  if (_node) {
+    PathArena::release(_node);
+    _node = nullptr;
+  }
+  if (_chunks) {
+    delete _chunks;
+    _chunks = nullptr;
   }
 }
 
 
 int ORMFileData::closelyExamine(FSOCounts* stats, LinkedList<StringBuilder*>* logs) {
-  if (!closelyExamined()) {
-    if (isFile()) {
-      _hash_file();
+  int ret = examineMetadata(stats, logs);
+  if (1 == ret) {
+    ret = examineContent();
+  }
+  return ret;
+}
+
+
+/*
+* The first phase of examination: stat (if still needed), tally, and dive into
+*   directories. Anything that is not a regular file is finished here.
+* Returns 1 if a content hash is still owed (see examineContent()), 0 if the
+*   object is finished, or -1 if it was already examined.
+*/
+int ORMFileData::examineMetadata(FSOCounts* stats, LinkedList<StringBuilder*>* logs) {
+  if (closelyExamined()) {
+    return -1;
+  }
+  const ScanDepth depth = ScanScheduler::getInstance()->options()->depth;
+  if (_stat_pending) {
+    _fill_from_stat();
+  }
+  if (_rules_pending) {
+    _rules_pending = false;
+    ScanRules* rules = &ScanScheduler::getInstance()->options()->rules;
+    const char* rel  = (rules->needsRelativePath()) ? PathArena::relativePath(_node) : nullptr;
+    if (_exists && (RuleVerdict::EXCLUDE == rules->evaluate(rel, _node->name, _is_dir, _is_file, _fsize, _mtime))) {
+      // Excluded once our stat was known. We are neither counted nor written.
+      stats->excluded++;
+      _closely_examined = true;
+      _release_parent();
+      return 0;
     }
-    else if (isDirectory()) {
-      dive(stats, logs);
+  }
+  if (_resumed) {
+    if (!_is_dir) {
+      // Since the checkpoint, the directory has gone, or become something else.
+      c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "%s is no longer a directory. Not resuming it.", path());
+      _closely_examined = true;
+      return 0;
     }
-    else if (isLink()) {
+  }
+  else {
+    stats->tally(this);
+  }
+  if (isFile()) {
+    if ((ScanDepth::FULL == depth) && (ScanDepth::METADATA == _tier)) {
+      return 1;
+    }
+    _closely_examined = true;
+  }
+  else if (isDirectory()) {
+    ScanScheduler* sched = ScanScheduler::getInstance();
+    if (sched->options()->one_fs && (_dev != sched->rootDevice())) {
+      // A mount point. It gets a row, but we stay on our own filesystem.
+      c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Not crossing into another filesystem at %s", path());
       _closely_examined = true;
     }
-    _need_db_write = true;
-    _databi_thread_queues.insert(this);
-    return 0;
+    else if (_skip_dive) {
+      _closely_examined = true;
+    }
+    else if (sched->divesPaused()) {
+      // A checkpoint is being taken. We are left for whoever continues.
+      sched->defer(_node);
+    }
+    else {
+      dive(stats, logs);
+    }
+  }
+  else if (isLink()) {
+    _closely_examined = true;
+  }
+  if (!isFile() && (ScanDepth::FULL == depth) && (ScanDepth::METADATA == _tier)) {
+    // There is nothing more to learn about a directory or link.
+    _tier = ScanDepth::FULL;
+  }
+  _need_db_write = !_resumed;
+  _release_parent();
+  return 0;
+}
+
+
+/*
+* The second phase of examination, for regular files: read and hash. This may
+*   be deferred, so that the scheduler can put a batch of files into physical
+*   order first.
+* Returns 0 on success, -1 on failure. Either way, the object is finished.
+*/
+int ORMFileData::examineContent() {
+  int ret = _hash_file();
+  if (0 == ret) {
+    _tier = ScanDepth::FULL;
+  }
+  _need_db_write = true;
+  _release_parent();
+  return ret;
+}
+
+
+/*
+* The second phase of examination, for a file whose content was read by
+*   readContent(), and hashed along with others. Either digest may be null if
+*   it was not wanted. If both are, the read failed.
+*/
+void ORMFileData::acceptContent(const uint8_t* hash, const uint8_t* blake3) {
+  if (hash) {
+    memcpy(_hash, hash, 32);
+  }
+  if (blake3) {
+    memcpy(_blake3, blake3, 32);
+    _has_blake3 = true;
+  }
+  if (hash || blake3) {
+    _tier = ScanDepth::FULL;
+    _closely_examined = true;
+  }
+  _need_db_write = true;
+  _release_parent();
+}
+
+
+/*
+* The second phase of examination, for a file whose inode was already read
+*   through another link. We take that link's digest instead of reading the
+*   same content again.
+*/
+void ORMFileData::adoptContent(const uint8_t* hash, const uint8_t* blake3, bool ok) {
+  memcpy(_hash, hash, 32);
+  if (blake3) {
+    memcpy(_blake3, blake3, 32);
+    _has_blake3 = true;
+  }
+  if (ok) {
+    _tier = ScanDepth::FULL;
+  }
+  _link_reused   = true;
+  _need_db_write = true;
+  _release_parent();
+}
+
+
+/*
+* The second phase of examination, for a file that has not changed since the
+*   baseline catalog. We take our old digests instead of reading our content.
+*/
+void ORMFileData::reuseContent(const uint8_t* hash, const uint8_t* blake3) {
+  memcpy(_hash, hash, 32);
+  if (blake3) {
+    memcpy(_blake3, blake3, 32);
+    _has_blake3 = true;
+  }
+  _tier = ScanDepth::FULL;
+  _closely_examined = true;
+  _need_db_write    = true;
+  _release_parent();
+}
+
+
+/*
+* The rules could not decide on us from our dirent. We will need a stat, and
+*   the rules get a second look once we have it.
+*/
+void ORMFileData::recheckRules() {
+  _rules_pending = true;
+  _stat_pending  = true;
+}
+
+
+/*
+* Drop our reference to the parent directory. Once every child has done so,
+*   its fd is closed.
+*/
+void ORMFileData::_release_parent() {
+  if (_parent) {
+    _parent->release();
+    _parent = nullptr;
+  }
+}
+
+
+/*
+* Open our content for reading, relative to our parent if we can.
+*/
+int ORMFileData::_open_content() {
+  return (_parent) ? openat(_parent->fd, _node->name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW) : open(path(), O_RDONLY | O_CLOEXEC);
+}
+
+
+/*
+* Ask the kernel to start fetching the head of our content, so that it is
+*   cached by the time our turn to be hashed comes.
+*/
+void ORMFileData::adviseContent() {
+  int fd = _open_content();
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, (off_t) ((_fsize < STREAM_ADVISE_BYTES) ? _fsize : STREAM_ADVISE_BYTES), POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+}
+
+
+/*
+* Find where an open file's data starts on the underlying device, using FIEMAP.
+* Returns 0 and fills the offset on success. Returns -1 if the filesystem does
+*   not support FIEMAP, or if the file has no mapped extent (empty, inline, or
+*   not yet allocated).
+*/
+static int _first_extent(int fd, uint64_t* offset) {
+  // Room for the request header and exactly one extent.
+  uint64_t req_buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+  memset(req_buf, 0, sizeof(req_buf));
+  struct fiemap* fm = (struct fiemap*) req_buf;
+  fm->fm_start        = 0;
+  fm->fm_length       = FIEMAP_MAX_OFFSET;
+  fm->fm_extent_count = 1;
+  if (0 == ioctl(fd, FS_IOC_FIEMAP, fm)) {
+    if ((fm->fm_mapped_extents > 0) && !(fm->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+      *offset = fm->fm_extents[0].fe_physical;
+      return 0;
+    }
   }
   return -1;
 }
 
 
-const int HASH_BUFFER_SIZE = 1024 * 1024;
+/*
+* Find where our data starts on the underlying device.
+* Returns as _first_extent() does.
+*/
+int ORMFileData::physicalOffset(uint64_t* offset) {
+  int ret = -1;
+  int fd = _open_content();
+  if (fd >= 0) {
+    ret = _first_extent(fd, offset);
+    close(fd);
+  }
+  return ret;
+}
+
 
 /*
-* Function takes a path and a buffer as arguments. The binary is hashed and the ASCII representation is
-*   placed in the buffer. The number of bytes read is returned on success. 0 is returned on failure.
+* Time hashing a directory's files in each hash-order, on the device that holds
+*   the directory. A tree of files is made there, created in a shuffled order,
+*   so that the order readdir() gives differs from the order of their inodes and
+*   blocks. Before each pass the files are dropped from the page cache, and the
+*   pass then does what a worker does with a chunk: stat every file (and find
+*   its first extent, for extent order), sort, and read and hash them in turn.
+*   The tree is removed afterward.
+* Only a disk shows a difference. A filesystem kept in memory has no cache to
+*   drop, and no seeks to save.
+*/
+void ORMFileData::orderBenchmark(StringBuilder* output, const char* dir, unsigned int files, unsigned int kib) {
+  StringBuilder root;
+  const size_t dir_len = strlen(dir);
+  root.concatf("%s%slibrarian-order-bench", dir, ((0 < dir_len) && ('/' == dir[dir_len - 1])) ? "" : "/");
+  if (0 != mkdir((const char*) root.string(), 0700)) {
+    output->concatf("Failed to make %s: %s\n", (char*) root.string(), strerror(errno));
+    return;
+  }
+  const size_t len = (size_t) kib << 10;
+  uint8_t* buf = (uint8_t*) malloc(HASH_BUFFER_SIZE);
+  std::vector<unsigned int> shuffled(files);
+  for (unsigned int i = 0; i < files; i++) {
+    shuffled[i] = i;
+  }
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (unsigned int i = files; i > 1; i--) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    std::swap(shuffled[i - 1], shuffled[x % i]);
+  }
+  for (size_t i = 0; buf && (i < HASH_BUFFER_SIZE); i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buf[i] = (uint8_t) x;
+  }
+  unsigned int made = 0;
+  for (unsigned int i = 0; buf && (made == i) && (i < files); i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f%07u", (char*) root.string(), shuffled[i]);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    size_t written = 0;
+    while ((fd >= 0) && (written < len)) {
+      const size_t want = ((len - written) < HASH_BUFFER_SIZE) ? (len - written) : HASH_BUFFER_SIZE;
+      const ssize_t w_len = write(fd, buf, want);
+      if (w_len <= 0) {
+        break;
+      }
+      written += (size_t) w_len;
+    }
+    if (fd >= 0) {
+      made += ((written == len) && (0 == fsync(fd))) ? 1 : 0;
+      close(fd);
+    }
+  }
+  if (made < files) {
+    output->concatf("Failed to write the test files in %s.\n", (char*) root.string());
+  }
+  else {
+    struct OrderKey {
+      uint8_t  key_class;   // 0 for a physical offset, 1 for an inode number.
+      uint64_t key;
+      unsigned int idx;     // The file is named for this.
+    };
+    const double mib = (double) ((uint64_t) files * len) / (1024.0 * 1024.0);
+    output->concatf("Hashing %u files of %u KiB (%.1f MiB) in %s, from a cold cache:\n", files, kib, mib, (char*) root.string());
+    const int root_fd = open((const char*) root.string(), O_RDONLY | O_DIRECTORY);
+    const HashOrder orders[] = {HashOrder::READDIR, HashOrder::INODE, HashOrder::EXTENT};
+    for (HashOrder order : orders) {
+      for (unsigned int i = 0; i < files; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%07u", i);
+        int fd = openat(root_fd, name, O_RDONLY);
+        if (fd >= 0) {
+          posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+          close(fd);
+        }
+      }
+      struct timespec start;
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      std::vector<OrderKey> owed;
+      DIR* d = opendir((const char*) root.string());
+      struct dirent* ent;
+      while (d && (nullptr != (ent = readdir(d)))) {
+        if ('f' == ent->d_name[0]) {
+          OrderKey k;
+          k.key_class = 1;
+          k.key       = 0;
+          k.idx       = (unsigned int) strtoul(ent->d_name + 1, nullptr, 10);
+          owed.push_back(k);
+        }
+      }
+      if (d) {
+        closedir(d);
+      }
+      for (OrderKey& k : owed) {
+        struct stat64 st;
+        char name[16];
+        snprintf(name, sizeof(name), "f%07u", k.idx);
+        int fd = openat(root_fd, name, O_RDONLY);
+        if ((fd >= 0) && (0 == fstat64(fd, &st))) {
+          k.key = (uint64_t) st.st_ino;
+          uint64_t offset = 0;
+          if ((HashOrder::EXTENT == order) && (0 == _first_extent(fd, &offset))) {
+            k.key_class = 0;
+            k.key       = offset;
+          }
+        }
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+      if (HashOrder::READDIR != order) {
+        std::sort(owed.begin(), owed.end(), [](const OrderKey& a, const OrderKey& b) {
+          if (a.key_class != b.key_class) {   return (a.key_class < b.key_class);  }
+          return (a.key < b.key);
+        });
+      }
+      uint64_t total_read = 0;
+      Sha256 hasher;
+      uint8_t digest[32];
+      for (OrderKey& k : owed) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%07u", k.idx);
+        int fd = openat(root_fd, name, O_RDONLY);
+        if (fd < 0) {
+          continue;
+        }
+        hasher.init();
+        ssize_t r_len;
+        while (0 < (r_len = read(fd, buf, HASH_BUFFER_SIZE))) {
+          hasher.update(buf, (size_t) r_len);
+          total_read += (uint64_t) r_len;
+        }
+        hasher.final(digest);
+        close(fd);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      const double secs = (double) (now.tv_sec - start.tv_sec) + ((double) (now.tv_nsec - start.tv_nsec) / 1e9);
+      output->concatf("  %-8s %9.1f MiB/s %9.0f files/s", ScanOptions::hashOrderString(order), (total_read / (1024.0 * 1024.0)) / secs, owed.size() / secs);
+      if ((uint64_t) files * len != total_read) {
+        output->concatf("   read %lu of %lu bytes", (unsigned long) total_read, (unsigned long) ((uint64_t) files * len));
+      }
+      output->concat("\n");
+    }
+    if (root_fd >= 0) {
+      close(root_fd);
+    }
+  }
+  for (unsigned int i = 0; i < files; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f%07u", (char*) root.string(), i);
+    unlink(path);
+  }
+  rmdir((const char*) root.string());
+  free(buf);
+}
+
+
+/*
+* Read and hash our content with the process's SHA-256 engine, and BLAKE3, as
+*   the scan's digests ask. Each thread keeps one hasher of each, so that
+*   nothing is set up per file. A large file is streamed, so that its next
+*   buffers are read while we hash the last. If BLAKE3 is the only digest, a
+*   very large file is instead cut into subtrees, and hashed by several threads.
+* If the scan asks for chunks, a streamed file is also cut into them as it is
+*   read, by the stream's helper.
+* Returns 0 on success, -1 on failure.
 */
 int ORMFileData::_hash_file() {
+  static thread_local Sha256 hasher;
+  static thread_local Blake3 b3_hasher;
+  static thread_local Chunker chunker;
+  ScanOptions* opts = ScanScheduler::getInstance()->options();
+  const bool want_sha = (0 != (opts->digests & DIGEST_SHA256));
+  const bool want_b3  = (0 != (opts->digests & DIGEST_BLAKE3));
+  const bool want_chunks = opts->chunksFor(_fsize);
   int return_value = -1;
-  int fd = open(_path, O_RDONLY);
-  if (fd >= 0) {
-    uint8_t* self_mass   = (uint8_t*) alloca(HASH_BUFFER_SIZE);
-    if (self_mass) {
-      const EVP_MD *evp_md  = EVP_sha256();
-      if (evp_md != NULL) {
-        EVP_MD_CTX *cntxt = (EVP_MD_CTX *)(intptr_t) EVP_MD_CTX_create();
-        EVP_DigestInit(cntxt, evp_md);
-        ulong total_read = 0;
+  int fd = _open_content();
+  if ((fd >= 0) && !want_sha && want_b3 && !want_chunks && (_fsize >= BLAKE3_PARALLEL_MIN_SIZE)) {
+    if (0 == Blake3::hashFile(fd, _fsize, opts->blake3Threads(), _blake3)) {
+      return_value = 0;
+      _has_blake3  = true;
+      _closely_examined = true;
+    }
+    else {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to run the hash on %s", path());
+    }
+    close(fd);
+  }
+  else if (fd >= 0) {
+    StreamReader* stream = (_fsize >= STREAM_MIN_FILE_SIZE) ? StreamReader::forThisThread() : nullptr;
+    uint8_t* self_mass   = (stream) ? nullptr : (uint8_t*) alloca(HASH_BUFFER_SIZE);
+    if (stream || self_mass) {
+      if (want_sha) {  hasher.init();     }
+      if (want_b3) {   b3_hasher.init();  }
+      ulong total_read = 0;
+      bool  read_ok    = true;
+      if (stream) {
+        // Large files are read ahead by the stream's helper, while we hash.
+        if (want_chunks) {
+          chunker.begin(opts->chunk_avg_size);
+        }
+        stream->begin(fd, _fsize, opts->direct_io, (want_chunks) ? &chunker : nullptr);
+        size_t r_len = 0;
+        const uint8_t* buf = stream->next(&r_len);
+        while (buf) {
+          if (want_sha) {  hasher.update(buf, r_len);     }
+          if (want_b3) {   b3_hasher.update(buf, r_len);  }
+          total_read += r_len;
+          buf = stream->next(&r_len);
+        }
+        read_ok = (0 == stream->end());
+      }
+      else {
         do {
           int r_len = read(fd, self_mass, HASH_BUFFER_SIZE);
-          if ((r_len > 0) || (0 == _fsize)) {
-            EVP_DigestUpdate(cntxt, self_mass, r_len);
+          if (r_len > 0) {
+            if (want_sha) {  hasher.update(self_mass, r_len);     }
+            if (want_b3) {   b3_hasher.update(self_mass, r_len);  }
             total_read += r_len;
-            //printf("%s is %lu bytes. %d\n", _path, total_read, r_len);
           }
-          else {
-            printf("Aborting read due to zero byte return. %s\n", _path);
-            c3p_log(LOG_LEV_DEBUG, __PRETTY_FUNCTION__, "Aborting read due to zero byte return. %s\n", _path);
-            total_read = _fsize;
+          else if (0 != _fsize) {
+            c3p_log(LOG_LEV_DEBUG, __PRETTY_FUNCTION__, "Aborting read due to zero byte return. %s\n", path());
+            break;
           }
         } while (total_read < _fsize);
-        uint md_len = 32;
-        EVP_DigestFinal_ex(cntxt, _hash, &md_len);
-        EVP_MD_CTX_destroy(cntxt);
-        if (_fsize == total_read) {
-          return_value = 0;
-          _closely_examined = true;
-        }
-        else {
-          c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to run the hash on %s", _path);
+      }
+      if (want_sha) {  hasher.final(_hash);        }
+      if (want_b3) {   b3_hasher.final(_blake3);   }
+      if (read_ok && (_fsize == total_read)) {
+        return_value = 0;
+        _has_blake3  = want_b3;
+        _closely_examined = true;
+        if (stream && want_chunks) {
+          chunker.finish();
+          _chunks = new std::vector<Chunker::Chunk>(*chunker.chunks());
         }
       }
       else {
-        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to load the digest algo SHA256.");
+        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to run the hash on %s", path());
       }
     }
     else {
-      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate %lu bytes from heap in pursuit of hashing %s", _fsize, _path);
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate %lu bytes from heap in pursuit of hashing %s", _fsize, path());
     }
     close(fd);
   }
   else {
-    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open path for hashing: %s", _path);
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open path for hashing: %s", path());
   }
   return return_value;
 }
 
 
+/*
+* Read all of our content into the given buffer, for a caller that will hash it
+*   together with other files. Only for files no larger than the buffer.
+* Returns 0 if exactly size() bytes were read, -1 otherwise.
+*/
+int ORMFileData::readContent(uint8_t* buf, size_t cap) {
+  if (_fsize > cap) {
+    return -1;
+  }
+  int fd = _open_content();
+  if (fd < 0) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open path for hashing: %s", path());
+    return -1;
+  }
+  size_t total_read = 0;
+  while (total_read < _fsize) {
+    const ssize_t r_len = read(fd, buf + total_read, _fsize - total_read);
+    if (r_len <= 0) {
+      break;
+    }
+    total_read += (size_t) r_len;
+  }
+  close(fd);
+  if (_fsize != total_read) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to run the hash on %s", path());
+    return -1;
+  }
+  return 0;
+}
+
+
 /*
 *
 */
 int ORMFileData::_fill_from_stat() {
   struct stat64 statbuf;
   memset((void*) &statbuf, 0, sizeof(struct stat64));
-  int return_value = lstat64((const char*) _path, &statbuf);
+  int return_value = (_parent) ? fstatat64(_parent->fd, _node->name, &statbuf, AT_SYMLINK_NOFOLLOW) : lstat64(path(), &statbuf);
   if (0 == return_value) {
-    _is_dir  = S_ISDIR(statbuf.st_mode);
-    _is_file = S_ISREG(statbuf.st_mode);
-    _is_link = S_ISLNK(statbuf.st_mode);
-    if (_is_link || _is_file || _is_dir) {
-      _uid = statbuf.st_uid;
-      _gid = statbuf.st_gid;
-      _mtime = statbuf.st_mtime;
-      _ctime = statbuf.st_ctime;
-      _exists = true;
-      cache_uid_gid_strings();
-
-      _mode[0] = (statbuf.st_mode & S_IRUSR) ? 'r' : '-';
-      _mode[1] = (statbuf.st_mode & S_IWUSR) ? 'w' : '-';
-      _mode[2] = (statbuf.st_mode & S_IXUSR) ? 'x' : '-';
-      _mode[3] = (statbuf.st_mode & S_IRGRP) ? 'r' : '-';
-      _mode[4] = (statbuf.st_mode & S_IWGRP) ? 'w' : '-';
-      _mode[5] = (statbuf.st_mode & S_IXGRP) ? 'x' : '-';
-      _mode[6] = (statbuf.st_mode & S_IROTH) ? 'r' : '-';
-      _mode[7] = (statbuf.st_mode & S_IWOTH) ? 'w' : '-';
-      _mode[8] = (statbuf.st_mode & S_IXOTH) ? 'x' : '-';
-
-      if (_is_file) {
-        _fsize = statbuf.st_size;
-        //c3p_log(LOG_LEV_INFO, "Path is a file with size %lu: %s", _fsize, _path);
-      }
-      else if (_is_dir) {
-        //c3p_log(LOG_LEV_INFO, "Path is a directory: %s", _path);
-      }
-      else {
-        //c3p_log(LOG_LEV_INFO, "Path is a link: %s", _path);
-      }
+    applyStat(&statbuf);
+  }
+  else {
+    statFailed(errno);
+  }
+  return return_value;
+}
+
+
+/*
+* Where an asynchronous stat of this object should be aimed. The path is
+*   relative to dirfd, which may be AT_FDCWD, and stays valid for as long as we
+*   do.
+* Returns 0 on success, or -1 if we have neither a parent handle nor a name
+*   that is a whole path. Such objects must be stat'd synchronously.
+*/
+int ORMFileData::statTarget(int* dirfd, const char** path) {
+  if (_parent) {
+    *dirfd = _parent->fd;
+    *path  = _node->name;
+    return 0;
+  }
+  if (nullptr == _node->parent) {
+    *dirfd = AT_FDCWD;
+    *path  = _node->name;
+    return 0;
+  }
+  return -1;
+}
+
+
+/*
+* Take on the metadata from a completed stat, however it was issued.
+*/
+int ORMFileData::applyStat(struct stat64* statbuf) {
+  _stat_pending = false;
+  _tier    = ScanDepth::NONE;
+  _is_dir  = S_ISDIR(statbuf->st_mode);
+  _is_file = S_ISREG(statbuf->st_mode);
+  _is_link = S_ISLNK(statbuf->st_mode);
+  if (_is_link || _is_file || _is_dir) {
+    _uid = statbuf->st_uid;
+    _gid = statbuf->st_gid;
+    _mtime = statbuf->st_mtime;
+    _ctime = statbuf->st_ctime;
+    _mtime_ns = ((int64_t) statbuf->st_mtim.tv_sec * 1000000000LL) + statbuf->st_mtim.tv_nsec;
+    _ctime_ns = ((int64_t) statbuf->st_ctim.tv_sec * 1000000000LL) + statbuf->st_ctim.tv_nsec;
+    _ino    = statbuf->st_ino;
+    _dev    = statbuf->st_dev;
+    _nlink  = statbuf->st_nlink;
+    _exists = true;
+    _tier   = ScanDepth::METADATA;
+    cache_uid_gid_strings();
+
+    _mode[0] = (statbuf->st_mode & S_IRUSR) ? 'r' : '-';
+    _mode[1] = (statbuf->st_mode & S_IWUSR) ? 'w' : '-';
+    _mode[2] = (statbuf->st_mode & S_IXUSR) ? 'x' : '-';
+    _mode[3] = (statbuf->st_mode & S_IRGRP) ? 'r' : '-';
+    _mode[4] = (statbuf->st_mode & S_IWGRP) ? 'w' : '-';
+    _mode[5] = (statbuf->st_mode & S_IXGRP) ? 'x' : '-';
+    _mode[6] = (statbuf->st_mode & S_IROTH) ? 'r' : '-';
+    _mode[7] = (statbuf->st_mode & S_IWOTH) ? 'w' : '-';
+    _mode[8] = (statbuf->st_mode & S_IXOTH) ? 'x' : '-';
+
+    if (_is_file) {
+      _fsize = statbuf->st_size;
+      //c3p_log(LOG_LEV_INFO, "Path is a file with size %lu: %s", _fsize, path());
+    }
+    else if (_is_dir) {
+      //c3p_log(LOG_LEV_INFO, "Path is a directory: %s", path());
     }
     else {
-      // TODO: Some unhandled filesystem object.
-      c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "Unhandled filesystem object at path: %s", _path);
+      //c3p_log(LOG_LEV_INFO, "Path is a link: %s", path());
     }
+    return 0;
   }
-  else {
-    perror("stat");
-    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to lstat path: %s", _path);
-  }
+  // TODO: Some unhandled filesystem object.
+  c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "Unhandled filesystem object at path: %s", path());
+  return -1;
+}
 
-  return return_value;
+
+void ORMFileData::statFailed(int err) {
+  _stat_pending = false;
+  c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to lstat path: %s (%s)", path(), strerror(err));
 }
 
 
@@ -312,42 +799,100 @@ int ORMFileData::_fill_from_stat() {
 *
 */
 long ORMFileData::dive(FSOCounts* fso_counts, LinkedList<StringBuilder*>* log) {
-  DIR *dir;
-  struct dirent *ent;
-  int files  = 0;
-  dir = opendir(_path);
-  if (dir) {
-    LinkedList<ORMFileData*>* fso_list = new LinkedList<ORMFileData*>();
-
-    while ((ent = readdir(dir)) != nullptr) {
-      if (strcasestr(ent->d_name, "..") && (strlen(ent->d_name) == 2)) {
-        // Ignore .. entry
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  DirReader reader;
+  ScanDirHandle* dh = nullptr;
+  const char* name = nullptr;
+  uint8_t d_type   = DT_UNKNOWN;
+  long files = 0;
+  int open_ret = -1;
+  if (sched->options()->dirfd_relative) {
+    dh = ScanDirHandle::open(_parent, _node->name, (_parent) ? nullptr : path());
+    open_ret = (dh) ? reader.attach(dh->fd) : -1;
+  }
+  else {
+    open_ret = reader.open(path());
+  }
+  if (0 == open_ret) {
+    const ScanDepth depth = sched->options()->depth;
+    // Children resolve against our fd, unless holding it would break the budget.
+    ScanDirHandle* child_dh = (dh && ScanDirHandle::withinBudget()) ? dh : nullptr;
+    // Rules are checked against each dirent before anything is made for it.
+    //   Anchored rules also need our path relative to the root, which is
+    //   built once here, with room to append each name in turn.
+    ScanRules* rules = &sched->options()->rules;
+    const bool use_rules = !rules->empty();
+    char*  rel     = nullptr;
+    size_t rel_len = 0;
+    if (use_rules && rules->needsRelativePath()) {
+      const char* dir_rel = PathArena::relativePath(_node);
+      rel_len = strlen(dir_rel);
+      rel = (char*) malloc(rel_len + NAME_MAX + 2);
+      if (rel) {
+        memcpy(rel, dir_rel, rel_len);
+        if (rel_len > 0) {
+          rel[rel_len++] = '/';
+        }
       }
-      else if (strcasestr(ent->d_name, ".") && (strlen(ent->d_name) == 1)) {
-        // Ignore . entry
+    }
+    ScanChunk* chunk = new ScanChunk();
+    int r_ret = reader.next(&name, &d_type);
+    while (1 == r_ret) {
+      const size_t name_len = strlen(name);
+      RuleVerdict verdict = RuleVerdict::INCLUDE;
+      if (use_rules) {
+        if (rel && (name_len <= NAME_MAX)) {
+          memcpy(rel + rel_len, name, name_len + 1);
+        }
+        verdict = rules->evaluate(rel, name, d_type);
+      }
+      if (RuleVerdict::EXCLUDE == verdict) {
+        fso_counts->excluded++;
       }
       else {
-        StringBuilder temp_path(_path);
-        temp_path.concatf("%s%s", ('/' == *(_path+strlen(_path)-1)) ? "" : "/", ent->d_name);
-        ORMFileData* n_fd = new ORMFileData(_dh_ver, (char*) temp_path.string());
-        if (n_fd) {
-          fso_list->insertAtHead(n_fd);
-          fso_counts->tally(n_fd);
+        ORMFileData* n_fd = new ORMFileData(_dh_ver, _node, name, name_len, d_type, child_dh, depth);
+        if (n_fd && n_fd->pathNode()) {
+          if (RuleVerdict::UNDECIDED == verdict) {
+            n_fd->recheckRules();
+          }
+          files++;
+          if (chunk->add(n_fd)) {
+            // Hand full chunks off while we keep reading. If that leaves too
+            //   much unexamined, we may do some of the examining first.
+            sched->submit(chunk, _dev, _node);
+            chunk = new ScanChunk();
+            sched->throttleTraversal();
+          }
         }
         else {
           c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate from heap for new ORMFileData.");
+          delete n_fd;
         }
       }
+      r_ret = reader.next(&name, &d_type);
+    }
+    reader.close();
+    if (rel) {
+      free(rel);
+    }
+    if (chunk->count > 0) {
+      sched->submit(chunk, _dev, _node);
+    }
+    else {
+      delete chunk;
+    }
+    if (0 > r_ret) {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Error while reading DIR %s", path());
     }
-    closedir(dir);
     _closely_examined = true;
-    _disk_thread_queues.insert(fso_list);
     //fso_counts->progressPrint();
   }
-  else{
-    printf("Failed\n");
-    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open DIR %s", _path);
-    return -1;
+  else {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open DIR %s", path());
+    files = -1;
+  }
+  if (dh) {
+    dh->release();
   }
   return files;
 }
@@ -386,7 +931,7 @@ void ORMFileData::printDebug(StringBuilder* output) {
   printBinStringToBuffer(_hash, 32, h_buf);
   output->concatf("%s ", h_buf);
   output->concatf("%9lu  ", _fsize);
-  output->concatf("%s", _path);
+  output->concatf("%s", path());
 }
 
 
@@ -405,7 +950,7 @@ void ORMFileData::generateInsertQuery(StringBuilder* output) {
 void ORMFileData::generateInsertQuery(StringBuilder* baseline_string, StringBuilder* cycled_string) {
   if (baseline_string) {
     // If this was provided, we give the baseline insert string.
-    baseline_string->concat("INSERT INTO `file_meta` (`id_dh_snapshot`, `ctime`, `mtime`, `size`, `userflags`, `isdir`, `isfile`, `islink`, `examined`, `rel_path`, `sha256`, `owner`, `group`, `perms`) VALUES ");
+    baseline_string->concat("INSERT INTO `file_meta` (`id_dh_snapshot`, `ctime`, `mtime`, `size`, `userflags`, `isdir`, `isfile`, `islink`, `examined`, `rel_path`, `sha256`, `owner`, `group`, `perms`, `st_dev`, `st_ino`, `nlink`, `hardlink`, `ctime_ns`, `mtime_ns`, `blake3`) VALUES ");
   }
   if (cycled_string) {
     // If this was provided, we give the string specific for this instance.
@@ -425,14 +970,75 @@ void ORMFileData::generateInsertQuery(StringBuilder* baseline_string, StringBuil
     cycled_string->concatf("'%s',", h_buf);
     memset(h_buf, 0, 65);
 
-    cycled_string->concatf("'%lu','%d','%d','%d','%d','%d','", _fsize, 0, _is_dir?1:0, _is_file?1:0, _is_link?1:0, _closely_examined?1:0);
+    cycled_string->concatf("'%lu','%d','%d','%d','%d','%d','", _fsize, 0, _is_dir?1:0, _is_file?1:0, _is_link?1:0, (int) _tier);
 
     LibrarianDB* db = LibrarianDB::getInstance();
-    db->escape_string(_path, cycled_string);
+    db->escape_string(path(), cycled_string);
 
     printBinStringToBuffer(_hash, 32, h_buf);
-    cycled_string->concatf("','%s','%s','%s','%s')", h_buf, uid_str_table[_uid], gid_str_table[_gid], _mode);
+    if (_exists) {
+      std::lock_guard<std::mutex> lock(id_str_mutex);
+      cycled_string->concatf("','%s','%s','%s','%s',", h_buf, uid_str_table[_uid], gid_str_table[_gid], _mode);
+    }
+    else {
+      // Never stat'd, so there is no ownership or mode to report.
+      cycled_string->concatf("','%s','','','',", h_buf);
+    }
+    cycled_string->concatf("'%lu','%lu','%lu','%d',", (unsigned long) _dev, (unsigned long) _ino, (unsigned long) _nlink, _link_reused?1:0);
+    cycled_string->concatf("'%lld','%lld',", (long long) _ctime_ns, (long long) _mtime_ns);
+    memset(h_buf, 0, 65);
+    if (_has_blake3) {
+      printBinStringToBuffer(_blake3, 32, h_buf);
+    }
+    cycled_string->concatf("'%s')", h_buf);
+  }
+}
+
+
+/*
+* Record our chunks, once our row is written. Each distinct chunk gets one row
+*   in `chunk`, keyed by its digest, and each of ours gets a row in `file_chunk`
+*   that places it in our content.
+* Returns 0 on success, or if we have no chunks. -1 on failure.
+*/
+int ORMFileData::writeChunks(LibrarianDB* db) {
+  if ((nullptr == _chunks) || _chunks->empty()) {
+    return 0;
+  }
+  StringBuilder esc_path;
+  db->escape_string(path(), &esc_path);
+  StringBuilder chunk_q;
+  StringBuilder file_q;
+  int ret = 0;
+  for (size_t i = 0; i < _chunks->size(); i++) {
+    const Chunker::Chunk* c = &_chunks->at(i);
+    char h_buf[65];
+    memset(h_buf, 0, 65);
+    printBinStringToBuffer((uint8_t*) c->digest, 32, h_buf);
+    if (0 == chunk_q.length()) {
+      chunk_q.concat("INSERT IGNORE INTO `chunk` (`digest`, `size`) VALUES ");
+      file_q.concat("INSERT INTO `file_chunk` (`id_dh_snapshot`, `rel_path`, `ordinal`, `offset`, `size`, `digest`) VALUES ");
+    }
+    else {
+      chunk_q.concat(",");
+      file_q.concat(",");
+    }
+    chunk_q.concatf("('%s','%u')", h_buf, c->size);
+    file_q.concatf("('%d','%s','%u','%lu','%u','%s')", _dh_ver, (char*) esc_path.string(), (unsigned int) i, (unsigned long) c->offset, c->size, h_buf);
+    if (((unsigned int) file_q.length() >= CHUNK_QUERY_LENGTH) || ((i + 1) == _chunks->size())) {
+      chunk_q.concat(";");
+      file_q.concat(";");
+      if ((1 != db->r_query(chunk_q.string())) || (1 != db->r_query(file_q.string()))) {
+        ret = -1;
+      }
+      chunk_q.clear();
+      file_q.clear();
+    }
+  }
+  if (0 != ret) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save the chunks of %s", path());
   }
+  return ret;
 }
 
 
@@ -440,17 +1046,18 @@ void ORMFileData::generateInsertQuery(StringBuilder* baseline_string, StringBuil
 *
 */
 void ORMFileData::cache_uid_gid_strings() {
+  std::lock_guard<std::mutex> lock(id_str_mutex);
   if (!gid_str_table[_gid]) {
     struct group* grp_s  = getgrgid(_gid);
     if (grp_s) {
-      gid_str_table[_gid] = grp_s->gr_name;
+      gid_str_table[_gid] = strdup(grp_s->gr_name);
       c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Added group %s", grp_s->gr_name);
     }
   }
   if (!uid_str_table[_uid]) {
     struct passwd* psw_s = getpwuid(_uid);
     if (psw_s) {
-      uid_str_table[_uid] = psw_s->pw_name;
+      uid_str_table[_uid] = strdup(psw_s->pw_name);
       c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Added user %s", psw_s->pw_name);
     }
   }
@@ -1,4 +1,7 @@
+#include <atomic>
+#include <sys/stat.h>
 #include "MySQLConnector/MySQLConnector.h"
+#include "ScanEngine/ScanEngine.h"
 #include "LightLinkedList.h"
 #include "PriorityQueue.h"
 #include "StringBuilder.h"
@@ -24,9 +27,10 @@ class FSOCounts {
     void progressPrint();
 
 
-    unsigned long dirs  = 0;
-    unsigned long files = 0;
-    unsigned long links = 0;
+    std::atomic<unsigned long> dirs{0};
+    std::atomic<unsigned long> files{0};
+    std::atomic<unsigned long> links{0};
+    std::atomic<unsigned long> excluded{0};   // Entries dropped by the catalog's rules.
 
 
   private:
@@ -98,14 +102,28 @@ class ORMDatahiveVersion : public ORM {
     inline int countDirectories() {   return _fso_totals.dirs;     };
     inline int countFiles() {         return _fso_totals.files;    };
     inline int countLinks() {         return _fso_totals.links;    };
+    inline int countExcluded() {      return _fso_totals.excluded; };
     inline bool dirty() {             return !(_saved_to_db);      };
     inline bool scanComplete() {      return _scan_complete;       };
     inline void markClean() {         _saved_to_db = true;    };
-
-    int scan();
+    inline ScanOptions* scanOptions() {  return &_scan_opts;  };
+    inline int32_t id() {             return _dh_ver;              };
+
+    static ORMDatahiveVersion* load(uint32_t catalog);
+    static void stopWatching();
+
+    int scan(ScanDepth);
+    int resume();
+    int watch();
+    int rescan(const char* subtree);
+    int scanDupes();
+    int verify();
     long commit();
     void setTag(StringBuilder*);
     void setNotes(StringBuilder*);
+    int  addRule(const char*);
+    int  clearRules();
+    int  copyRules(uint32_t catalog);
     void printDebug(StringBuilder*);
 
 
@@ -115,7 +133,6 @@ class ORMDatahiveVersion : public ORM {
     char*          _path      = nullptr;
     char*          _notes     = nullptr;
     LibrarianDB*   _db        = nullptr;
-    ORMFileData*   _root_obj  = nullptr;
     LinkedList<StringBuilder*> _logs;
     time_t _catalog_start_time = 0;
     time_t _catalog_stop_time  = 0;
@@ -124,6 +141,7 @@ class ORMDatahiveVersion : public ORM {
     time_t _scan_duration      = 0;
     time_t _copy_duration      = 0;
     FSOCounts _fso_totals;
+    ScanOptions _scan_opts;
 
     bool    _saved_to_db    = false;
     bool    _scan_complete  = false;
@@ -133,6 +151,20 @@ class ORMDatahiveVersion : public ORM {
     void _mark_scan_complete();
     void _mark_copy_started();
     void _mark_copy_complete();
+    int  _save_rule(unsigned int ordinal);
+    int  _read_rules(uint32_t catalog, bool save);
+    int  _run(std::vector<ORMFileData*>* starts, dev_t root_dev);
+    int  _checkpoint(std::vector<PathNode*>* frontier, bool complete);
+    int  _load_baseline(BaselineTable*);
+    int  _save_dupes(DupeFinder*);
+    int  _load_verify_rows(VerifyTable*);
+    long _report_missing(VerifyTable*);
+    int  _scan_finished();
+    int  _read_totals(unsigned long* totals);
+    int  _count_rows(StringBuilder* cond, unsigned long* counts);
+    int  _write_totals(unsigned long* totals, const unsigned long* old_counts, const unsigned long* new_counts);
+    int  _apply_watch_batch(std::vector<WatchEvent>*, dev_t root_dev);
+    bool _excluded_by_rules(const char* rel_path, struct stat64*);
 };
 
 
@@ -142,47 +174,99 @@ class ORMDatahiveVersion : public ORM {
 class ORMFileData : public ORM {
   public:
     ORMFileData(uint32_t, char*);
+    ORMFileData(uint32_t, PathNode* dir, const char* name, size_t name_len, uint8_t d_type, ScanDirHandle*, ScanDepth);
+    ORMFileData(uint32_t, PathNode* node, bool resumed);
     virtual ~ORMFileData();
 
+    // Entries come from per-thread slabs, and are freed a slab at a time.
+    static void* operator new(size_t) noexcept;
+    static void  operator delete(void*);
+    static size_t slabBytesHeld();
+    static void orderBenchmark(StringBuilder*, const char* dir, unsigned int files, unsigned int kib);
+
     void generateInsertQuery(StringBuilder*);
     void generateInsertQuery(StringBuilder*, StringBuilder*);
 
     inline bool exists() {        return _exists;            };
+    inline ulong size() {         return _fsize;             };
+    inline PathNode* pathNode() {  return _node;            };
+    inline const char* path() {     return PathArena::fullPath(_node);  };  // Valid until this thread builds another.
     inline bool isDirectory() {   return _is_dir;            };
     inline bool isFile() {        return _is_file;           };
     inline bool isLink() {        return _is_link;           };
     inline bool dirty() {         return _need_db_write;     };
     inline void markClean() {     _need_db_write = false;    };
+    inline void skipDive() {      _skip_dive = true;         };   // A directory that gets a row, but is not read.
 
     inline bool closelyExamined() {  return _closely_examined;  };
+    inline bool statPending() {      return _stat_pending;      };
+    inline ScanDepth tier() {        return _tier;              };
+    inline ino_t inode() {           return _ino;               };
+    inline dev_t device() {          return _dev;               };
+    inline nlink_t linkCount() {     return _nlink;             };
+    inline const uint8_t* digest() { return _hash;              };
+    inline const uint8_t* blake3() { return (_has_blake3) ? _blake3 : nullptr;  };
+    inline int64_t mtimeNs() {       return _mtime_ns;          };
+    inline int64_t ctimeNs() {       return _ctime_ns;          };
+    inline std::vector<Chunker::Chunk>* chunks() {  return _chunks;  };
+    inline size_t footprint() {      return (sizeof(ORMFileData) + sizeof(PathNode) + ((_node) ? (_node->len + 1) : 0) + ((_chunks) ? (_chunks->capacity() * sizeof(Chunker::Chunk)) : 0));  };  // Bytes we hold, for budgets.
+
+    int  statTarget(int* dirfd, const char** path);
+    int  applyStat(struct stat64*);
+    void statFailed(int err);
 
     int closelyExamine(FSOCounts*, LinkedList<StringBuilder*>*);
+    int examineMetadata(FSOCounts*, LinkedList<StringBuilder*>*);
+    int examineContent();
+    int readContent(uint8_t* buf, size_t cap);
+    void acceptContent(const uint8_t* hash, const uint8_t* blake3);
+    void adoptContent(const uint8_t* hash, const uint8_t* blake3, bool ok);
+    void reuseContent(const uint8_t* hash, const uint8_t* blake3);
+    void recheckRules();
+    int physicalOffset(uint64_t*);
+    void adviseContent();
+    int  writeChunks(LibrarianDB*);
     void printDebug(StringBuilder*);
 
-    static void ship_db_thread(FSOCounts*, LinkedList<StringBuilder*>*);
-
 
   private:
     const uint32_t _dh_ver;
     uint8_t _hash[32];
+    uint8_t _blake3[32];
     char    _mode[12];
-    char*   _path    = nullptr;
+    PathNode* _node  = nullptr;        // Our name, and the way back to the root.
+    std::vector<Chunker::Chunk>* _chunks = nullptr;  // Our content-defined chunks, if we were cut into any.
+    ScanDirHandle* _parent = nullptr;  // Our directory, if we resolve relative to it.
     ulong   _fsize   = 0;
     uid_t   _uid     = 0;
     gid_t   _gid     = 0;
-    time_t  _ctime;
-    time_t  _mtime;
+    ino_t   _ino     = 0;
+    dev_t   _dev     = 0;
+    nlink_t _nlink   = 0;
+    time_t  _ctime   = 0;
+    time_t  _mtime   = 0;
+    int64_t _ctime_ns = 0;            // The same times, to the nanosecond.
+    int64_t _mtime_ns = 0;
     bool    _exists  = false;
     bool    _is_dir  = false;
     bool    _is_file = false;
     bool    _is_link = false;
     bool    _closely_examined = false;
     bool    _need_db_write    = false;
+    bool    _stat_pending     = false;
+    bool    _link_reused      = false;  // Our digest came from another link to our inode.
+    bool    _has_blake3       = false;  // _blake3 holds our content's BLAKE3.
+    bool    _rules_pending    = false;  // The rules need our stat to decide on us.
+    bool    _resumed          = false;  // A directory left unread by a checkpoint. Our row is already written.
+    bool    _skip_dive        = false;
+    ScanDepth _tier = ScanDepth::NONE;  // How far examination got.
 
 
     int _hash_file();
+    int _open_content();
     long dive(FSOCounts*, LinkedList<StringBuilder*>*);
     int _fill_from_stat();
+    void _release_parent();
     void cache_uid_gid_strings();
     long _write_files_to_database();
 };
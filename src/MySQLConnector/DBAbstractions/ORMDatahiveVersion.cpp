@@ -7,8 +7,10 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "ORM.h"
+#include "ScanEngine/ScanEngine.h"
 #include "LightLinkedList.h"
 #include "PriorityQueue.h"
 #include "StringBuilder.h"
@@ -19,6 +21,94 @@ extern char* printBinStringToBuffer(unsigned char *str, int len, char *buffer);
 
 using namespace std;
 
+const unsigned int CHECKPOINT_POLL_MS      = 1000;   // How often a running scan looks at the clock.
+const unsigned int BATCH_QUERY_LENGTH      = 40000;  // Upper bound on a query that batches many paths.
+const unsigned int BASELINE_PAGE_ROWS      = 100000; // Baseline rows fetched per query.
+const unsigned int WATCH_POLL_MS           = 250;    // Longest a watch waits for events before looking at its queue.
+
+static std::atomic<bool> _watch_stop(false);
+
+
+static uint64_t _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000) + (uint64_t) (ts.tv_nsec / 1000000);
+}
+
+
+/*
+* Append a condition that matches the row of the given path, and if subtree is
+*   set, the rows beneath it too. The LIKE pattern is anchored at the start, so
+*   that the `snapshot_path` index can serve it.
+*/
+static void _path_condition(LibrarianDB* db, StringBuilder* q, const char* full, bool subtree) {
+  q->concat("(`rel_path` = '");
+  db->escape_string(full, q);
+  q->concat("'");
+  if (subtree) {
+    StringBuilder pattern;
+    for (const char* c = full; '\0' != *c; c++) {
+      if (('\\' == *c) || ('%' == *c) || ('_' == *c)) {
+        pattern.concat('\\');
+      }
+      pattern.concat(*c);
+    }
+    if ((0 == pattern.length()) || ('/' != full[strlen(full) - 1])) {
+      pattern.concat('/');
+    }
+    pattern.concat('%');
+    q->concat(" OR `rel_path` LIKE '");
+    db->escape_string((char*) pattern.string(), q);
+    q->concat("'");
+  }
+  q->concat(")");
+}
+
+
+/*
+* Delete a catalog's rows that meet a condition on `rel_path`, and the chunks
+*   recorded for them.
+* Returns 0 on success, -1 on failure.
+*/
+static int _delete_rows(LibrarianDB* db, int32_t dh_ver, StringBuilder* cond) {
+  static const char* TABLES[2] = { "file_chunk", "file_meta" };
+  for (unsigned int i = 0; i < 2; i++) {
+    StringBuilder q;
+    q.concatf("DELETE FROM `%s` WHERE `id_dh_snapshot` = '%d' AND ", TABLES[i], dh_ver);
+    q.concat(cond);
+    q.concat(";");
+    if (1 != db->r_query(q.string())) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+* Parse a digest as written to the `sha256` column.
+* Returns 0 on success, -1 if it is not 64 hex digits.
+*/
+static int _hex_to_digest(const char* hex, uint8_t* out) {
+  if ((nullptr == hex) || (64 != strlen(hex))) {
+    return -1;
+  }
+  for (unsigned int i = 0; i < 32; i++) {
+    uint8_t v = 0;
+    for (unsigned int n = 0; n < 2; n++) {
+      const char c = hex[(i << 1) + n];
+      v <<= 4;
+      if ((c >= '0') && (c <= '9')) {       v |= (uint8_t) (c - '0');         }
+      else if ((c >= 'a') && (c <= 'f')) {  v |= (uint8_t) (c - 'a' + 10);    }
+      else if ((c >= 'A') && (c <= 'F')) {  v |= (uint8_t) (c - 'A' + 10);    }
+      else {                                return -1;                        }
+    }
+    out[i] = v;
+  }
+  return 0;
+}
+
+
 
 
 ORMDatahiveVersion::ORMDatahiveVersion(char* p) {
@@ -56,11 +146,6 @@ ORMDatahiveVersion::~ORMDatahiveVersion() {
   while (_logs.size() > 0) {
     delete _logs.remove();
   }
-
-  if (_root_obj) {
-    delete _root_obj;
-    _root_obj = nullptr;
-  }
   if (_path) {
     free(_path);
     _path = nullptr;
@@ -130,6 +215,13 @@ void ORMDatahiveVersion::printDebug(StringBuilder* output) {
     output->concatf("    Directories: %d\n", countDirectories());
     output->concatf("    Files:       %d\n", countFiles());
     output->concatf("    Links:       %d\n", countLinks());
+    if (0 < countExcluded()) {
+      output->concatf("    Excluded:    %d\n", countExcluded());
+    }
+  }
+  if (!_scan_opts.rules.empty()) {
+    output->concat("  Rules:\n");
+    _scan_opts.rules.printDebug(output);
   }
   if (0 != _copy_start_time) {
     memset(buf0, 0, 65);
@@ -167,43 +259,1069 @@ void ORMDatahiveVersion::generateInsertQuery(StringBuilder* baseline_string, Str
   LibrarianDB* db = LibrarianDB::getInstance();
   if (baseline_string) {
     // If this was provided, we give the baseline insert string.
-    baseline_string->concat("INSERT INTO `datahive_version` (`tag`, `count_files`, `count_links`, `count_directories`, `rel_path`, `notes`) VALUES ");
+    baseline_string->concat("INSERT INTO `datahive_version` (`tag`, `count_files`, `count_links`, `count_directories`, `rel_path`, `notes`, `digests`) VALUES ");
   }
   if (cycled_string) {
     cycled_string->concat("('");
     db->escape_string((_tag) ? _tag : ((char*) "The-Tagless"), cycled_string);
-    cycled_string->concatf("','%d','%d','%d','", _fso_totals.files, _fso_totals.links, _fso_totals.dirs);
+    cycled_string->concatf("','%d','%d','%d','", countFiles(), countLinks(), countDirectories());
     db->escape_string(_path, cycled_string);
     cycled_string->concat("','");
     db->escape_string((_notes) ? _notes : ((char*) "No notes"), cycled_string);
-    cycled_string->concat("')");
+    cycled_string->concatf("','%u')", (unsigned int) _scan_opts.digests);
   }
 }
 
 
 /*
-*
+* Scan the catalog's root to the given depth. Blocks until every row has been
+*   written, or the scan stops at a checkpoint.
+* Returns 0 if the scan finished, 1 if it stopped at a checkpoint, or -1 on
+*   failure.
 */
-int ORMDatahiveVersion::scan() {
-  int ret    = -1;
+int ORMDatahiveVersion::scan(ScanDepth depth) {
+  _scan_opts.depth = depth;
+  if (_saved_to_db) {
+    // The digests may have been picked after the catalog was saved.
+    StringBuilder q;
+    q.concatf("UPDATE `datahive_version` SET `digests` = '%u' WHERE `id` = '%d';", (unsigned int) _scan_opts.digests, _dh_ver);
+    _db->r_query(q.string());
+  }
+  ORMFileData* root_obj = new ORMFileData(_dh_ver, _path);
+  if (nullptr == root_obj) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to scan.");
+    return -1;
+  }
+  std::vector<ORMFileData*> starts(1, root_obj);
+  return _run(&starts, root_obj->device());
+}
+
+
+/*
+* Continue a scan of this catalog from its last checkpoint. Rows written after
+*   that checkpoint are discarded first, since whatever they came from will be
+*   read again. A catalog with no checkpoint is scanned again from the root.
+* A scan with rows that failed to reach the database is never marked complete.
+* Returns as scan() does.
+*/
+int ORMDatahiveVersion::resume() {
+  StringBuilder q;
+  q.concatf("SELECT `depth`, `last_row_id`, `count_files`, `count_links`, `count_directories`, `count_excluded`, `complete` FROM `scan_checkpoint` WHERE `id_dh_snapshot` = '%d';", _dh_ver);
+  if (1 != _db->r_query(q.string())) {
+    return -1;
+  }
+  bool found = false;
+  bool complete = false;
+  unsigned long last_row_id = 0;
+  if (nullptr != _db->result) {
+    MYSQL_ROW row = mysql_fetch_row(_db->result);
+    if (row) {
+      found = true;
+      _scan_opts.depth     = (ScanDepth) atoi(row[0]);
+      last_row_id          = strtoul(row[1], nullptr, 10);
+      _fso_totals.files    = strtoul(row[2], nullptr, 10);
+      _fso_totals.links    = strtoul(row[3], nullptr, 10);
+      _fso_totals.dirs     = strtoul(row[4], nullptr, 10);
+      _fso_totals.excluded = strtoul(row[5], nullptr, 10);
+      complete             = (0 != atoi(row[6]));
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
+  }
+  if (complete) {
+    printf("Catalog %d was already scanned to the end.\n", _dh_ver);
+    return 0;
+  }
+
+  q.clear();
+  q.concatf("DELETE FROM `file_meta` WHERE `id_dh_snapshot` = '%d' AND `id` > '%lu';", _dh_ver, last_row_id);
+  bool deleted = (1 == _db->r_query(q.string()));
+  q.clear();
+  // Chunks are written just after their file's row, so any left without one went with it.
+  q.concatf("DELETE c FROM `file_chunk` c LEFT JOIN `file_meta` m ON m.`id_dh_snapshot` = c.`id_dh_snapshot` AND m.`rel_path` = c.`rel_path` WHERE c.`id_dh_snapshot` = '%d' AND m.`id` IS NULL;", _dh_ver);
+  deleted = deleted && (1 == _db->r_query(q.string()));
+  if (!deleted) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to discard the rows written after the last checkpoint.");
+    return -1;
+  }
+  if (!found) {
+    c3p_log(LOG_LEV_NOTICE, __PRETTY_FUNCTION__, "Catalog %d has no checkpoint. Starting over from the root.", _dh_ver);
+    return scan(_scan_opts.depth);
+  }
+
+  std::vector<ORMFileData*> starts;
+  q.clear();
+  q.concatf("SELECT `rel_path` FROM `scan_frontier` WHERE `id_dh_snapshot` = '%d' ORDER BY `id` ASC;", _dh_ver);
+  if ((1 == _db->r_query(q.string())) && (nullptr != _db->result)) {
+    PathNode* root = PathArena::make(nullptr, _path, strlen(_path));
+    MYSQL_ROW row;
+    while (root && (row = mysql_fetch_row(_db->result))) {
+      PathNode* node = PathArena::makeRelative(root, (row[0]) ? row[0] : "");
+      ORMFileData* obj = (node) ? new ORMFileData(_dh_ver, node, true) : nullptr;
+      if (obj) {
+        starts.push_back(obj);
+      }
+      else {
+        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate for a directory to resume.");
+        PathArena::release(node);
+      }
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
+    PathArena::release(root);
+  }
+  else {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to read the frontier of catalog %d.", _dh_ver);
+    return -1;
+  }
+  struct stat64 root_stat;
+  memset((void*) &root_stat, 0, sizeof(struct stat64));
+  lstat64(_path, &root_stat);
+  printf("Resuming catalog %d with %u directories left to read.\n", _dh_ver, (unsigned int) starts.size());
+  return _run(&starts, root_stat.st_dev);
+}
+
+
+/*
+* Run a scan from the given starting objects until it finishes, or until its
+*   time box closes. The pipeline takes the objects.
+* Saved catalogs take a checkpoint every so often, and again at the end. To
+*   take one, dives are paused and the pipeline is drained. What remains is a
+*   set of directories that have rows, but have not been read. They are saved,
+*   and then submitted to carry on.
+* A scan with rows that failed to reach the database is never marked complete.
+* Returns as scan() does.
+*/
+int ORMDatahiveVersion::_run(std::vector<ORMFileData*>* starts, dev_t root_dev) {
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  if ((0 != sched->start()) || (0 != sched->beginScan(&_fso_totals, &_logs, &_scan_opts, root_dev))) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to start the scan.");
+    for (ORMFileData* obj : *starts) {
+      delete obj;
+    }
+    starts->clear();
+    return -1;
+  }
+  if ((0 != _scan_opts.baseline) && (ScanDepth::FULL == _scan_opts.depth)) {
+    _load_baseline(sched->baseline());
+  }
   _mark_scan_started();
-  ORMFileData::ship_db_thread(&_fso_totals, &_logs);
-  printf("Scan started for path %s\n\n\n\n\n", _path);
+  printf("Scan (%s) started for path %s\n", ScanOptions::depthString(_scan_opts.depth), _path);
+  for (ORMFileData* obj : *starts) {
+    sched->submit(obj);      // The pipeline owns them from here.
+  }
+  starts->clear();
 
-  _root_obj = new ORMFileData(_dh_ver, _path);
-  if (_root_obj) {
-    _fso_totals.tally(_root_obj);  // Including the root.
-    _root_obj->closelyExamine(&_fso_totals, &_logs);
+  time_t deadline = 0;
+  if (0 != _scan_opts.time_box_secs) {
+    if (_saved_to_db) {
+      deadline = _catalog_start_time + _scan_opts.time_box_secs;
+    }
+    else {
+      c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "The catalog is not saved, so it cannot be checkpointed. Ignoring the time box.");
+    }
+  }
+  time_t last_checkpoint = _catalog_start_time;
+  int ret = 0;
+  while (!sched->waitForIdle(CHECKPOINT_POLL_MS)) {
+    // The console is ours until the scan ends, so `info` cannot show this.
+    StringBuilder occupancy;
+    sched->printOccupancy(&occupancy);
+    printf("%s", (char*) occupancy.string());
+    const time_t now = time(nullptr);
+    const bool stopping = (0 != deadline) && (now >= deadline);
+    const bool due = _saved_to_db && (0 != _scan_opts.checkpoint_secs) && ((unsigned long) (now - last_checkpoint) >= _scan_opts.checkpoint_secs);
+    if (!(stopping || due)) {
+      continue;
+    }
+    std::vector<PathNode*> frontier;
+    sched->pauseDives();
+    sched->waitForIdle();
+    sched->resumeDives(&frontier);
+    last_checkpoint = time(nullptr);
+    // Rows that failed are not behind any checkpoint taken since, so the last
+    //   one from before they failed is kept for a resume.
+    const bool rows_ok = (0 == sched->rowsFailed());
+    if (rows_ok) {
+      _checkpoint(&frontier, false);
+    }
+    if (stopping && !frontier.empty()) {
+      for (PathNode* node : frontier) {
+        PathArena::release(node);
+      }
+      ret = (rows_ok) ? 1 : -1;
+      break;
+    }
+    for (PathNode* node : frontier) {
+      ORMFileData* obj = new ORMFileData(_dh_ver, node, true);
+      if (obj) {
+        sched->submit(obj);
+      }
+      else {
+        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate for a deferred directory.");
+        PathArena::release(node);
+      }
+    }
+  }
+
+  if (0 < sched->rowsFailed()) {
+    // The catalog is missing rows, so it is left incomplete.
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "%lu rows failed to reach the database. Scan it again with `resume %d`.", sched->rowsFailed(), _dh_ver);
+    ret = -1;
+  }
+  else if (0 == ret) {
     _mark_scan_complete();
-    ret = 0;
+    if (_saved_to_db) {
+      std::vector<PathNode*> none;
+      _checkpoint(&none, true);
+    }
   }
   else {
-    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to scan.");
+    printf("Scan stopped at a checkpoint. Continue it with `resume %d`.\n", _dh_ver);
+  }
+  return ret;
+}
+
+
+/*
+* Scan one subtree of the catalog again, and swap its rows for the new ones.
+*   The old rows are deleted and the new ones written in one transaction, so
+*   anyone reading the catalog sees either the old subtree or the new one. The
+*   catalog's totals are corrected by the difference, rather than counted again.
+* The subtree is given relative to the root, or as a full path beneath it.
+* Returns 0 on success, or -1 on failure, in which case the rows are unchanged.
+*/
+int ORMDatahiveVersion::rescan(const char* subtree) {
+  if (!_saved_to_db) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Only a saved catalog can be rescanned in part.");
+    return -1;
+  }
+  if (1 != _scan_finished()) {
+    return -1;
+  }
+  const size_t root_len = strlen(_path);
+  const char* rel = subtree;
+  if ('/' == *rel) {
+    const bool beneath = (0 == strncmp(rel, _path, root_len)) && (('/' == _path[root_len - 1]) || ('\0' == rel[root_len]) || ('/' == rel[root_len]));
+    if (!beneath) {
+      printf("%s is not beneath the catalog's root (%s).\n", subtree, _path);
+      return -1;
+    }
+    rel += root_len;
+  }
+  while ('/' == *rel) {
+    rel++;
+  }
+  char* rel_path = strdup(rel);
+  if (nullptr == rel_path) {
+    return -1;
+  }
+  size_t rel_len = strlen(rel_path);
+  while ((0 < rel_len) && ('/' == rel_path[rel_len - 1])) {
+    rel_path[--rel_len] = '\0';
+  }
+  // The rows hold the paths as they were found, so "." and ".." would match nothing.
+  bool dotted = false;
+  for (const char* c = rel_path; ('\0' != *c) && !dotted; ) {
+    const size_t len = strcspn(c, "/");
+    dotted = ((1 == len) && ('.' == *c)) || ((2 == len) && (0 == strncmp(c, "..", 2)));
+    c += len;
+    while ('/' == *c) {
+      c++;
+    }
+  }
+  if (dotted) {
+    printf("Give the subtree without \".\" or \"..\" in it.\n");
+    free(rel_path);
+    return -1;
+  }
+
+  PathNode* root = PathArena::make(nullptr, _path, root_len);
+  PathNode* node = (root) ? PathArena::makeRelative(root, rel_path) : nullptr;
+  PathArena::release(root);     // The subtree's node holds it, if it was made.
+  struct stat64 st;
+  const bool exists   = (nullptr != node) && (0 == lstat64(PathArena::fullPath(node), &st));
+  const bool excluded = exists && _excluded_by_rules(rel_path, &st);
+  free(rel_path);
+  if (!exists || excluded) {
+    printf("%s %s.\n", subtree, (excluded) ? "is excluded by the catalog's rules" : "does not exist");
+    PathArena::release(node);
+    return -1;
+  }
+  StringBuilder cond;
+  _path_condition(_db, &cond, PathArena::fullPath(node), S_ISDIR(st.st_mode));
+
+  // The totals to correct, and the depth the catalog was scanned to.
+  unsigned long totals[3] = {0, 0, 0};
+  _read_totals(totals);
+
+  // Everything from here to COMMIT is one transaction, including the rows the
+  //   DB thread writes. It shares our connection.
+  unsigned long old_counts[3] = {0, 0, 0};
+  bool ok = (1 == _db->r_query("START TRANSACTION;"));
+  ok = ok && (0 == _count_rows(&cond, old_counts));
+  ok = ok && (0 == _delete_rows(_db, _dh_ver, &cond));
+
+  FSOCounts counts;
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  ORMFileData* obj = (ok) ? new ORMFileData(_dh_ver, node, false) : nullptr;
+  if (nullptr == obj) {
+    PathArena::release(node);
+    ok = false;
+  }
+  else if ((0 != sched->start()) || (0 != sched->beginScan(&counts, &_logs, &_scan_opts, st.st_dev))) {
+    delete obj;
+    ok = false;
+  }
+  else {
+    printf("Rescanning %s\n", PathArena::fullPath(node));
+    sched->submit(obj);
+    sched->waitForIdle();
+    ok = (0 == sched->rowsFailed());
+  }
+
+  const unsigned long new_counts[3] = {counts.files.load(), counts.links.load(), counts.dirs.load()};
+  ok = ok && (0 == _write_totals(totals, old_counts, new_counts));
+  ok = (1 == _db->r_query(ok ? "COMMIT;" : "ROLLBACK;")) && ok;
+  if (!ok) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to rescan %s. The catalog is unchanged.", subtree);
+    return -1;
+  }
+  _fso_totals.files = totals[0];
+  _fso_totals.links = totals[1];
+  _fso_totals.dirs  = totals[2];
+  printf("Rescanned %s: files %lu -> %lu, links %lu -> %lu, directories %lu -> %lu.\n", (('\0' != *subtree) ? subtree : _path),
+    old_counts[0], new_counts[0], old_counts[1], new_counts[1], old_counts[2], new_counts[2]
+  );
+  return 0;
+}
+
+
+/*
+* Find the files in the tree that hold the same content, while reading as
+*   little of it as we can. The tree is scanned for metadata only, and its
+*   files are grouped by size as they are stat'd. Only files that share a size
+*   with another inode are then read: first their head and tail, and in full
+*   only if those match too (and dupes-confirm is set).
+* Each group gets a row in `dupe_group`, and the rows of its members point to
+*   it. Members that were hashed in full take their digest.
+* A scan with rows that failed to reach the database is never marked complete.
+* Returns as scan() does.
+*/
+int ORMDatahiveVersion::scanDupes() {
+  if (!_saved_to_db) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Only a saved catalog can hold duplicate groups.");
+    return -1;
+  }
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  _scan_opts.dupes = true;
+  int ret = scan(ScanDepth::METADATA);
+  _scan_opts.dupes = false;
+  if (0 != ret) {
+    if (1 == ret) {
+      printf("The scan stopped before it read the whole tree, so no duplicates were looked for.\n");
+    }
+    sched->sizes()->reset();
+    return ret;
+  }
+  struct stat64 root_stat;
+  memset((void*) &root_stat, 0, sizeof(struct stat64));
+  lstat64(_path, &root_stat);
+  const unsigned int threads = _scan_opts.threadsFor(DevicePool::classify(root_stat.st_dev, _path));
+  printf("Looking for duplicates with %u threads.\n", threads);
+  DupeFinder finder(&_scan_opts);
+  if (0 != finder.run(sched->sizes(), threads)) {
+    return -1;
+  }
+  ret = _save_dupes(&finder);
+  StringBuilder output;
+  finder.printDebug(&output);
+  printf("%s", (char*) output.string());
+  return ret;
+}
+
+
+/*
+* Replace the catalog's duplicate groups with those the finder found, in one
+*   transaction.
+* Returns 0 on success, -1 on failure, in which case the catalog is unchanged.
+*/
+int ORMDatahiveVersion::_save_dupes(DupeFinder* finder) {
+  StringBuilder q;
+  bool ok = (1 == _db->r_query("START TRANSACTION;"));
+  q.concatf("UPDATE `file_meta` SET `dupe_group` = '0' WHERE `id_dh_snapshot` = '%d' AND `dupe_group` <> '0';", _dh_ver);
+  ok = ok && (1 == _db->r_query(q.string()));
+  q.clear();
+  q.concatf("DELETE FROM `dupe_group` WHERE `id_dh_snapshot` = '%d';", _dh_ver);
+  ok = ok && (1 == _db->r_query(q.string()));
+
+  for (DupeFinder::Group& g : *finder->groups()) {
+    if (!ok) {
+      break;
+    }
+    char h_buf[65];
+    memset(h_buf, 0, 65);
+    printBinStringToBuffer(g.hash, 32, h_buf);
+    q.clear();
+    q.concatf("INSERT INTO `dupe_group` (`id_dh_snapshot`, `size`, `digest`, `confirmed`, `members`, `inodes`) VALUES ('%d','%lu','%s','%d','%u','%u');",
+      _dh_ver, (unsigned long) g.size, h_buf, g.confirmed ? 1 : 0, (unsigned int) g.members.size(), g.inodes
+    );
+    ok = (1 == _db->r_query(q.string()));
+    const int group_id = (ok) ? _db->last_insert_id() : 0;
+    q.clear();
+    for (size_t i = 0; ok && (i < g.members.size()); i++) {
+      if (0 == q.length()) {
+        q.concatf("UPDATE `file_meta` SET `dupe_group` = '%d'", group_id);
+        if (g.confirmed) {
+          q.concatf(", `sha256` = '%s', `examined` = '%d'", h_buf, (int) ScanDepth::FULL);
+        }
+        q.concatf(" WHERE `id_dh_snapshot` = '%d' AND `rel_path` IN ('", _dh_ver);
+      }
+      else {
+        q.concat("','");
+      }
+      _db->escape_string(PathArena::fullPath(g.members[i]), &q);
+      if (((unsigned int) q.length() >= BATCH_QUERY_LENGTH) || ((i + 1) == g.members.size())) {
+        q.concat("');");
+        ok = (1 == _db->r_query(q.string()));
+        q.clear();
+      }
+    }
+  }
+  ok = (1 == _db->r_query(ok ? "COMMIT;" : "ROLLBACK;")) && ok;
+  if (!ok) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save the duplicate groups of catalog %d.", _dh_ver);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+* Check the tree against this catalog, without changing the catalog. Its rows
+*   are read into memory, and the tree is then read and hashed in full by the
+*   scan pipeline, with the catalog's own rules, through the usual pools. Each
+*   object is checked against its row instead of being written. Rows that no
+*   object was checked against are missing. Only the digest the catalog keeps
+*   is taken (SHA-256, if it keeps both).
+* A summary of the run is saved in `verification`. If the time box closes
+*   first, the run stops, and missing files are not counted.
+* Returns 0 if the whole tree was checked, 1 if the time box closed first, or
+*   -1 on failure.
+*/
+int ORMDatahiveVersion::verify() {
+  if (!_saved_to_db) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Only a saved catalog can be verified.");
+    return -1;
+  }
+  if (1 != _scan_finished()) {
+    return -1;
+  }
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  VerifyTable* table = sched->verifier();
+  table->reset();
+  if (0 > _load_verify_rows(table)) {
+    table->reset();
+    return -1;
+  }
+  ORMFileData* root_obj = new ORMFileData(_dh_ver, _path);
+  if (nullptr == root_obj) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to verify.");
+    table->reset();
+    return -1;
+  }
+  // The catalog's own counts and options are left as they were.
+  FSOCounts counts;
+  const ScanDepth saved_depth    = _scan_opts.depth;
+  const uint8_t   saved_digests  = _scan_opts.digests;
+  const uint32_t  saved_baseline = _scan_opts.baseline;
+  const bool      saved_cache    = _scan_opts.hash_cache;
+  const bool      saved_chunks   = _scan_opts.chunks;
+  _scan_opts.depth      = ScanDepth::FULL;
+  _scan_opts.digests    = (saved_digests & DIGEST_SHA256) ? DIGEST_SHA256 : DIGEST_BLAKE3;
+  _scan_opts.baseline   = 0;
+  _scan_opts.hash_cache = false;   // A cached digest would only prove the cache agrees with the catalog.
+  _scan_opts.chunks     = false;
+  _scan_opts.verify     = true;
+  const time_t started = time(nullptr);
+  const time_t deadline = (0 != _scan_opts.time_box_secs) ? (started + _scan_opts.time_box_secs) : 0;
+  int ret = 0;
+  if ((0 != sched->start()) || (0 != sched->beginScan(&counts, &_logs, &_scan_opts, root_obj->device()))) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to start the scan.");
+    delete root_obj;
+    ret = -1;
+  }
+  else {
+    printf("Verifying catalog %d (%s) against %lu rows.\n", _dh_ver, _path, (unsigned long) table->count());
+    sched->submit(root_obj);
+  }
+  while ((0 == ret) && !sched->waitForIdle(CHECKPOINT_POLL_MS)) {
+    if ((0 != deadline) && (time(nullptr) >= deadline)) {
+      std::vector<PathNode*> frontier;
+      sched->pauseDives();
+      sched->waitForIdle();
+      sched->resumeDives(&frontier);
+      if (frontier.empty()) {
+        break;   // Nothing was left to read.
+      }
+      for (PathNode* node : frontier) {
+        PathArena::release(node);
+      }
+      ret = 1;
+      break;
+    }
+  }
+  _scan_opts.verify     = false;
+  _scan_opts.depth      = saved_depth;
+  _scan_opts.digests    = saved_digests;
+  _scan_opts.baseline   = saved_baseline;
+  _scan_opts.hash_cache = saved_cache;
+  _scan_opts.chunks     = saved_chunks;
+  if (-1 == ret) {
+    table->reset();
+    return -1;
+  }
+
+  const long missing = (0 == ret) ? _report_missing(table) : 0;
+  StringBuilder q;
+  q.concatf("INSERT INTO `verification` (`id_dh_snapshot`, `seconds`, `complete`, `count_matched`, `count_changed`, `count_corrupt`, `count_unreadable`, `count_missing`, `count_new`, `bytes_verified`) VALUES ('%d','%lu','%d','%lu','%lu','%lu','%lu','%ld','%lu','%lu');",
+    _dh_ver, (unsigned long) (time(nullptr) - started), (0 == ret) ? 1 : 0,
+    table->matched(), table->changed(), table->corrupt(), table->unreadable(), (missing > 0) ? missing : 0L, table->newFiles(), (unsigned long) table->bytesVerified()
+  );
+  if (1 != _db->r_query(q.string())) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save the verification of catalog %d.", _dh_ver);
+  }
+  StringBuilder output;
+  table->printDebug(&output);
+  if (0 == ret) {
+    output.concatf("  Missing:       %ld\n", missing);
+  }
+  else {
+    output.concat("  The time box closed before the whole tree was read. Missing files were not counted.\n");
+  }
+  printf("%s", (char*) output.string());
+  table->reset();
+  if (0 < sched->rowsFailed()) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "%lu objects failed to leave the pipeline.", sched->rowsFailed());
+  }
+  return ret;
+}
+
+
+/*
+* Log the path of every row that a verify run never checked an object against,
+*   a batch of IDs at a time.
+* Returns the number of such rows, or -1 on failure.
+*/
+long ORMDatahiveVersion::_report_missing(VerifyTable* table) {
+  std::vector<uint32_t> ids;
+  table->unseen(&ids);
+  StringBuilder q;
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (0 == q.length()) {
+      q.concatf("SELECT `rel_path` FROM `file_meta` WHERE `id_dh_snapshot` = '%d' AND `id` IN (", _dh_ver);
+    }
+    else {
+      q.concat(",");
+    }
+    q.concatf("'%u'", ids[i]);
+    if (((unsigned int) q.length() >= BATCH_QUERY_LENGTH) || ((i + 1) == ids.size())) {
+      q.concat(");");
+      if ((1 != _db->r_query(q.string())) || (nullptr == _db->result)) {
+        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to read the paths of missing rows.");
+        return -1;
+      }
+      MYSQL_ROW row;
+      while ((row = mysql_fetch_row(_db->result))) {
+        c3p_log(LOG_LEV_NOTICE, __PRETTY_FUNCTION__, "Missing: %s", (row[0]) ? row[0] : "");
+      }
+      mysql_free_result(_db->result);
+      _db->result = nullptr;
+      q.clear();
+    }
+  }
+  return (long) ids.size();
+}
+
+
+/*
+* Ask a running watch to stop. Safe to call from a signal handler.
+*/
+void ORMDatahiveVersion::stopWatching() {
+  _watch_stop = true;
+}
+
+
+/*
+* Keep the catalog current by following changes to its tree, until
+*   stopWatching() is called, or the time box closes. Only a catalog whose scan
+*   finished can be watched.
+* Changes are held until their paths have been quiet for the debounce period,
+*   and are then applied as a batch.
+* Returns 0 once stopped, or -1 on failure.
+*/
+int ORMDatahiveVersion::watch() {
+  if (!_saved_to_db) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Only a saved catalog can be watched.");
+    return -1;
+  }
+  if (1 != _scan_finished()) {
+    return -1;
+  }
+  // Rows written again are examined to the depth of the rest of the catalog.
+  unsigned long totals[3] = {0, 0, 0};
+  if (0 == _read_totals(totals)) {
+    _fso_totals.files = totals[0];
+    _fso_totals.links = totals[1];
+    _fso_totals.dirs  = totals[2];
+  }
+  struct stat64 root_stat;
+  FsWatcher watcher;
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  if ((0 != lstat64(_path, &root_stat)) || (0 != watcher.open(_path, &_scan_opts)) || (0 != sched->start())) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to watch %s.", _path);
+    return -1;
+  }
+  printf("Watching catalog %d (%s) with %s.\n", _dh_ver, _path, ScanOptions::watchBackendString(watcher.backend()));
+
+  _watch_stop = false;
+  const uint64_t deadline = (0 != _scan_opts.time_box_secs) ? (_now_ms() + (_scan_opts.time_box_secs * 1000ULL)) : 0;
+  WatchCoalescer pending;
+  std::vector<WatchEvent> events;
+  unsigned long applied = 0;
+  bool stopping = false;
+  while (!stopping) {
+    stopping = _watch_stop.load() || ((0 != deadline) && (_now_ms() >= deadline));
+    watcher.poll((stopping ? 0 : WATCH_POLL_MS), &events);
+    for (WatchEvent& ev : events) {
+      pending.add(&ev);
+    }
+    events.clear();
+    // Whatever is still pending when we stop is applied now.
+    if (0 < pending.take(_now_ms(), _scan_opts.watch_debounce_ms, stopping, &events)) {
+      applied += events.size();
+      _apply_watch_batch(&events, root_stat.st_dev);
+      for (WatchEvent& ev : events) {
+        free(ev.rel_path);
+      }
+      events.clear();
+    }
+  }
+  StringBuilder output;
+  watcher.printDebug(&output);
+  output.concatf("  Paths applied: %lu\n", applied);
+  printf("%s", (char*) output.string());
+  return 0;
+}
+
+
+/*
+* Has this catalog been scanned to the end? A catalog without a checkpoint
+*   counts if it has any rows, since it was scanned before checkpoints existed.
+* Returns 1 if so, 0 if not, or -1 on failure.
+*/
+int ORMDatahiveVersion::_scan_finished() {
+  if (_scan_complete) {
+    return 1;
+  }
+  int ret = -1;
+  StringBuilder q;
+  q.concatf("SELECT `complete` FROM `scan_checkpoint` WHERE `id_dh_snapshot` = '%d';", _dh_ver);
+  if ((1 == _db->r_query(q.string())) && (nullptr != _db->result)) {
+    MYSQL_ROW row = mysql_fetch_row(_db->result);
+    if (row && row[0]) {
+      ret = (0 != atoi(row[0])) ? 1 : 0;
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
+  }
+  if (-1 == ret) {
+    q.clear();
+    q.concatf("SELECT `id` FROM `file_meta` WHERE `id_dh_snapshot` = '%d' LIMIT 1;", _dh_ver);
+    if ((1 == _db->r_query(q.string())) && (nullptr != _db->result)) {
+      ret = (nullptr != mysql_fetch_row(_db->result)) ? 1 : 0;
+      mysql_free_result(_db->result);
+      _db->result = nullptr;
+    }
+  }
+  if (0 == ret) {
+    printf("Catalog %d has not been scanned to the end. Scan or resume it first.\n", _dh_ver);
+  }
+  return ret;
+}
+
+
+/*
+* Read the catalog's file, link, and directory totals, in that order. Those of
+*   the last checkpoint are the most recent. The depth the catalog was scanned
+*   to is taken from the checkpoint too, if it has one, so that rows written
+*   again are examined to the same depth as the rest.
+* Returns 0 on success, -1 on failure.
+*/
+int ORMDatahiveVersion::_read_totals(unsigned long* totals) {
+  int ret = -1;
+  StringBuilder q;
+  q.concatf("SELECT IFNULL(c.`count_files`, d.`count_files`), IFNULL(c.`count_links`, d.`count_links`), IFNULL(c.`count_directories`, d.`count_directories`), c.`depth` FROM `datahive_version` d LEFT JOIN `scan_checkpoint` c ON c.`id_dh_snapshot` = d.`id` WHERE d.`id` = '%d';", _dh_ver);
+  if ((1 == _db->r_query(q.string())) && (nullptr != _db->result)) {
+    MYSQL_ROW row = mysql_fetch_row(_db->result);
+    if (row) {
+      for (int i = 0; i < 3; i++) {
+        totals[i] = (row[i]) ? strtoul(row[i], nullptr, 10) : 0;
+      }
+      if (row[3]) {
+        _scan_opts.depth = (ScanDepth) atoi(row[3]);
+      }
+      ret = 0;
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
   }
   return ret;
 }
 
 
+/*
+* Add the files, links, and directories among the catalog's rows that meet a
+*   condition on `rel_path` to the given counts. The rows are locked until the
+*   transaction ends, so only call this within one.
+* Returns 0 on success, -1 on failure.
+*/
+int ORMDatahiveVersion::_count_rows(StringBuilder* cond, unsigned long* counts) {
+  StringBuilder q;
+  q.concatf("SELECT IFNULL(SUM(`isfile`), 0), IFNULL(SUM(`islink` AND NOT `isfile` AND NOT `isdir`), 0), IFNULL(SUM(`isdir` AND NOT `isfile`), 0) FROM `file_meta` WHERE `id_dh_snapshot` = '%d' AND ", _dh_ver);
+  q.concat(cond);
+  q.concat(" FOR UPDATE;");
+  if ((1 != _db->r_query(q.string())) || (nullptr == _db->result)) {
+    return -1;
+  }
+  MYSQL_ROW row = mysql_fetch_row(_db->result);
+  for (int i = 0; row && (i < 3); i++) {
+    counts[i] += (row[i]) ? strtoul(row[i], nullptr, 10) : 0;
+  }
+  mysql_free_result(_db->result);
+  _db->result = nullptr;
+  return 0;
+}
+
+
+/*
+* Correct the totals by rows that were replaced, and save them with the catalog
+*   and its checkpoint. The totals are updated in place.
+* Returns 0 on success, -1 on failure.
+*/
+int ORMDatahiveVersion::_write_totals(unsigned long* totals, const unsigned long* old_counts, const unsigned long* new_counts) {
+  for (int i = 0; i < 3; i++) {
+    totals[i] = ((totals[i] > old_counts[i]) ? (totals[i] - old_counts[i]) : 0) + new_counts[i];
+  }
+  StringBuilder q;
+  q.concatf("UPDATE `datahive_version` SET `count_files` = '%lu', `count_links` = '%lu', `count_directories` = '%lu' WHERE `id` = '%d';", totals[0], totals[1], totals[2], _dh_ver);
+  bool ok = (1 == _db->r_query(q.string()));
+  q.clear();
+  q.concatf("UPDATE `scan_checkpoint` SET `count_files` = '%lu', `count_links` = '%lu', `count_directories` = '%lu' WHERE `id_dh_snapshot` = '%d';", totals[0], totals[1], totals[2], _dh_ver);
+  ok = ok && (1 == _db->r_query(q.string()));
+  return (ok) ? 0 : -1;
+}
+
+
+/*
+* Apply a batch of changes from a watch. The old rows for each path are
+*   deleted, and whatever is there now is examined again by the scan pipeline,
+*   and written as new rows. Files are hashed again, if the catalog was scanned
+*   to that depth. A directory that is new, or whose events were lost, is read
+*   in full. Any other directory only gets its own row again.
+* The rows are swapped and the catalog's totals corrected in one transaction,
+*   so a batch that fails leaves the catalog as it was.
+* Returns the number of objects examined, or -1 on failure.
+*/
+int ORMDatahiveVersion::_apply_watch_batch(std::vector<WatchEvent>* events, dev_t root_dev) {
+  PathNode* root = PathArena::make(nullptr, _path, strlen(_path));
+  if (nullptr == root) {
+    return -1;
+  }
+  std::vector<ORMFileData*> starts;
+  std::vector<StringBuilder*> conds;
+  StringBuilder* cond = nullptr;
+  for (size_t i = 0; i < events->size(); i++) {
+    WatchEvent* ev = &events->at(i);
+    PathNode* node = PathArena::makeRelative(root, ev->rel_path);
+    if (nullptr == node) {
+      continue;
+    }
+    struct stat64 st;
+    const char* full    = PathArena::fullPath(node);
+    const bool exists   = (0 == lstat64(full, &st));
+    const bool is_dir   = (exists) ? S_ISDIR(st.st_mode) : (0 != (ev->flags & WATCH_EV_DIR));
+    const bool subtree  = is_dir && (!exists || (0 != (ev->flags & (WATCH_EV_GONE | WATCH_EV_NEW | WATCH_EV_RESCAN))));
+
+    if ((nullptr == cond) || ((unsigned int) cond->length() >= BATCH_QUERY_LENGTH)) {
+      cond = new StringBuilder();
+      conds.push_back(cond);
+    }
+    cond->concat((0 == cond->length()) ? "(" : " OR ");
+    _path_condition(_db, cond, full, subtree);
+
+    ORMFileData* obj = (exists && !_excluded_by_rules(ev->rel_path, &st)) ? new ORMFileData(_dh_ver, node, false) : nullptr;
+    if (obj) {
+      if (is_dir && !subtree) {
+        obj->skipDive();
+      }
+      starts.push_back(obj);
+    }
+    else {
+      PathArena::release(node);
+    }
+  }
+  PathArena::release(root);
+
+  // Everything from here to COMMIT is one transaction, including the rows the
+  //   DB thread writes. It shares our connection.
+  unsigned long totals[3]     = {0, 0, 0};
+  unsigned long old_counts[3] = {0, 0, 0};
+  bool ok = (1 == _db->r_query("START TRANSACTION;"));
+  ok = ok && (0 == _read_totals(totals));
+  for (StringBuilder* c : conds) {
+    c->concat(")");
+    ok = ok && (0 == _count_rows(c, old_counts));
+    ok = ok && (0 == _delete_rows(_db, _dh_ver, c));
+    delete c;
+  }
+  conds.clear();
+
+  FSOCounts counts;
+  ScanScheduler* sched = ScanScheduler::getInstance();
+  if (!ok || (0 != sched->beginScan(&counts, &_logs, &_scan_opts, root_dev))) {
+    for (ORMFileData* obj : starts) {
+      delete obj;
+    }
+    starts.clear();
+    ok = false;
+  }
+  for (ORMFileData* obj : starts) {
+    sched->submit(obj);
+  }
+  if (!starts.empty()) {
+    sched->waitForIdle();
+    ok = (0 == sched->rowsFailed());
+  }
+
+  const unsigned long new_counts[3] = {counts.files.load(), counts.links.load(), counts.dirs.load()};
+  ok = ok && (0 == _write_totals(totals, old_counts, new_counts));
+  ok = (1 == _db->r_query(ok ? "COMMIT;" : "ROLLBACK;")) && ok;
+  if (!ok) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to apply a batch of %u changes. Their rows are unchanged.", (unsigned int) events->size());
+    return -1;
+  }
+  _fso_totals.files = totals[0];
+  _fso_totals.links = totals[1];
+  _fso_totals.dirs  = totals[2];
+  c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Applied %u changes: %lu files, %lu directories, %lu links examined.",
+    (unsigned int) events->size(), counts.files.load(), counts.dirs.load(), counts.links.load()
+  );
+  return (int) (counts.files + counts.dirs + counts.links);
+}
+
+
+/*
+* Would the rules exclude this path, or any directory above it? The stat is
+*   that of the path itself.
+*/
+bool ORMDatahiveVersion::_excluded_by_rules(const char* rel_path, struct stat64* st) {
+  ScanRules* rules = &_scan_opts.rules;
+  if (rules->empty() || ('\0' == *rel_path)) {
+    return false;
+  }
+  char* buf = strdup(rel_path);
+  if (nullptr == buf) {
+    return false;
+  }
+  bool ret = false;
+  char* name = buf;
+  for (char* slash = strchr(buf, '/'); (slash && !ret); slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    ret = (RuleVerdict::EXCLUDE == rules->evaluate(buf, name, true, false, 0, 0));
+    *slash = '/';
+    name = slash + 1;
+  }
+  if (!ret) {
+    ret = (RuleVerdict::EXCLUDE == rules->evaluate(buf, name, S_ISDIR(st->st_mode), S_ISREG(st->st_mode), (uint64_t) st->st_size, st->st_mtime));
+  }
+  free(buf);
+  return ret;
+}
+
+
+/*
+* Fill the table with the fully examined files of the baseline catalog. Rows
+*   are read a page at a time, so that the client never holds more than a page
+*   of the result. Rows written before nanosecond times were recorded cannot be
+*   trusted to match, and are left out.
+* Returns the number of files loaded, or -1 on failure.
+*/
+int ORMDatahiveVersion::_load_baseline(BaselineTable* table) {
+  const uint32_t base = _scan_opts.baseline;
+  StringBuilder root;
+  StringBuilder q;
+  uint8_t base_digests = 0;
+  q.concatf("SELECT `rel_path`, `digests` FROM `datahive_version` WHERE `id` = '%u';", base);
+  if ((1 == _db->r_query(q.string())) && (nullptr != _db->result)) {
+    MYSQL_ROW row = mysql_fetch_row(_db->result);
+    if (row && row[0]) {
+      root.concat(row[0]);
+      base_digests = (uint8_t) ((row[1]) ? atoi(row[1]) : DIGEST_SHA256);
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
+  }
+  if (0 == root.length()) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "No baseline catalog with ID %u. Every file will be read.", base);
+    return -1;
+  }
+  if ((base_digests & _scan_opts.digests) != _scan_opts.digests) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Baseline catalog %u took %s digests, and this scan wants %s. Every file will be read.",
+      base, ScanOptions::digestsString(base_digests), ScanOptions::digestsString(_scan_opts.digests)
+    );
+    return -1;
+  }
+  const bool want_b3 = (0 != (_scan_opts.digests & DIGEST_BLAKE3));
+  const size_t root_len = strlen((char*) root.string());
+
+  unsigned long last_id = 0;
+  unsigned int  page    = 0;
+  do {
+    q.clear();
+    q.concatf("SELECT `id`, `rel_path`, `size`, `mtime_ns`, `ctime_ns`, `st_ino`, `sha256`, `blake3` FROM `file_meta` WHERE `id_dh_snapshot` = '%u' AND `id` > '%lu' AND `isfile` = 1 AND `examined` = '%d' AND `ctime_ns` > 0 ORDER BY `id` ASC LIMIT %u;",
+      base, last_id, (int) ScanDepth::FULL, BASELINE_PAGE_ROWS
+    );
+    if ((1 != _db->r_query(q.string())) || (nullptr == _db->result)) {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to read baseline catalog %u. Every file will be read.", base);
+      table->reset();
+      return -1;
+    }
+    page = 0;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(_db->result))) {
+      page++;
+      last_id = strtoul(row[0], nullptr, 10);
+      const char* rel = row[1];
+      uint8_t hash[32];
+      uint8_t b3[32];
+      memset(hash, 0, 32);
+      if ((nullptr == rel) || (0 != strncmp(rel, (char*) root.string(), root_len))) {
+        continue;
+      }
+      if (((base_digests & DIGEST_SHA256) && (0 != _hex_to_digest(row[6], hash))) || (want_b3 && (0 != _hex_to_digest(row[7], b3)))) {
+        continue;
+      }
+      rel += root_len;
+      if ('/' == *rel) {
+        rel++;
+      }
+      table->add(rel, strtoull(row[2], nullptr, 10), strtoll(row[3], nullptr, 10), strtoll(row[4], nullptr, 10), strtoull(row[5], nullptr, 10), hash, (want_b3) ? b3 : nullptr);
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
+  } while (BASELINE_PAGE_ROWS == page);
+  table->seal();
+  printf("Baseline catalog %u has %lu files to compare against.\n", base, (unsigned long) table->count());
+  return (int) table->count();
+}
+
+
+/*
+* Fill the table with every row of this catalog, a page at a time. Files that
+*   were fully examined carry the digest the catalog keeps. Rows that cannot be
+*   placed beneath the root are left out.
+* Returns the number of rows loaded, or -1 on failure.
+*/
+int ORMDatahiveVersion::_load_verify_rows(VerifyTable* table) {
+  const uint8_t digest = (_scan_opts.digests & DIGEST_SHA256) ? DIGEST_SHA256 : DIGEST_BLAKE3;
+  const size_t root_len = strlen(_path);
+  StringBuilder q;
+  unsigned long last_id = 0;
+  unsigned int  page    = 0;
+  do {
+    q.clear();
+    q.concatf("SELECT `id`, `rel_path`, `isdir`, `isfile`, `islink`, `size`, `mtime_ns`, `examined`, `%s` FROM `file_meta` WHERE `id_dh_snapshot` = '%d' AND `id` > '%lu' ORDER BY `id` ASC LIMIT %u;",
+      (DIGEST_SHA256 == digest) ? "sha256" : "blake3", _dh_ver, last_id, BASELINE_PAGE_ROWS
+    );
+    if ((1 != _db->r_query(q.string())) || (nullptr == _db->result)) {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to read the rows of catalog %d.", _dh_ver);
+      return -1;
+    }
+    page = 0;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(_db->result))) {
+      page++;
+      last_id = strtoul(row[0], nullptr, 10);
+      const char* rel = row[1];
+      if ((nullptr == rel) || (0 != strncmp(rel, _path, root_len))) {
+        continue;
+      }
+      rel += root_len;
+      if ('/' == *rel) {
+        rel++;
+      }
+      uint8_t type = VERIFY_TYPE_OTHER;
+      if (row[3] && (0 != atoi(row[3]))) {        type = VERIFY_TYPE_FILE;  }
+      else if (row[2] && (0 != atoi(row[2]))) {   type = VERIFY_TYPE_DIR;   }
+      else if (row[4] && (0 != atoi(row[4]))) {   type = VERIFY_TYPE_LINK;  }
+      uint8_t hash[32];
+      const bool hashed = (VERIFY_TYPE_FILE == type) && row[7] && ((int) ScanDepth::FULL == atoi(row[7])) && (0 == _hex_to_digest(row[8], hash));
+      table->add(rel, (uint32_t) last_id, type,
+        (row[5]) ? strtoull(row[5], nullptr, 10) : 0, (row[6]) ? strtoll(row[6], nullptr, 10) : 0,
+        (hashed) ? hash : nullptr
+      );
+    }
+    mysql_free_result(_db->result);
+    _db->result = nullptr;
+  } while (BASELINE_PAGE_ROWS == page);
+  table->seal(digest);
+  return (int) table->count();
+}
+
+
+/*
+* Save where the scan stands: the directories left to read, the counts so far,
+*   and the newest row written. It all goes in one transaction, so a crash
+*   leaves either this checkpoint or the one before it.
+* Only call this while the scan is idle, since it shares the DB writer's
+*   connection.
+* Returns 0 on success, -1 on failure.
+*/
+int ORMDatahiveVersion::_checkpoint(std::vector<PathNode*>* frontier, bool complete) {
+  bool ok = (1 == _db->r_query("START TRANSACTION;"));
+  StringBuilder q;
+  q.concatf("DELETE FROM `scan_frontier` WHERE `id_dh_snapshot` = '%d';", _dh_ver);
+  ok = ok && (1 == _db->r_query(q.string()));
+  q.clear();
+  for (size_t i = 0; ok && (i < frontier->size()); i++) {
+    q.concat((0 == q.length()) ? "INSERT INTO `scan_frontier` (`id_dh_snapshot`, `rel_path`) VALUES " : ",");
+    q.concatf("('%d','", _dh_ver);
+    _db->escape_string(PathArena::relativePath(frontier->at(i)), &q);
+    q.concat("')");
+    if (((unsigned int) q.length() >= BATCH_QUERY_LENGTH) || ((i + 1) == frontier->size())) {
+      q.concat(";");
+      ok = (1 == _db->r_query(q.string()));
+      q.clear();
+    }
+  }
+  q.clear();
+  q.concatf("REPLACE INTO `scan_checkpoint` (`id_dh_snapshot`, `depth`, `last_row_id`, `count_files`, `count_links`, `count_directories`, `count_excluded`, `complete`) SELECT '%d','%d',IFNULL(MAX(`id`), 0),'%lu','%lu','%lu','%lu','%d' FROM `file_meta` WHERE `id_dh_snapshot` = '%d';",
+    _dh_ver, (int) _scan_opts.depth,
+    _fso_totals.files.load(), _fso_totals.links.load(), _fso_totals.dirs.load(), _fso_totals.excluded.load(),
+    (complete ? 1 : 0), _dh_ver
+  );
+  ok = ok && (1 == _db->r_query(q.string()));
+  _db->r_query(ok ? "COMMIT;" : "ROLLBACK;");
+  if (!ok) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save a checkpoint for catalog %d.", _dh_ver);
+    return -1;
+  }
+  c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Checkpoint for catalog %d: %u directories left to read.", _dh_ver, (unsigned int) frontier->size());
+  return 0;
+}
+
+
 /*
 *
 */
@@ -216,6 +1334,10 @@ long ORMDatahiveVersion::commit() {
     if (1 == _db->r_query(insert_query.string())) {
       _dh_ver = _db->last_insert_id();
       _saved_to_db = true;
+      // Rules given before we had an ID are saved now that we have one.
+      for (unsigned int i = 0; i < _scan_opts.rules.count(); i++) {
+        _save_rule(i);
+      }
     }
     else {
       c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save ORMDatahiveVersion to database.");
@@ -267,3 +1389,126 @@ void ORMDatahiveVersion::setNotes(StringBuilder* n_raw) {
     }
   }
 }
+
+
+/*
+* Compile a rule and append it to this catalog's list. If the catalog has
+*   already been saved, the rule is saved alongside it.
+* Returns 0 on success, -1 if the rule does not parse or could not be saved.
+*/
+int ORMDatahiveVersion::addRule(const char* text) {
+  if (0 != _scan_opts.rules.add(text)) {
+    return -1;
+  }
+  if (_saved_to_db) {
+    return _save_rule(_scan_opts.rules.count() - 1);
+  }
+  return 0;
+}
+
+
+/*
+* Forget every rule for this catalog.
+* Returns 0 on success, -1 if the saved rules could not be deleted.
+*/
+int ORMDatahiveVersion::clearRules() {
+  _scan_opts.rules.clear();
+  if (_saved_to_db) {
+    StringBuilder q;
+    q.concatf("DELETE FROM `scan_rules` WHERE `id_dh_snapshot` = '%d';", _dh_ver);
+    if (1 != _db->r_query(q.string())) {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to delete the rules for catalog %d.", _dh_ver);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+* Append the rules saved with another catalog to our own, in their order.
+* Returns the number of rules copied, or -1 on failure.
+*/
+int ORMDatahiveVersion::copyRules(uint32_t catalog) {
+  return _read_rules(catalog, true);
+}
+
+
+/*
+* Load a saved catalog, and its rules.
+* Returns nullptr if there is no such catalog.
+*/
+ORMDatahiveVersion* ORMDatahiveVersion::load(uint32_t catalog) {
+  LibrarianDB* db = LibrarianDB::getInstance();
+  ORMDatahiveVersion* ret = nullptr;
+  StringBuilder q;
+  q.concatf("SELECT `rel_path`, `tag`, `notes`, `digests` FROM `datahive_version` WHERE `id` = '%u';", catalog);
+  if ((1 == db->r_query(q.string())) && (nullptr != db->result)) {
+    MYSQL_ROW row = mysql_fetch_row(db->result);
+    if (row && row[0]) {
+      StringBuilder path(row[0]);
+      ret = new ORMDatahiveVersion(catalog, (char*) path.string());
+      if (row[1]) {
+        StringBuilder tag(row[1]);
+        ret->setTag(&tag);
+      }
+      if (row[2]) {
+        StringBuilder notes(row[2]);
+        ret->setNotes(&notes);
+      }
+      if (row[3]) {
+        ret->_scan_opts.digests = (uint8_t) atoi(row[3]);
+      }
+      ret->_saved_to_db = true;
+    }
+    mysql_free_result(db->result);
+    db->result = nullptr;
+  }
+  if (ret) {
+    ret->_read_rules(catalog, false);
+  }
+  return ret;
+}
+
+
+/*
+* Append the rules saved with the given catalog to our own. If save is set,
+*   they are saved again as ours.
+* Returns the number of rules read, or -1 on failure.
+*/
+int ORMDatahiveVersion::_read_rules(uint32_t catalog, bool save) {
+  int ret = -1;
+  StringBuilder q;
+  q.concatf("SELECT `rule` FROM `scan_rules` WHERE `id_dh_snapshot` = '%u' ORDER BY `ordinal` ASC;", catalog);
+  if (1 == _db->r_query(q.string())) {
+    MYSQL_RES* result = _db->result;
+    if (nullptr != result) {
+      MYSQL_ROW row;
+      ret = 0;
+      while ((row = mysql_fetch_row(result))) {
+        if (row[0] && (0 == (save ? addRule(row[0]) : _scan_opts.rules.add(row[0])))) {
+          ret++;
+        }
+        else {
+          c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "Skipping a rule from catalog %u that did not compile: %s", catalog, (row[0] ? row[0] : "NULL"));
+        }
+      }
+      mysql_free_result(result);
+      _db->result = nullptr;
+    }
+  }
+  return ret;
+}
+
+
+int ORMDatahiveVersion::_save_rule(unsigned int ordinal) {
+  StringBuilder q;
+  q.concatf("INSERT INTO `scan_rules` (`id_dh_snapshot`, `ordinal`, `rule`) VALUES ('%d','%u','", _dh_ver, ordinal);
+  _db->escape_string(_scan_opts.rules.text(ordinal), &q);
+  q.concat("');");
+  if (1 != _db->r_query(q.string())) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save rule %u for catalog %d.", ordinal, _dh_ver);
+    return -1;
+  }
+  return 0;
+}
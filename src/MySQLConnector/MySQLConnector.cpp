@@ -112,7 +112,7 @@ int MySQLConnector::r_query(char *query) {
 }
 
 
-long MySQLConnector::escape_string(char* src, StringBuilder* dest) {
+long MySQLConnector::escape_string(const char* src, StringBuilder* dest) {
   if ((nullptr != src) && (nullptr != dest)) {
     long escaped_len = 0;
     long src_len = strlen(src);
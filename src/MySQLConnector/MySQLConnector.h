@@ -31,7 +31,7 @@ class MySQLConnector {
         int r_query(char *query);
         int r_query(unsigned char *query);
         int r_query(const char *query);
-        long escape_string(char*, StringBuilder*);
+        long escape_string(const char*, StringBuilder*);
 
         int last_insert_id();
 
@@ -0,0 +1,99 @@
+#include <string.h>
+#include <algorithm>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+
+
+/*
+* FNV-1a, over the path relative to the scan root. Keying on the relative path
+*   lets a baseline follow its root to another mount point.
+*/
+uint64_t BaselineTable::pathKey(const char* rel_path) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (const uint8_t* p = (const uint8_t*) rel_path; *p; p++) {
+    h ^= *p;
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+
+/*
+* Add a file from the baseline. Only call this before seal().
+*/
+void BaselineTable::add(const char* rel_path, uint64_t size, int64_t mtime_ns, int64_t ctime_ns, uint64_t ino, const uint8_t* hash, const uint8_t* blake3) {
+  Entry e;
+  e.key      = pathKey(rel_path);
+  e.size     = size;
+  e.mtime_ns = mtime_ns;
+  e.ctime_ns = ctime_ns;
+  e.ino      = ino;
+  memcpy(e.hash, hash, 32);
+  if (blake3) {
+    memcpy(e.blake3, blake3, 32);
+  }
+  else {
+    memset(e.blake3, 0, 32);
+  }
+  _entries.push_back(e);
+}
+
+
+/*
+* Sort the table for lookup. Any key held by more than one entry is dropped
+*   entirely, since we could not tell which of them a file should match.
+*/
+void BaselineTable::seal() {
+  std::sort(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) {  return (a.key < b.key);  });
+  size_t w = 0;
+  for (size_t r = 0; r < _entries.size(); ) {
+    size_t end = r + 1;
+    while ((end < _entries.size()) && (_entries[end].key == _entries[r].key)) {
+      end++;
+    }
+    if (1 == (end - r)) {
+      _entries[w++] = _entries[r];
+    }
+    r = end;
+  }
+  _entries.resize(w);
+  _entries.shrink_to_fit();
+}
+
+
+/*
+* If the object is unchanged since the baseline, copy its old digests.
+* Returns true if the digests were found and copied.
+*/
+bool BaselineTable::lookup(ORMFileData* obj, uint8_t* hash, uint8_t* blake3) {
+  const uint64_t key = pathKey(PathArena::relativePath(obj->pathNode()));
+  auto it = std::lower_bound(_entries.begin(), _entries.end(), key, [](const Entry& e, uint64_t k) {  return (e.key < k);  });
+  if ((it == _entries.end()) || (it->key != key)) {
+    return false;
+  }
+  if ((it->size != obj->size()) || (it->mtime_ns != obj->mtimeNs()) || (it->ctime_ns != obj->ctimeNs()) || (it->ino != (uint64_t) obj->inode())) {
+    _changed++;
+    return false;
+  }
+  memcpy(hash, it->hash, 32);
+  memcpy(blake3, it->blake3, 32);
+  _reused++;
+  return true;
+}
+
+
+void BaselineTable::reset() {
+  _entries.clear();
+  _entries.shrink_to_fit();
+  _reused  = 0;
+  _changed = 0;
+}
+
+
+void BaselineTable::printDebug(StringBuilder* output) {
+  output->concatf("  Baseline:      %lu files (%lu KiB), %lu digests reused, %lu changed\n",
+    (unsigned long) _entries.size(), (unsigned long) ((_entries.capacity() * sizeof(Entry)) >> 10),
+    _reused.load(), _changed.load()
+  );
+}
@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+
+#define B3_CHUNK_START  0x01
+#define B3_CHUNK_END    0x02
+#define B3_PARENT       0x04
+#define B3_ROOT         0x08
+
+static const uint32_t IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// The message words each of the seven rounds takes, in order.
+static const uint8_t SCHEDULE[7][16] = {
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+  {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+  { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+  { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+  {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+  { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 }
+};
+
+static std::atomic<unsigned long> _files_split{0};
+
+
+static inline uint32_t _rot_right(uint32_t x, unsigned int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t _load_le32(const uint8_t* p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void _store_le32(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t) v;
+  p[1] = (uint8_t) (v >> 8);
+  p[2] = (uint8_t) (v >> 16);
+  p[3] = (uint8_t) (v >> 24);
+}
+
+static inline void _load_block(const uint8_t* block, uint32_t* m) {
+  for (unsigned int i = 0; i < 16; i++) {
+    m[i] = _load_le32(block + (i << 2));
+  }
+}
+
+static inline void _g(uint32_t* v, unsigned int a, unsigned int b, unsigned int c, unsigned int d, uint32_t mx, uint32_t my) {
+  v[a] = v[a] + v[b] + mx;
+  v[d] = _rot_right(v[d] ^ v[a], 16);
+  v[c] = v[c] + v[d];
+  v[b] = _rot_right(v[b] ^ v[c], 12);
+  v[a] = v[a] + v[b] + my;
+  v[d] = _rot_right(v[d] ^ v[a], 8);
+  v[c] = v[c] + v[d];
+  v[b] = _rot_right(v[b] ^ v[c], 7);
+}
+
+
+/*
+* The compression function. Writes all 16 words of output. The first 8 are the
+*   next chaining value.
+*/
+static void _compress(const uint32_t* cv, const uint32_t* m, uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t* out) {
+  uint32_t v[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    IV[0], IV[1], IV[2], IV[3],
+    (uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags
+  };
+  for (unsigned int r = 0; r < 7; r++) {
+    const uint8_t* s = SCHEDULE[r];
+    _g(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+    _g(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+    _g(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+    _g(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+    _g(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+    _g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    _g(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+    _g(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+  }
+  for (unsigned int i = 0; i < 8; i++) {
+    out[i]     = v[i] ^ v[i + 8];
+    out[i + 8] = v[i + 8] ^ cv[i];
+  }
+}
+
+
+unsigned long Blake3::filesSplit() {  return _files_split.load();  }
+
+
+void Blake3::Output::chainingValue(uint32_t* cv_out) const {
+  uint32_t out[16];
+  _compress(cv, block, counter, block_len, flags, out);
+  memcpy(cv_out, out, 32);
+}
+
+
+void Blake3::Output::rootBytes(uint8_t* digest) const {
+  uint32_t out[16];
+  _compress(cv, block, 0, block_len, flags | B3_ROOT, out);
+  for (unsigned int i = 0; i < 8; i++) {
+    _store_le32(digest + (i << 2), out[i]);
+  }
+}
+
+
+void Blake3::init() {
+  _init_at(0);
+}
+
+
+/*
+* Start hashing a part of a larger message, from the given chunk on. The part
+*   must begin at a multiple of its own size, rounded up to a power of two, in
+*   chunks. Otherwise its subtree would not be one of the message's.
+*/
+void Blake3::_init_at(uint64_t first_chunk) {
+  memcpy(_cv, IV, 32);
+  _block_len   = 0;
+  _blocks_done = 0;
+  _chunk       = first_chunk;
+  _first_chunk = first_chunk;
+  _stack_len   = 0;
+}
+
+
+void Blake3::update(const uint8_t* data, size_t len) {
+  uint32_t m[16];
+  while (len > 0) {
+    if (1024 == (((size_t) _blocks_done << 6) + _block_len)) {
+      // The chunk is full, and there is more to come, so it is not the last.
+      Output o;
+      memcpy(o.cv, _cv, 32);
+      _load_block(_block, o.block);
+      o.counter   = _chunk;
+      o.block_len = 64;
+      o.flags     = B3_CHUNK_END | ((0 == _blocks_done) ? B3_CHUNK_START : 0);
+      uint32_t cv[8];
+      o.chainingValue(cv);
+      _push_chunk(cv);
+      _chunk++;
+      memcpy(_cv, IV, 32);
+      _blocks_done = 0;
+      _block_len   = 0;
+    }
+    if (64 == _block_len) {
+      _load_block(_block, m);
+      _compress(_cv, m, _chunk, 64, (0 == _blocks_done) ? B3_CHUNK_START : 0, m);
+      memcpy(_cv, m, 32);
+      _blocks_done++;
+      _block_len = 0;
+    }
+    // Whole blocks that are neither a chunk's last, nor the message's, need no copy.
+    while ((0 == _block_len) && (len > 64) && (_blocks_done < 15)) {
+      _load_block(data, m);
+      _compress(_cv, m, _chunk, 64, (0 == _blocks_done) ? B3_CHUNK_START : 0, m);
+      memcpy(_cv, m, 32);
+      _blocks_done++;
+      data += 64;
+      len  -= 64;
+    }
+    const size_t take = ((64 - (size_t) _block_len) < len) ? (64 - (size_t) _block_len) : len;
+    memcpy(_block + _block_len, data, take);
+    _block_len += (uint8_t) take;
+    data += take;
+    len  -= take;
+  }
+}
+
+
+/*
+* Add a finished chunk, and merge every subtree it completes.
+*/
+void Blake3::_push_chunk(const uint32_t* cv) {
+  uint32_t merged[8];
+  memcpy(merged, cv, 32);
+  uint64_t total = _chunk - _first_chunk + 1;
+  while (0 == (total & 1)) {
+    Output o;
+    _parent(_stack[--_stack_len], merged, &o);
+    o.chainingValue(merged);
+    total >>= 1;
+  }
+  memcpy(_stack[_stack_len++], merged, 32);
+}
+
+
+/*
+* The top node of what has been hashed so far, before it is finalized.
+*/
+void Blake3::_output(Output* o) {
+  uint8_t last[64];
+  memset(last, 0, 64);
+  memcpy(last, _block, _block_len);
+  memcpy(o->cv, _cv, 32);
+  _load_block(last, o->block);
+  o->counter   = _chunk;
+  o->block_len = _block_len;
+  o->flags     = B3_CHUNK_END | ((0 == _blocks_done) ? B3_CHUNK_START : 0);
+  for (unsigned int i = _stack_len; i > 0; i--) {
+    uint32_t cv[8];
+    o->chainingValue(cv);
+    _parent(_stack[i - 1], cv, o);
+  }
+}
+
+
+void Blake3::_parent(const uint32_t* left, const uint32_t* right, Output* o) {
+  memcpy(o->cv, IV, 32);
+  memcpy(o->block, left, 32);
+  memcpy(o->block + 8, right, 32);
+  o->counter   = 0;
+  o->block_len = 64;
+  o->flags     = B3_PARENT;
+}
+
+
+void Blake3::final(uint8_t* digest) {
+  Output o;
+  _output(&o);
+  o.rootBytes(digest);
+}
+
+
+void Blake3::digest(const uint8_t* msg, size_t len, uint8_t* digest) {
+  Blake3 hasher;
+  hasher.update(msg, len);
+  hasher.final(digest);
+}
+
+
+/*
+* Read and hash one segment of a file, as a subtree of the whole.
+* Returns 0 on success, -1 if the segment could not be read in full.
+*/
+int Blake3::_hash_segment(int fd, uint64_t offset, uint64_t len, uint8_t* buf, Output* o) {
+  Blake3 hasher;
+  hasher._init_at(offset >> 10);
+  uint64_t done = 0;
+  while (done < len) {
+    const size_t want = ((len - done) < HASH_BUFFER_SIZE) ? (size_t) (len - done) : HASH_BUFFER_SIZE;
+    const ssize_t r_len = pread(fd, buf, want, (off_t) (offset + done));
+    if (r_len > 0) {
+      hasher.update(buf, (size_t) r_len);
+      done += (uint64_t) r_len;
+    }
+    else if ((0 == r_len) || (EINTR != errno)) {
+      return -1;
+    }
+  }
+  hasher._output(o);
+  return 0;
+}
+
+
+/*
+* Hash a file of the given size, with up to the given number of threads. The
+*   file is cut into segments of BLAKE3_SEGMENT_SIZE, each of which is a whole
+*   subtree. The threads take segments in turn, and the subtrees are joined
+*   once all are done, as a single hasher would have joined them.
+* Returns 0 on success, -1 if the file could not be read in full.
+*/
+int Blake3::hashFile(int fd, uint64_t size, unsigned int threads, uint8_t* digest) {
+  const uint64_t segments = (size + BLAKE3_SEGMENT_SIZE - 1) / BLAKE3_SEGMENT_SIZE;
+  if (0 == segments) {
+    Blake3::digest(nullptr, 0, digest);
+    return 0;
+  }
+  if (0 == threads) {
+    threads = 1;
+  }
+  if (threads > segments) {
+    threads = (unsigned int) segments;
+  }
+  std::vector<Output> outs(segments);
+  std::atomic<uint64_t> next{0};
+  std::atomic<bool>     ok{true};
+  auto worker = [&]() {
+    std::vector<uint8_t> buf(HASH_BUFFER_SIZE);
+    uint64_t i;
+    while (ok.load() && ((i = next++) < segments)) {
+      const uint64_t offset = i * BLAKE3_SEGMENT_SIZE;
+      const uint64_t len    = ((size - offset) < BLAKE3_SEGMENT_SIZE) ? (size - offset) : BLAKE3_SEGMENT_SIZE;
+      if (0 != _hash_segment(fd, offset, len, buf.data(), &outs[i])) {
+        ok = false;
+      }
+    }
+  };
+  std::vector<std::thread*> pool;
+  for (unsigned int t = 1; t < threads; t++) {
+    pool.push_back(new std::thread(worker));
+  }
+  worker();
+  for (std::thread* t : pool) {
+    t->join();
+    delete t;
+  }
+  if (!ok.load()) {
+    return -1;
+  }
+
+  // Join the segments. Every one but the last is a complete subtree.
+  uint32_t stack[54][8];
+  unsigned int stack_len = 0;
+  for (uint64_t i = 0; (i + 1) < segments; i++) {
+    uint32_t cv[8];
+    outs[i].chainingValue(cv);
+    uint64_t total = i + 1;
+    while (0 == (total & 1)) {
+      Output o;
+      _parent(stack[--stack_len], cv, &o);
+      o.chainingValue(cv);
+      total >>= 1;
+    }
+    memcpy(stack[stack_len++], cv, 32);
+  }
+  Output root = outs[segments - 1];
+  while (stack_len > 0) {
+    uint32_t cv[8];
+    root.chainingValue(cv);
+    _parent(stack[--stack_len], cv, &root);
+  }
+  root.rootBytes(digest);
+  if (segments > 1) {
+    _files_split++;
+  }
+  return 0;
+}
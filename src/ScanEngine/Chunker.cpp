@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+
+static std::atomic<unsigned long> _files_chunked{0};
+static std::atomic<unsigned long> _chunks_cut{0};
+
+
+/*
+* The gear table. Any 256 random words will do, but they must never change, or
+*   no chunk would match one cut before the change. These come from splitmix64,
+*   seeded with 0.
+*/
+struct GearTable {
+  uint64_t v[256];
+
+  GearTable() {
+    uint64_t x = 0;
+    for (unsigned int i = 0; i < 256; i++) {
+      x += 0x9E3779B97F4A7C15ULL;
+      uint64_t z = x;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      v[i] = z ^ (z >> 31);
+    }
+  };
+};
+
+static const GearTable GEAR;
+
+
+unsigned long Chunker::filesChunked() {  return _files_chunked.load();  }
+unsigned long Chunker::chunksCut() {     return _chunks_cut.load();     }
+
+
+/*
+* Start a new stream, with chunks that average the given size, which must be a
+*   power of two. The masks take their bits from the top of the hash, which has
+*   seen the most bytes.
+*/
+void Chunker::begin(unsigned int avg_size) {
+  unsigned int bits = 0;
+  while ((1U << (bits + 1)) <= avg_size) {
+    bits++;
+  }
+  _avg    = 1U << bits;
+  _min    = _avg >> 2;
+  _max    = _avg << 2;
+  _mask_s = ~0ULL << (64 - (bits + 1));
+  _mask_l = ~0ULL << (64 - (bits - 1));
+  _fp     = 0;
+  _len    = 0;
+  _offset = 0;
+  _hashed = 0;
+  _chunks.clear();
+  _hasher.init();
+  _files_chunked++;
+}
+
+
+/*
+* Find the boundaries in the next bytes of the stream. The position just past
+*   the end of each chunk that ends in them is added to cuts.
+*/
+void Chunker::scan(const uint8_t* data, size_t len, std::vector<uint32_t>* cuts) {
+  size_t i = 0;
+  while (i < len) {
+    if (_len < _min) {
+      // No boundary may fall this early, so these bytes are not looked at.
+      const size_t skip = ((len - i) < (size_t) (_min - _len)) ? (len - i) : (size_t) (_min - _len);
+      _len += (uint32_t) skip;
+      i    += skip;
+      continue;
+    }
+    const size_t start  = i;
+    const size_t end    = i + (((len - i) < (size_t) (_max - _len)) ? (len - i) : (size_t) (_max - _len));
+    const size_t to_avg = (_len < _avg) ? (i + (size_t) (_avg - _len)) : i;
+    const size_t end_s  = (to_avg < end) ? to_avg : end;
+    uint64_t fp = _fp;
+    bool cut = false;
+    for (; i < end_s; i++) {
+      fp = (fp << 1) + GEAR.v[data[i]];
+      if (0 == (fp & _mask_s)) {
+        cut = true;
+        i++;
+        break;
+      }
+    }
+    for (; !cut && (i < end); i++) {
+      fp = (fp << 1) + GEAR.v[data[i]];
+      if (0 == (fp & _mask_l)) {
+        cut = true;
+        i++;
+        break;
+      }
+    }
+    _fp = fp;
+    _len += (uint32_t) (i - start);
+    if (cut || (_len >= _max)) {
+      cuts->push_back((uint32_t) i);
+      _len = 0;
+      _fp  = 0;
+    }
+  }
+}
+
+
+/*
+* Hash the next bytes of the stream, closing a chunk at each of the cuts that
+*   scan() found in them.
+*/
+void Chunker::digest(const uint8_t* data, size_t len, const std::vector<uint32_t>* cuts) {
+  size_t i = 0;
+  for (uint32_t c : *cuts) {
+    _hasher.update(data + i, c - i);
+    _hashed += (uint32_t) (c - i);
+    i = c;
+    _cut();
+  }
+  if (i < len) {
+    _hasher.update(data + i, len - i);
+    _hashed += (uint32_t) (len - i);
+  }
+}
+
+
+/*
+* Close the last chunk. An empty stream has no chunks.
+*/
+void Chunker::finish() {
+  if (_hashed > 0) {
+    _cut();
+  }
+}
+
+
+void Chunker::_cut() {
+  Chunk c;
+  c.offset = _offset;
+  c.size   = _hashed;
+  _hasher.final(c.digest);
+  _chunks.push_back(c);
+  _chunks_cut++;
+  _offset += _hashed;
+  _hashed = 0;
+  _hasher.init();
+}
@@ -0,0 +1,46 @@
+#include <map>
+
+#include "ScanEngine.h"
+
+
+/* The number of workers currently holding each device's gate. */
+class GateState {
+  public:
+    unsigned int holders = 0;
+    std::condition_variable cv;
+};
+
+static std::mutex _gate_mutex;
+static std::map<dev_t, GateState*> _gates;
+
+
+/*
+* Blocks until fewer than limit workers hold the device's gate, and then takes
+*   a place. A limit of zero means the device is not gated.
+*/
+void DeviceGate::acquire(dev_t dev, unsigned int limit) {
+  if (0 == limit) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(_gate_mutex);
+  GateState* g = _gates[dev];
+  if (nullptr == g) {
+    g = new GateState();
+    _gates[dev] = g;
+  }
+  g->cv.wait(lock, [g, limit]{ return (g->holders < limit); });
+  g->holders++;
+}
+
+
+void DeviceGate::release(dev_t dev, unsigned int limit) {
+  if (0 == limit) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(_gate_mutex);
+  GateState* g = _gates[dev];
+  if (g && (g->holders > 0)) {
+    g->holders--;
+    g->cv.notify_one();
+  }
+}
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+#include "AbstractPlatform.h"
+
+// f_type values for filesystems whose latency is a network's, not a disk's.
+#define FS_MAGIC_NFS     0x00006969
+#define FS_MAGIC_SMB     0x0000517B
+#define FS_MAGIC_CIFS    0xFF534D42
+#define FS_MAGIC_SMB2    0xFE534D42
+#define FS_MAGIC_CEPH    0x00C36400
+#define FS_MAGIC_AFS     0x5346414F
+#define FS_MAGIC_9P      0x01021997
+#define FS_MAGIC_CODA    0x73757245
+#define FS_MAGIC_FUSE    0x65735546
+
+// The pool whose worker is the calling thread, and that worker's deque.
+static thread_local DevicePool* _worker_pool = nullptr;
+static thread_local int         _worker_idx  = -1;
+
+
+
+/*******************************************************************************
+* Classification
+*******************************************************************************/
+
+/*
+* Read the rotational flag of a block device's queue, given its sysfs
+*   directory. Returns 1 (rotational), 0 (not), or -1 if there is no queue.
+*/
+static int _read_rotational(const char* sys_dir) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/queue/rotational", sys_dir);
+  FILE* f = fopen(path, "r");
+  if (nullptr == f) {
+    return -1;
+  }
+  int c = fgetc(f);
+  fclose(f);
+  return ('1' == c) ? 1 : (('0' == c) ? 0 : -1);
+}
+
+
+/*
+* Decide what backs the given device. The path is anywhere on that device, and
+*   is used to recognize network filesystems. Block devices are looked up in
+*   sysfs. A partition has no queue of its own, so we try its parent disk.
+*/
+DeviceClass DevicePool::classify(dev_t dev, const char* path) {
+  struct statfs sfs;
+  if (path && (0 == statfs(path, &sfs))) {
+    switch ((unsigned long) sfs.f_type) {
+      case FS_MAGIC_NFS:
+      case FS_MAGIC_SMB:
+      case FS_MAGIC_CIFS:
+      case FS_MAGIC_SMB2:
+      case FS_MAGIC_CEPH:
+      case FS_MAGIC_AFS:
+      case FS_MAGIC_9P:
+      case FS_MAGIC_CODA:
+      case FS_MAGIC_FUSE:
+        return DeviceClass::NETWORK;
+      default:
+        break;
+    }
+  }
+  if (0 != major(dev)) {
+    char sys_dir[64];
+    snprintf(sys_dir, sizeof(sys_dir), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    int rot = _read_rotational(sys_dir);
+    if (rot < 0) {
+      strcat(sys_dir, "/..");
+      rot = _read_rotational(sys_dir);
+    }
+    if (rot >= 0) {
+      return (1 == rot) ? DeviceClass::HDD : DeviceClass::SSD;
+    }
+  }
+  return DeviceClass::OTHER;
+}
+
+
+const char* DevicePool::classString(DeviceClass c) {
+  switch (c) {
+    case DeviceClass::SSD:      return "ssd";
+    case DeviceClass::HDD:      return "hdd";
+    case DeviceClass::NETWORK:  return "network";
+    default:                    return "other";
+  }
+}
+
+
+
+/*******************************************************************************
+* DevicePool
+*******************************************************************************/
+
+DevicePool::DevicePool(ScanScheduler* sched, dev_t dev, DeviceClass c) : _sched(sched), _dev(dev), _class(c) {}
+
+
+DevicePool::~DevicePool() {
+  stop();
+}
+
+
+/*
+* Returns the pool that the calling thread works for, if any.
+*/
+DevicePool* DevicePool::current() {
+  return _worker_pool;
+}
+
+
+/*
+* Set the number of workers allowed to take work, spawning threads if there
+*   are not yet enough of them.
+*/
+void DevicePool::resize(unsigned int active) {
+  if (0 == active) {
+    active = 1;
+  }
+  if (active > DEVICE_POOL_MAX_THREADS) {
+    active = DEVICE_POOL_MAX_THREADS;
+  }
+  std::lock_guard<std::mutex> ctrl(_ctrl_mutex);
+  if (!_running) {
+    return;
+  }
+  while (_spawned.load() < active) {
+    const unsigned int idx = _spawned.load();
+    _threads.push_back(new std::thread(&DevicePool::_worker, this, idx));
+    _spawned++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_wake_mutex);
+    _active = active;
+  }
+  _park_cv.notify_all();
+  _work_cv.notify_all();
+}
+
+
+/*
+* Stop and join every worker. Anything still queued is discarded.
+*/
+void DevicePool::stop() {
+  std::lock_guard<std::mutex> ctrl(_ctrl_mutex);
+  {
+    std::lock_guard<std::mutex> lock(_wake_mutex);
+    _running = false;
+  }
+  _park_cv.notify_all();
+  _work_cv.notify_all();
+  while (_threads.size() > 0) {
+    std::thread* t = _threads.back();
+    _threads.pop_back();
+    t->join();
+    delete t;
+  }
+  for (unsigned int i = 0; i < DEVICE_POOL_MAX_THREADS; i++) {
+    ScanChunk* cur = _deques[i].steal();
+    while (cur) {
+      for (unsigned int n = 0; n < cur->count; n++) {
+        _sched->_stage_traverse.remove(1, cur->items[n]->footprint());
+        delete cur->items[n];
+      }
+      delete cur;
+      cur = _deques[i].steal();
+    }
+  }
+  _queued = 0;
+}
+
+
+/*
+* Queue a chunk. Our own workers push onto their own deque. Anyone else is
+*   spread across the active deques round-robin.
+*/
+void DevicePool::push(ScanChunk* chunk) {
+  unsigned int idx = (_worker_pool == this) ? (unsigned int) _worker_idx : (_next_deque++ % _active.load());
+  _deques[idx].push(chunk);
+  _queued++;
+  if (_sleepers.load() > 0) {
+    std::lock_guard<std::mutex> lock(_wake_mutex);
+    _work_cv.notify_one();
+  }
+}
+
+
+/*
+* Examine one queued chunk in the calling worker's thread, on behalf of a
+*   directory reader that is over budget. Only our own workers may help.
+* Returns false if the caller is not ours, or there was nothing to take.
+*/
+bool DevicePool::helpOnce() {
+  if (_worker_pool != this) {
+    return false;
+  }
+  ScanChunk* chunk = _take_work((unsigned int) _worker_idx);
+  if (nullptr == chunk) {
+    return false;
+  }
+  _sched->_examine_chunk(chunk);
+  delete chunk;
+  return true;
+}
+
+
+/*
+* Take work from our own deque, or steal it from another worker's. Parked
+*   workers' deques are included, so nothing is stranded by a shrink.
+*/
+ScanChunk* DevicePool::_take_work(unsigned int idx) {
+  ScanChunk* ret = _deques[idx].pop();
+  const unsigned int dq_count = _spawned.load();
+  for (unsigned int i = 1; ((nullptr == ret) && (i < dq_count)); i++) {
+    ret = _deques[(idx + i) % dq_count].steal();
+    if (ret) {
+      _sched->_steals++;
+    }
+  }
+  if (ret) {
+    _queued--;
+  }
+  return ret;
+}
+
+
+void DevicePool::_worker(unsigned int idx) {
+  _worker_pool = this;
+  _worker_idx  = (int) idx;
+  while (_running) {
+    if (idx >= _active.load()) {
+      std::unique_lock<std::mutex> lock(_wake_mutex);
+      _park_cv.wait(lock, [this, idx]{ return ((idx < _active.load()) || !_running); });
+      continue;
+    }
+    ScanChunk* chunk = _take_work(idx);
+    if (chunk) {
+      _sched->_examine_chunk(chunk);
+      delete chunk;
+    }
+    else {
+      std::unique_lock<std::mutex> lock(_wake_mutex);
+      _sleepers++;
+      _work_cv.wait(lock, [this, idx]{ return ((_queued.load() > 0) || !_running || (idx >= _active.load())); });
+      _sleepers--;
+    }
+  }
+}
+
+
+/*
+* Forget what the controller learned. The next sample starts a fresh climb
+*   from whatever size the pool has.
+*/
+void DevicePool::resetTuning() {
+  _last_files = _files_done.load();
+  _last_bytes = _bytes_done.load();
+  _last_score = 0.0;
+  _step_dir   = 1;
+}
+
+
+/*
+* One step of the controller. Throughput since the last sample is scored as
+*   files examined plus bytes hashed (weighted by TUNE_BYTES_PER_FILE), and
+*   smoothed against earlier samples, since a single sample can land in the
+*   middle of one large file. The pool is then hill-climbed toward the size
+*   that scores best:
+*   - A pool with nothing queued is starved, not slow. It is left alone.
+*   - If io pressure is over the limit, the pool shrinks.
+*   - If the score improved by 5% or more, we take another step the same way.
+*   - If it fell by 5% or more, we turn around.
+*   - Otherwise we are on a plateau, and hold.
+*/
+void DevicePool::tune(ScanOptions* opts, int io_pressure, double secs) {
+  const unsigned long files = _files_done.load();
+  const unsigned long bytes = _bytes_done.load();
+  const double last  = _last_score;
+  const double raw   = ((files - _last_files) + ((bytes - _last_bytes) / (double) TUNE_BYTES_PER_FILE)) / secs;
+  const double score = (last > 0.0) ? ((raw + last) / 2.0) : raw;
+  _last_files = files;
+  _last_bytes = bytes;
+  _last_score = score;
+  if (0 == _queued.load()) {
+    return;
+  }
+
+  int step = 0;
+  if ((io_pressure >= 0) && ((unsigned int) io_pressure >= opts->tune_psi_limit)) {
+    _step_dir = -1;
+    step = -1;
+  }
+  else if (last <= 0.0) {
+    step = _step_dir;
+  }
+  else if (score >= (last * 1.05)) {
+    step = _step_dir;
+  }
+  else if (score <= (last * 0.95)) {
+    _step_dir = -_step_dir;
+    step = _step_dir;
+  }
+
+  const unsigned int lo  = (opts->tune_min > 0) ? opts->tune_min : 1;
+  const unsigned int hi  = (opts->tune_max >= lo) ? opts->tune_max : lo;
+  const unsigned int cur = _active.load();
+  unsigned int next = cur;
+  if (step > 0) {
+    next = cur + 1;
+  }
+  else if ((step < 0) && (cur > 0)) {
+    next = cur - 1;
+  }
+  if (next < lo) {
+    next = lo;
+    _step_dir = 1;
+  }
+  else if (next > hi) {
+    next = hi;
+    _step_dir = -1;
+  }
+  if (next != cur) {
+    c3p_log(LOG_LEV_DEBUG, __PRETTY_FUNCTION__, "Device %u:%u: %u -> %u workers (%.1f/s, was %.1f/s, io pressure %d%%).", major(_dev), minor(_dev), cur, next, score, last, io_pressure);
+    resize(next);
+  }
+}
+
+
+void DevicePool::printDebug(StringBuilder* output) {
+  output->concatf("  Device %u:%u (%s)\n", major(_dev), minor(_dev), classString(_class));
+  output->concatf("    Workers:     %u active of %u (%u idle)\n", _active.load(), _spawned.load(), _sleepers.load());
+  output->concatf("    Queued:      %ld\n", _queued.load());
+  output->concatf("    Throughput:  %.1f/s\n", _last_score.load());
+}
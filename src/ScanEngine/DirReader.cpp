@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+
+/* The kernel's record format for getdents64(). */
+struct linux_dirent64 {
+  uint64_t       d_ino;
+  int64_t        d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[];
+};
+
+// Each thread keeps its read buffers for its lifetime. Readers nest when a
+//   worker helps out in the middle of a directory, so there is one buffer for
+//   each level it may reach.
+static thread_local uint8_t*     _tl_dirent_bufs[SCAN_HELP_DEPTH_MAX + 1] = {};
+static thread_local unsigned int _tl_dirent_depth = 0;
+
+// fds held open by ScanDirHandles, and the most we will allow.
+static std::atomic<unsigned int> _dir_fds_open{0};
+static unsigned int _dir_fd_budget = 0;
+
+const unsigned int FD_RESERVE = 256;  // Kept free for hashing, MySQL, and the console.
+
+
+
+/*******************************************************************************
+* ScanDirHandle
+*******************************************************************************/
+
+/*
+* Set the number of directory fds we may hold. Zero derives the budget from
+*   RLIMIT_NOFILE, after raising the soft limit as far as the hard limit allows.
+*/
+void ScanDirHandle::setBudget(unsigned int b) {
+  if (0 == b) {
+    struct rlimit rl;
+    if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+      if (rl.rlim_cur < rl.rlim_max) {
+        rlim_t prior = rl.rlim_cur;
+        rl.rlim_cur = rl.rlim_max;
+        if (0 != setrlimit(RLIMIT_NOFILE, &rl)) {
+          rl.rlim_cur = prior;
+        }
+      }
+      if (rl.rlim_cur > (2 * FD_RESERVE)) {
+        b = (unsigned int) (((rl.rlim_cur - FD_RESERVE) > 1000000) ? 1000000 : (rl.rlim_cur - FD_RESERVE));
+      }
+    }
+  }
+  _dir_fd_budget = b;
+}
+
+bool ScanDirHandle::withinBudget() {       return (_dir_fds_open.load() <= _dir_fd_budget);  }
+unsigned int ScanDirHandle::budget() {     return _dir_fd_budget;        }
+unsigned int ScanDirHandle::openCount() {  return _dir_fds_open.load();  }
+
+
+/*
+* Open a directory for reading. If the parent is given, the name is resolved
+*   against it. Otherwise the absolute path is used.
+* Returns a handle with one reference held by the caller, or nullptr on failure.
+*   The handle is returned even if the budget is exhausted, since the caller
+*   still has to read the directory. It should check withinBudget() before
+*   handing the handle to children.
+*/
+ScanDirHandle* ScanDirHandle::open(ScanDirHandle* parent, const char* name, const char* path) {
+  const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW;
+  int f = ((nullptr != parent) && (parent->fd >= 0)) ? ::openat(parent->fd, name, flags) : ::open(path, flags);
+  if (f < 0) {
+    return nullptr;
+  }
+  _dir_fds_open++;
+  return new ScanDirHandle(f);
+}
+
+
+void ScanDirHandle::release() {
+  if (0 == --_refs) {
+    delete this;
+  }
+}
+
+
+ScanDirHandle::~ScanDirHandle() {
+  if (fd >= 0) {
+    ::close(fd);
+    _dir_fds_open--;
+  }
+}
+
+
+
+/*******************************************************************************
+* DirReader
+*******************************************************************************/
+
+DirReader::~DirReader() {
+  close();
+}
+
+
+/*
+* Take the calling thread's next free buffer. Readers on a thread are opened
+*   and closed in LIFO order, so the buffers are used as a stack.
+*/
+int DirReader::_acquire_buffer() {
+  if (_tl_dirent_depth > SCAN_HELP_DEPTH_MAX) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Too many directories open at once on one thread.");
+    return -1;
+  }
+  uint8_t** slot = &_tl_dirent_bufs[_tl_dirent_depth];
+  if (nullptr == *slot) {
+    *slot = (uint8_t*) malloc(DIR_READ_BUFFER_SIZE);
+    if (nullptr == *slot) {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate a directory buffer.");
+      return -1;
+    }
+  }
+  _buf = *slot;
+  _tl_dirent_depth++;
+  return 0;
+}
+
+
+/*
+* Open a directory by path. Returns 0 on success, -1 on failure.
+*/
+int DirReader::open(const char* path) {
+  close();
+  if (0 != _acquire_buffer()) {
+    return -1;
+  }
+  _fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  _owns_fd = true;
+  return (_fd >= 0) ? 0 : -1;
+}
+
+
+/*
+* Read from a directory fd that someone else owns. Returns 0 on success, -1 on
+*   failure.
+*/
+int DirReader::attach(int fd) {
+  close();
+  if ((fd < 0) || (0 != _acquire_buffer())) {
+    return -1;
+  }
+  _fd = fd;
+  _owns_fd = false;
+  return 0;
+}
+
+
+/*
+* Fetch the next entry, skipping "." and "..". The name pointer is valid until
+*   the next call.
+* Returns 1 if an entry was produced, 0 at the end of the directory, and -1 on
+*   a read error.
+*/
+int DirReader::next(const char** name, uint8_t* d_type) {
+  while (_fd >= 0) {
+    if (_pos >= _len) {
+      _len = syscall(SYS_getdents64, _fd, _buf, DIR_READ_BUFFER_SIZE);
+      _pos = 0;
+      if (_len <= 0) {
+        int ret = (0 == _len) ? 0 : -1;
+        _len = 0;
+        return ret;
+      }
+    }
+    struct linux_dirent64* ent = (struct linux_dirent64*) (_buf + _pos);
+    _pos += ent->d_reclen;
+    const char* n = ent->d_name;
+    if (('.' == n[0]) && (('\0' == n[1]) || (('.' == n[1]) && ('\0' == n[2])))) {
+      continue;
+    }
+    *name   = n;
+    *d_type = ent->d_type;
+    return 1;
+  }
+  return -1;
+}
+
+
+void DirReader::close() {
+  if (_fd >= 0) {
+    if (_owns_fd) {
+      ::close(_fd);
+    }
+    _fd = -1;
+  }
+  if (_buf) {
+    _buf = nullptr;
+    _tl_dirent_depth--;
+  }
+  _len = 0;
+  _pos = 0;
+}
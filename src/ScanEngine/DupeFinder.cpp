@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+
+DupeFinder::~DupeFinder() {
+  for (Item& item : _items) {
+    PathArena::release(item.node);
+  }
+}
+
+
+/*
+* Take the sizes held by more than one inode, and narrow them down to groups of
+*   files with the same content. Reads are spread over the given number of
+*   threads.
+* Returns 0 on success, -1 on failure.
+*/
+int DupeFinder::run(SizeTable* sizes, unsigned int threads) {
+  _files_seen = sizes->filesSeen();
+  _bytes_seen = sizes->bytesSeen();
+  std::vector<SizeTable::Group> shared;
+  sizes->take(&shared);
+
+  std::vector<Span> spans;
+  for (SizeTable::Group& g : shared) {
+    Span span = { _items.size(), 0 };
+    for (SizeTable::Entry& e : g.members) {
+      Item item;
+      item.node = e.node;
+      item.dev  = e.dev;
+      item.ino  = e.ino;
+      item.size = g.size;
+      item.ok   = false;
+      _items.push_back(item);
+    }
+    span.end = _items.size();
+    spans.push_back(span);
+  }
+  _files_shared = _items.size();
+  shared.clear();
+
+  const uint64_t whole_size = 2 * (uint64_t) _opts->dupes_sample;
+  _pass(&spans, false, threads);
+  if (_opts->dupes_confirm) {
+    // Files that were read whole in the first pass are already confirmed.
+    std::vector<Span> sampled;
+    std::vector<Span> confirmed;
+    for (Span& span : spans) {
+      ((_items[span.begin].size > whole_size) ? &sampled : &confirmed)->push_back(span);
+    }
+    _pass(&sampled, true, threads);
+    spans.swap(confirmed);
+    spans.insert(spans.end(), sampled.begin(), sampled.end());
+  }
+
+  for (Span& span : spans) {
+    Group g;
+    g.size      = _items[span.begin].size;
+    g.confirmed = _opts->dupes_confirm || (g.size <= whole_size);
+    memcpy(g.hash, _items[span.begin].digest, 32);
+    for (size_t i = span.begin; i < span.end; i++) {
+      g.members.push_back(_items[i].node);
+      if ((i == span.begin) || (_items[i].dev != _items[i - 1].dev) || (_items[i].ino != _items[i - 1].ino)) {
+        g.inodes++;
+      }
+    }
+    _groups.push_back(std::move(g));
+  }
+  return 0;
+}
+
+
+/*
+* Hash one inode from each run of links in the given spans, with as many
+*   threads as we were given. Every link takes its inode's digest, and the
+*   spans are then split by digest.
+*/
+void DupeFinder::_pass(std::vector<Span>* spans, bool full, unsigned int threads) {
+  std::vector<size_t> work;
+  for (Span& span : *spans) {
+    for (size_t i = span.begin; i < span.end; i++) {
+      if ((i == span.begin) || (_items[i].dev != _items[i - 1].dev) || (_items[i].ino != _items[i - 1].ino)) {
+        work.push_back(i);
+      }
+    }
+  }
+  // In inode order, which is the closest we can cheaply get to disk order.
+  std::sort(work.begin(), work.end(), [this](size_t a, size_t b) {
+    const Item& x = _items[a];
+    const Item& y = _items[b];
+    return (x.dev != y.dev) ? (x.dev < y.dev) : (x.ino < y.ino);
+  });
+
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    Sha256 hasher;
+    std::vector<uint8_t> buf;
+    size_t i;
+    while ((i = next++) < work.size()) {
+      _read(&_items[work[i]], full, &hasher, &buf);
+    }
+  };
+  if (0 == threads) {
+    threads = 1;
+  }
+  std::vector<std::thread*> pool;
+  for (unsigned int t = 1; (t < threads) && (t < work.size()); t++) {
+    pool.push_back(new std::thread(worker));
+  }
+  worker();
+  for (std::thread* t : pool) {
+    t->join();
+    delete t;
+  }
+
+  for (Span& span : *spans) {
+    for (size_t i = span.begin + 1; i < span.end; i++) {
+      Item* item = &_items[i];
+      Item* prev = &_items[i - 1];
+      if ((item->dev == prev->dev) && (item->ino == prev->ino)) {
+        memcpy(item->digest, prev->digest, 32);
+        item->ok = prev->ok;
+      }
+    }
+  }
+  _regroup(spans);
+}
+
+
+/*
+* Split each span into runs of equal digest, and keep the runs that still hold
+*   more than one inode. Files that could not be read are dropped.
+*/
+void DupeFinder::_regroup(std::vector<Span>* spans) {
+  std::vector<Span> kept;
+  for (Span& span : *spans) {
+    std::sort(_items.begin() + span.begin, _items.begin() + span.end, [](const Item& a, const Item& b) {
+      if (a.ok != b.ok) {  return a.ok;  }
+      const int cmp = memcmp(a.digest, b.digest, 32);
+      if (0 != cmp) {      return (cmp < 0);  }
+      return (a.dev != b.dev) ? (a.dev < b.dev) : (a.ino < b.ino);
+    });
+    size_t run = span.begin;
+    while ((run < span.end) && _items[run].ok) {
+      size_t end = run + 1;
+      bool inodes = false;
+      while ((end < span.end) && _items[end].ok && (0 == memcmp(_items[end].digest, _items[run].digest, 32))) {
+        inodes = inodes || (_items[end].dev != _items[run].dev) || (_items[end].ino != _items[run].ino);
+        end++;
+      }
+      if (inodes) {
+        Span s = { run, end };
+        kept.push_back(s);
+      }
+      run = end;
+    }
+  }
+  spans->swap(kept);
+}
+
+
+/*
+* Hash a file's head and tail, or the whole of it. A file that fits in its two
+*   samples is read whole either way. Large files are streamed.
+*/
+void DupeFinder::_read(Item* item, bool full, Sha256* hasher, std::vector<uint8_t>* buf) {
+  const size_t   sample = _opts->dupes_sample;
+  const bool     whole  = full || (item->size <= (2 * (uint64_t) sample));
+  const char*    path   = PathArena::fullPath(item->node);
+  item->ok = false;
+  const int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open %s: %s", path, strerror(errno));
+    _files_failed++;
+    return;
+  }
+  hasher->init();
+  uint64_t total_read = 0;
+  bool read_ok = true;
+  StreamReader* stream = (whole && (item->size >= STREAM_MIN_FILE_SIZE)) ? StreamReader::forThisThread() : nullptr;
+  if (stream) {
+    stream->begin(fd, item->size, _opts->direct_io);
+    size_t r_len = 0;
+    const uint8_t* data = stream->next(&r_len);
+    while (data) {
+      hasher->update(data, r_len);
+      total_read += r_len;
+      data = stream->next(&r_len);
+    }
+    read_ok = (0 == stream->end());
+  }
+  else if (whole) {
+    buf->resize(HASH_BUFFER_SIZE);
+    while (total_read < item->size) {
+      const ssize_t r_len = read(fd, buf->data(), HASH_BUFFER_SIZE);
+      if (r_len > 0) {
+        hasher->update(buf->data(), (size_t) r_len);
+        total_read += (uint64_t) r_len;
+      }
+      else if ((0 == r_len) || (EINTR != errno)) {
+        break;
+      }
+    }
+  }
+  else {
+    buf->resize(sample);
+    const off_t offsets[2] = { 0, (off_t) (item->size - sample) };
+    for (unsigned int i = 0; read_ok && (i < 2); i++) {
+      read_ok = ((ssize_t) sample == pread(fd, buf->data(), sample, offsets[i]));
+      if (read_ok) {
+        hasher->update(buf->data(), sample);
+        total_read += sample;
+      }
+    }
+  }
+  close(fd);
+  hasher->final(item->digest);
+  _bytes_read += total_read;
+  if (read_ok && (!whole || (total_read == item->size))) {
+    item->ok = true;
+    if (whole) {
+      _files_hashed++;
+    }
+    else {
+      _files_sampled++;
+    }
+  }
+  else {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to read %s. It changed during the scan, or could not be read.", path);
+    _files_failed++;
+  }
+}
+
+
+void DupeFinder::printDebug(StringBuilder* output) {
+  unsigned long members   = 0;
+  unsigned long confirmed = 0;
+  uint64_t      redundant = 0;   // Bytes that keeping one inode of each group would free.
+  for (Group& g : _groups) {
+    members += g.members.size();
+    if (g.confirmed) {
+      confirmed++;
+    }
+    redundant += g.size * (g.inodes - 1);
+  }
+  output->concatf("Duplicates\n");
+  output->concatf("  Files:         %lu (%lu MiB), %lu sharing a size with another inode\n", _files_seen, (unsigned long) (_bytes_seen >> 20), _files_shared);
+  output->concatf("  Read:          %lu sampled, %lu whole, %lu failed, %lu MiB (%.2f%% of the bytes seen)\n",
+    _files_sampled.load(), _files_hashed.load(), _files_failed.load(), (unsigned long) (_bytes_read.load() >> 20),
+    (_bytes_seen) ? ((100.0 * _bytes_read.load()) / _bytes_seen) : 0.0
+  );
+  output->concatf("  Groups:        %lu (%lu confirmed), holding %lu files\n", (unsigned long) _groups.size(), confirmed, members);
+  output->concatf("  Redundant:     %lu MiB\n", (unsigned long) (redundant >> 20));
+}
@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <mntent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+#define FANOTIFY_MASK  (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+#define INOTIFY_MASK   (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+
+/*
+* Join a relative directory and a name into a new malloc'd relative path.
+*/
+static char* _join(const char* rel_dir, const char* name) {
+  const size_t d_len = strlen(rel_dir);
+  const size_t n_len = (name) ? strlen(name) : 0;
+  char* ret = (char*) malloc(d_len + n_len + 2);
+  if (ret) {
+    memcpy(ret, rel_dir, d_len);
+    size_t w = d_len;
+    if (n_len) {
+      if (d_len) {
+        ret[w++] = '/';
+      }
+      memcpy(ret + w, name, n_len);
+      w += n_len;
+    }
+    ret[w] = '\0';
+  }
+  return ret;
+}
+
+
+/*
+* Is path the same as, or beneath, the given prefix?
+*/
+static bool _under(const char* path, const char* prefix, size_t prefix_len) {
+  if (0 == prefix_len) {
+    return true;
+  }
+  return ((0 == strncmp(path, prefix, prefix_len)) && (('\0' == path[prefix_len]) || ('/' == path[prefix_len])));
+}
+
+
+
+/*******************************************************************************
+* FsWatcher
+*******************************************************************************/
+
+FsWatcher::~FsWatcher() {
+  close();
+}
+
+
+/*
+* Start watching the tree under root, with the backend the options ask for.
+* Returns 0 on success, -1 on failure.
+*/
+int FsWatcher::open(const char* root, ScanOptions* opts) {
+  close();
+  struct stat64 st;
+  if ((0 != lstat64(root, &st)) || !S_ISDIR(st.st_mode)) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "%s is not a directory.", root);
+    return -1;
+  }
+  _opts     = opts;
+  _root_dev = st.st_dev;
+  _root_len = strlen(root);
+  while ((_root_len > 1) && ('/' == root[_root_len - 1])) {
+    _root_len--;
+  }
+  _root = strndup(root, _root_len);
+  _buf  = (uint8_t*) malloc(WATCH_EVENT_BUFFER_SIZE);
+  if ((nullptr == _root) || (nullptr == _buf)) {
+    close();
+    return -1;
+  }
+  int ret = -1;
+  if (WatchBackend::INOTIFY != opts->watch_backend) {
+    ret = _open_fanotify();
+    if ((0 != ret) && (WatchBackend::FANOTIFY == opts->watch_backend)) {
+      close();
+      return -1;
+    }
+  }
+  if (0 != ret) {
+    ret = _open_inotify();
+  }
+  if (0 != ret) {
+    close();
+  }
+  return ret;
+}
+
+
+void FsWatcher::close() {
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  if (_mount_fd >= 0) {
+    ::close(_mount_fd);
+    _mount_fd = -1;
+  }
+  for (auto& it : _wd_paths) {
+    free(it.second);
+  }
+  _wd_paths.clear();
+  if (_root) {
+    free(_root);
+    _root = nullptr;
+  }
+  if (_buf) {
+    free(_buf);
+    _buf = nullptr;
+  }
+  _backend = WatchBackend::AUTO;
+}
+
+
+/*
+* Wait up to the given time for events, and append whatever arrives.
+* Returns the number of events appended, or -1 if we are not watching.
+*/
+int FsWatcher::poll(unsigned int timeout_ms, std::vector<WatchEvent>* events) {
+  if (_fd < 0) {
+    return -1;
+  }
+  const size_t before = events->size();
+  struct pollfd pfd;
+  pfd.fd      = _fd;
+  pfd.events  = POLLIN;
+  pfd.revents = 0;
+  if (::poll(&pfd, 1, (int) timeout_ms) > 0) {
+    if (WatchBackend::FANOTIFY == _backend) {
+      _read_fanotify(events);
+    }
+    else {
+      _read_inotify(events);
+    }
+  }
+  return (int) (events->size() - before);
+}
+
+
+/*
+* Mark the root's filesystem, and (unless we stay on one) every filesystem
+*   mounted beneath it. Events are reported as a directory handle and a name.
+*/
+int FsWatcher::_open_fanotify() {
+  _fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+  if (_fd < 0) {
+    c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "fanotify is not available (%s).", strerror(errno));
+    return -1;
+  }
+  _mount_fd = ::open(_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if ((_mount_fd < 0) || (0 != fanotify_mark(_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, _root))) {
+    c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Could not mark %s with fanotify (%s).", _root, strerror(errno));
+    ::close(_fd);
+    _fd = -1;
+    return -1;
+  }
+  if (!_opts->one_fs) {
+    FILE* mounts = setmntent("/proc/self/mounts", "r");
+    struct mntent ent;
+    char ent_buf[4096];
+    while (mounts && getmntent_r(mounts, &ent, ent_buf, sizeof(ent_buf))) {
+      if ((strlen(ent.mnt_dir) > _root_len) && _under(ent.mnt_dir, _root, _root_len)) {
+        if (0 != fanotify_mark(_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, ent.mnt_dir)) {
+          c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "Changes under %s will be missed (%s).", ent.mnt_dir, strerror(errno));
+        }
+      }
+    }
+    if (mounts) {
+      endmntent(mounts);
+    }
+  }
+  _backend = WatchBackend::FANOTIFY;
+  return 0;
+}
+
+
+int FsWatcher::_open_inotify() {
+  _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_fd < 0) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "inotify is not available (%s).", strerror(errno));
+    return -1;
+  }
+  _backend = WatchBackend::INOTIFY;
+  _add_inotify_tree("");
+  if (_wd_paths.empty()) {
+    ::close(_fd);
+    _fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+* Watch a directory and everything beneath it. Excluded directories, and other
+*   filesystems under one-fs, are skipped.
+* Returns the number of directories watched.
+*/
+int FsWatcher::_add_inotify_tree(const char* rel_path) {
+  int ret = 0;
+  std::vector<char*> stack(1, strdup(rel_path));
+  while (!stack.empty()) {
+    char* rel = stack.back();
+    stack.pop_back();
+    if (nullptr == rel) {
+      continue;
+    }
+    char* full = _join(_root, rel);
+    const int wd = (full) ? inotify_add_watch(_fd, full, INOTIFY_MASK) : -1;
+    if (wd < 0) {
+      if ((ENOSPC == errno) && !_told_limit) {
+        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Out of inotify watches. Raise fs.inotify.max_user_watches. Changes under unwatched directories will be missed.");
+        _told_limit = true;
+      }
+      _watch_failures++;
+      free(full);
+      free(rel);
+      continue;
+    }
+    ret++;
+    auto it = _wd_paths.find(wd);
+    if (it != _wd_paths.end()) {
+      free(it->second);    // Already watched, under its old name.
+    }
+    _wd_paths[wd] = rel;
+
+    DIR* dir = opendir(full);
+    struct dirent* ent;
+    while (dir && (ent = readdir(dir))) {
+      if ((0 == strcmp(ent->d_name, ".")) || (0 == strcmp(ent->d_name, ".."))) {
+        continue;
+      }
+      bool is_dir = (DT_DIR == ent->d_type);
+      if ((DT_UNKNOWN == ent->d_type) || (is_dir && _opts->one_fs)) {
+        struct stat64 st;
+        is_dir = ((0 == fstatat64(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) && S_ISDIR(st.st_mode));
+        if (is_dir && _opts->one_fs && (st.st_dev != _root_dev)) {
+          continue;
+        }
+      }
+      if (!is_dir) {
+        continue;
+      }
+      char* child = _join(rel, ent->d_name);
+      if (child && (RuleVerdict::EXCLUDE == _opts->rules.evaluate(child, ent->d_name, true, false, 0, 0))) {
+        free(child);
+        continue;
+      }
+      stack.push_back(child);
+    }
+    if (dir) {
+      closedir(dir);
+    }
+    free(full);
+  }
+  return ret;
+}
+
+
+/*
+* Stop watching a directory that moved away, and everything beneath it.
+*/
+void FsWatcher::_drop_inotify_tree(const char* rel_path) {
+  const size_t len = strlen(rel_path);
+  for (auto it = _wd_paths.begin(); it != _wd_paths.end(); ) {
+    if ((0 != len) && _under(it->second, rel_path, len)) {
+      inotify_rm_watch(_fd, it->first);
+      free(it->second);
+      it = _wd_paths.erase(it);
+    }
+    else {
+      it++;
+    }
+  }
+}
+
+
+/*
+* Translate a full path into one relative to the root. The result points into
+*   the argument.
+* Returns nullptr if the path is outside the root.
+*/
+const char* FsWatcher::_relative(const char* full) {
+  if (!_under(full, _root, _root_len)) {
+    return nullptr;
+  }
+  full += _root_len;
+  return ('/' == *full) ? (full + 1) : full;
+}
+
+
+void FsWatcher::_emit(std::vector<WatchEvent>* events, const char* rel_dir, const char* name, uint8_t flags) {
+  WatchEvent ev;
+  ev.rel_path = _join(rel_dir, name);
+  ev.flags    = flags;
+  if (ev.rel_path) {
+    events->push_back(ev);
+  }
+}
+
+
+void FsWatcher::_read_fanotify(std::vector<WatchEvent>* events) {
+  ssize_t len;
+  while ((len = read(_fd, _buf, WATCH_EVENT_BUFFER_SIZE)) > 0) {
+    struct fanotify_event_metadata* meta = (struct fanotify_event_metadata*) _buf;
+    for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+      _events++;
+      if (FANOTIFY_METADATA_VERSION != meta->vers) {
+        c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "fanotify reports version %u, and we speak %u.", meta->vers, FANOTIFY_METADATA_VERSION);
+        return;
+      }
+      if (meta->mask & FAN_Q_OVERFLOW) {
+        _overflows++;
+        WatchEvent ev;
+        ev.flags = WATCH_EV_OVERFLOW;
+        events->push_back(ev);
+        continue;
+      }
+      if (meta->event_len <= meta->metadata_len) {
+        continue;
+      }
+      struct fanotify_event_info_fid* fid = (struct fanotify_event_info_fid*) (meta + 1);
+      if (FAN_EVENT_INFO_TYPE_DFID_NAME != fid->hdr.info_type) {
+        continue;
+      }
+      struct file_handle* handle = (struct file_handle*) fid->handle;
+      const char* name = (const char*) (handle->f_handle + handle->handle_bytes);
+      if (0 == strcmp(name, ".")) {
+        name = nullptr;    // The event is on the directory itself.
+      }
+
+      // Turn the directory's handle into its current path.
+      char link[32];
+      char dir_path[PATH_MAX];
+      const int dir_fd = open_by_handle_at(_mount_fd, handle, O_PATH | O_CLOEXEC);
+      if (dir_fd < 0) {
+        continue;    // Gone already. Its parent will report it.
+      }
+      snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+      const ssize_t p_len = readlink(link, dir_path, sizeof(dir_path) - 1);
+      ::close(dir_fd);
+      if (p_len <= 0) {
+        continue;
+      }
+      dir_path[p_len] = '\0';
+      const char* rel_dir = _relative(dir_path);
+      if (nullptr == rel_dir) {
+        continue;    // Elsewhere on the filesystem.
+      }
+
+      uint8_t flags = (meta->mask & FAN_ONDIR) ? WATCH_EV_DIR : 0;
+      if (meta->mask & (FAN_CREATE | FAN_MOVED_TO)) {
+        flags |= (WATCH_EV_CHANGED | WATCH_EV_NEW);
+      }
+      if (meta->mask & (FAN_DELETE | FAN_MOVED_FROM)) {
+        flags |= WATCH_EV_GONE;
+      }
+      if (meta->mask & (FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ATTRIB)) {
+        flags |= WATCH_EV_CHANGED;
+      }
+      if (nullptr == name) {
+        flags |= WATCH_EV_DIR;
+      }
+      _emit(events, rel_dir, name, flags);
+    }
+  }
+}
+
+
+void FsWatcher::_read_inotify(std::vector<WatchEvent>* events) {
+  ssize_t len;
+  while ((len = read(_fd, _buf, WATCH_EVENT_BUFFER_SIZE)) > 0) {
+    for (ssize_t off = 0; off < len; ) {
+      struct inotify_event* ev = (struct inotify_event*) (_buf + off);
+      off += sizeof(struct inotify_event) + ev->len;
+      _events++;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        _overflows++;
+        WatchEvent o;
+        o.flags = WATCH_EV_OVERFLOW;
+        events->push_back(o);
+        continue;
+      }
+      auto it = _wd_paths.find(ev->wd);
+      if (it == _wd_paths.end()) {
+        continue;
+      }
+      if (ev->mask & IN_IGNORED) {
+        free(it->second);
+        _wd_paths.erase(it);
+        continue;
+      }
+      const char* rel_dir = it->second;
+      const char* name    = (ev->len > 0) ? ev->name : nullptr;
+      if (nullptr == name) {
+        // Events on the directory itself. Only a change of its metadata is
+        //   news. Its parent reports the rest.
+        if (ev->mask & IN_ATTRIB) {
+          _emit(events, rel_dir, nullptr, WATCH_EV_CHANGED | WATCH_EV_DIR);
+        }
+        continue;
+      }
+
+      uint8_t flags = (ev->mask & IN_ISDIR) ? WATCH_EV_DIR : 0;
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        flags |= (WATCH_EV_CHANGED | WATCH_EV_NEW);
+      }
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        flags |= WATCH_EV_GONE;
+      }
+      if (ev->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)) {
+        flags |= WATCH_EV_CHANGED;
+      }
+      const size_t before = events->size();
+      _emit(events, rel_dir, name, flags);
+      if ((flags & WATCH_EV_DIR) && (events->size() > before)) {
+        // rel_dir may not survive what follows. The new event's path is ours.
+        const char* child = events->back().rel_path;
+        if (ev->mask & IN_MOVED_FROM) {
+          _drop_inotify_tree(child);
+        }
+        else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+          _add_inotify_tree(child);
+        }
+      }
+    }
+  }
+}
+
+
+void FsWatcher::printDebug(StringBuilder* output) {
+  output->concatf("Watching %s with %s\n", (_root ? _root : "nothing"), ScanOptions::watchBackendString(_backend));
+  if (WatchBackend::INOTIFY == _backend) {
+    output->concatf("  Directories:   %u watched, %lu failed\n", (unsigned int) _wd_paths.size(), _watch_failures);
+  }
+  output->concatf("  Events:        %lu (%lu overflows)\n", _events, _overflows);
+}
+
+
+
+/*******************************************************************************
+* WatchCoalescer
+*******************************************************************************/
+
+WatchCoalescer::~WatchCoalescer() {
+  for (auto& it : _pending) {
+    free(it.first);
+  }
+  for (auto& it : _hot) {
+    free(it.first);
+  }
+}
+
+
+/*
+* Take in an event. Its path becomes ours.
+*/
+void WatchCoalescer::add(WatchEvent* ev) {
+  if (ev->flags & WATCH_EV_OVERFLOW) {
+    _overflow();
+    return;
+  }
+  if (nullptr == ev->rel_path) {
+    return;
+  }
+  // The directory holding the path is now suspect.
+  char* slash = strrchr(ev->rel_path, '/');
+  char* dir   = (slash) ? strndup(ev->rel_path, (size_t) (slash - ev->rel_path)) : strdup("");
+  if (dir) {
+    auto h = _hot.find(dir);
+    if (h != _hot.end()) {
+      h->second = _now_ms;
+      free(dir);
+    }
+    else {
+      _hot[dir] = _now_ms;
+    }
+  }
+  auto it = _pending.find(ev->rel_path);
+  if (it != _pending.end()) {
+    it->second.flags  |= ev->flags;
+    it->second.last_ms = _now_ms;
+    free(ev->rel_path);
+  }
+  else {
+    Entry e = { ev->flags, _now_ms, _now_ms };
+    _pending[ev->rel_path] = e;
+  }
+  ev->rel_path = nullptr;
+}
+
+
+/*
+* Events were lost. Every directory that saw an event recently is read again.
+*   If none did, the whole tree is.
+*/
+void WatchCoalescer::_overflow() {
+  bool any = false;
+  for (auto& it : _hot) {
+    if ((_now_ms - it.second) < WATCH_HOT_MS) {
+      _mark(it.first, WATCH_EV_RESCAN | WATCH_EV_DIR);
+      any = true;
+    }
+  }
+  if (!any) {
+    _mark("", WATCH_EV_RESCAN | WATCH_EV_DIR);
+  }
+}
+
+
+void WatchCoalescer::_mark(const char* rel_path, uint8_t flags) {
+  auto it = _pending.find((char*) rel_path);
+  if (it != _pending.end()) {
+    it->second.flags  |= flags;
+    it->second.last_ms = _now_ms;
+    return;
+  }
+  char* key = strdup(rel_path);
+  if (key) {
+    Entry e = { flags, _now_ms, _now_ms };
+    _pending[key] = e;
+  }
+}
+
+
+/*
+* Move the paths that have gone quiet (or all of them) into out. A path is
+*   dropped if a directory above it will be read again in the same batch. The
+*   caller frees the paths.
+* Returns the number of paths taken.
+*/
+int WatchCoalescer::take(uint64_t now_ms, unsigned int debounce_ms, bool all, std::vector<WatchEvent>* out) {
+  _now_ms = now_ms;
+  for (auto it = _hot.begin(); it != _hot.end(); ) {
+    if ((now_ms - it->second) >= WATCH_HOT_MS) {
+      free(it->first);
+      it = _hot.erase(it);
+    }
+    else {
+      it++;
+    }
+  }
+
+  std::vector<const char*> rescans;
+  const size_t before = out->size();
+  for (auto it = _pending.begin(); it != _pending.end(); ) {
+    const Entry& e = it->second;
+    const bool due = all || ((now_ms - e.last_ms) >= debounce_ms) || ((now_ms - e.first_ms) >= ((uint64_t) debounce_ms * WATCH_MAX_DELAY_FACTOR));
+    if (!due) {
+      it++;
+      continue;
+    }
+    WatchEvent ev;
+    ev.rel_path = it->first;
+    ev.flags    = e.flags;
+    it = _pending.erase(it);
+    bool covered = false;
+    for (const char* r : rescans) {
+      if ((0 == *r) || ((0 == strncmp(ev.rel_path, r, strlen(r))) && ('/' == ev.rel_path[strlen(r)]))) {
+        covered = true;
+        break;
+      }
+    }
+    if (covered) {
+      free(ev.rel_path);
+      continue;
+    }
+    if ((ev.flags & WATCH_EV_DIR) && (ev.flags & (WATCH_EV_NEW | WATCH_EV_RESCAN))) {
+      rescans.push_back(ev.rel_path);
+    }
+    out->push_back(ev);
+  }
+  return (int) (out->size() - before);
+}
@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+#include "AbstractPlatform.h"
+
+
+const char     HASH_CACHE_MAGIC[8]    = { 'L', 'I', 'B', 'H', 'A', 'S', 'H', 'C' };
+const uint32_t HASH_CACHE_VERSION     = 1;
+const size_t   HASH_CACHE_HEADER_SIZE = 4096;   // The slots start on a page of their own.
+
+static HashCache* INSTANCE = nullptr;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The hash cache shares atomics with other processes.");
+
+
+HashCache* HashCache::getInstance() {
+  if (nullptr == INSTANCE) {
+    INSTANCE = new HashCache();
+  }
+  return INSTANCE;
+}
+
+
+HashCache::~HashCache() {
+  close();
+}
+
+
+/*
+* Map the cache file at the given path, creating it with the given number of
+*   slots (0 for the default) if it is new. An existing file keeps its size.
+*   Each process holds a shared lock on the file for as long as it is open, so
+*   that compaction can tell when it is alone.
+* Returns 0 on success, -1 on failure.
+*/
+int HashCache::open(const char* path, uint64_t slots) {
+  close();
+  if (0 == slots) {
+    slots = HASH_CACHE_SLOTS;
+  }
+  if ((slots < HASH_CACHE_MIN_SLOTS) || (0 != (slots & (slots - 1)))) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "A hash cache needs a power of two slots, and at least %u.", HASH_CACHE_MIN_SLOTS);
+    return -1;
+  }
+  const int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open the hash cache %s: %s", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  flock(fd, LOCK_SH);
+  if ((0 == fstat(fd, &st)) && (0 == st.st_size) && (0 == flock(fd, LOCK_EX)) && (0 == fstat(fd, &st)) && (0 == st.st_size)) {
+    // New. Nobody else will use it until we downgrade our lock.
+    void*  map = nullptr;
+    size_t len = 0;
+    if (0 != _map_file(fd, slots, &map, &len)) {
+      ::close(fd);
+      return -1;
+    }
+    Header* h = (Header*) map;
+    memcpy(h->magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC));
+    h->version   = HASH_CACHE_VERSION;
+    h->slot_size = sizeof(Slot);
+    h->slots     = slots;
+    munmap(map, len);
+  }
+  flock(fd, LOCK_SH);
+
+  Header h;
+  if ((0 != fstat(fd, &st)) || (sizeof(Header) != pread(fd, &h, sizeof(Header), 0))) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to read the hash cache %s.", path);
+    ::close(fd);
+    return -1;
+  }
+  const bool valid = (0 == memcmp(h.magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC))) &&
+                     (HASH_CACHE_VERSION == h.version) && (sizeof(Slot) == h.slot_size) &&
+                     (0 == (h.slots & (h.slots - 1))) && (h.slots >= HASH_CACHE_MIN_SLOTS) &&
+                     ((uint64_t) st.st_size == (HASH_CACHE_HEADER_SIZE + (h.slots * sizeof(Slot))));
+  if (!valid) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "%s is not a hash cache, or not one we can read. Leaving it alone.", path);
+    ::close(fd);
+    return -1;
+  }
+  _map_len = HASH_CACHE_HEADER_SIZE + (h.slots * sizeof(Slot));
+  _map = mmap(nullptr, _map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == _map) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to map the hash cache %s: %s", path, strerror(errno));
+    _map = nullptr;
+    ::close(fd);
+    return -1;
+  }
+  madvise(_map, _map_len, MADV_RANDOM);
+  _fd     = fd;
+  _path   = strdup(path);
+  _header = (Header*) _map;
+  _slots  = (Slot*) ((uint8_t*) _map + HASH_CACHE_HEADER_SIZE);
+  _mask   = h.slots - 1;
+  c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Hash cache %s has %lu of %lu slots in use.", _path, (unsigned long) _header->used.load(), (unsigned long) h.slots);
+  return 0;
+}
+
+
+void HashCache::close() {
+  if (_map) {
+    munmap(_map, _map_len);
+    _map = nullptr;
+  }
+  if (0 <= _fd) {
+    ::close(_fd);   // Drops our lock.
+    _fd = -1;
+  }
+  if (_path) {
+    free(_path);
+    _path = nullptr;
+  }
+  _header  = nullptr;
+  _slots   = nullptr;
+  _map_len = 0;
+  _mask    = 0;
+}
+
+
+/*
+* Size a new file for the given number of slots, and map it. The kernel gives
+*   us zeroes, which is an empty table.
+* Returns 0 on success, -1 on failure.
+*/
+int HashCache::_map_file(int fd, uint64_t slots, void** map, size_t* len) {
+  *len = HASH_CACHE_HEADER_SIZE + (slots * sizeof(Slot));
+  if (0 != ftruncate(fd, (off_t) *len)) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to size a hash cache of %lu slots: %s", (unsigned long) slots, strerror(errno));
+    return -1;
+  }
+  *map = mmap(nullptr, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == *map) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to map a hash cache of %lu slots: %s", (unsigned long) slots, strerror(errno));
+    *map = nullptr;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+* Start a scan's use of the cache. Files changed since a little before now
+*   might change again within the same tick of their filesystem's clock, and
+*   are not stored.
+*/
+void HashCache::beginScan() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  _settled_ns = ((int64_t) now.tv_sec * 1000000000LL) + now.tv_nsec - HASH_CACHE_SETTLE_NS;
+  _header->epoch++;
+  _hits      = 0;
+  _misses    = 0;
+  _changed   = 0;
+  _stored    = 0;
+  _evicted   = 0;
+  _unsettled = 0;
+}
+
+
+/*
+* Take a consistent copy of a slot.
+* Returns false if it was being written.
+*/
+bool HashCache::_read(Slot* slot, Entry* e, uint64_t* seq) {
+  uint64_t w[15];
+  const uint64_t s1 = slot->seq.load(std::memory_order_acquire);
+  if (s1 & 1) {
+    return false;
+  }
+  for (unsigned int i = 0; i < 15; i++) {
+    w[i] = slot->w[i].load(std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (s1 != slot->seq.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  e->dev      = w[0];
+  e->ino      = w[1];
+  e->size     = w[2];
+  e->mtime_ns = (int64_t) w[3];
+  e->ctime_ns = (int64_t) w[4];
+  e->digests  = (uint8_t) w[5];
+  e->epoch    = (uint32_t) (w[5] >> 32);
+  memcpy(e->hash,   &w[6],  32);
+  memcpy(e->blake3, &w[10], 32);
+  *seq = s1;
+  return true;
+}
+
+
+/*
+* Fill a slot, if nobody has written it since we read it at the given sequence.
+* Returns false if somebody has.
+*/
+bool HashCache::_write(Slot* slot, uint64_t seq, const Entry& e) {
+  if (!slot->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  uint64_t w[15];
+  w[0] = e.dev;
+  w[1] = e.ino;
+  w[2] = e.size;
+  w[3] = (uint64_t) e.mtime_ns;
+  w[4] = (uint64_t) e.ctime_ns;
+  w[5] = e.digests | ((uint64_t) e.epoch << 32);
+  memcpy(&w[6],  e.hash,   32);
+  memcpy(&w[10], e.blake3, 32);
+  w[14] = 0;
+  for (unsigned int i = 0; i < 15; i++) {
+    slot->w[i].store(w[i], std::memory_order_relaxed);
+  }
+  slot->seq.store(seq + 2, std::memory_order_release);
+  return true;
+}
+
+
+/*
+* If the cache holds every digest wanted for this file, and the file has not
+*   changed since they were taken, copy them out.
+* Returns true on a hit.
+*/
+bool HashCache::lookup(ORMFileData* obj, uint8_t digests, uint8_t* hash, uint8_t* blake3) {
+  const uint64_t dev  = (uint64_t) obj->device();
+  const uint64_t ino  = (uint64_t) obj->inode();
+  const uint64_t home = _home(dev, ino);
+  const uint32_t epoch = (uint32_t) _header->epoch.load(std::memory_order_relaxed);
+  for (unsigned int i = 0; i < HASH_CACHE_PROBE; i++) {
+    Slot* slot = &_slots[(home + i) & _mask];
+    Entry e;
+    uint64_t seq;
+    if (!_read(slot, &e, &seq) || (0 == e.digests) || (e.dev != dev) || (e.ino != ino)) {
+      continue;
+    }
+    if ((e.size != obj->size()) || (e.mtime_ns != obj->mtimeNs()) || (e.ctime_ns != obj->ctimeNs()) || (digests != (e.digests & digests))) {
+      _changed++;
+      break;
+    }
+    memcpy(hash, e.hash, 32);
+    memcpy(blake3, e.blake3, 32);
+    if (e.epoch != epoch) {
+      // Note that the entry is still in use. If a writer beat us to the slot,
+      //   it no longer matters.
+      uint64_t meta = e.digests | ((uint64_t) e.epoch << 32);
+      slot->w[5].compare_exchange_strong(meta, (e.digests | ((uint64_t) epoch << 32)), std::memory_order_relaxed);
+    }
+    _hits++;
+    return true;
+  }
+  _misses++;
+  return false;
+}
+
+
+/*
+* Remember the digests just taken of a file. Its own old entry is replaced, or
+*   an empty slot is taken, or the slot used longest ago is given up.
+*/
+void HashCache::store(ORMFileData* obj, uint8_t digests) {
+  if (obj->ctimeNs() >= _settled_ns) {
+    _unsettled++;
+    return;
+  }
+  Entry e;
+  e.dev      = (uint64_t) obj->device();
+  e.ino      = (uint64_t) obj->inode();
+  e.size     = obj->size();
+  e.mtime_ns = obj->mtimeNs();
+  e.ctime_ns = obj->ctimeNs();
+  e.epoch    = (uint32_t) _header->epoch.load(std::memory_order_relaxed);
+  e.digests  = digests & DIGEST_SHA256;
+  memcpy(e.hash, obj->digest(), 32);
+  memset(e.blake3, 0, 32);
+  if ((digests & DIGEST_BLAKE3) && obj->blake3()) {
+    memcpy(e.blake3, obj->blake3(), 32);
+    e.digests |= DIGEST_BLAKE3;
+  }
+  if (0 == e.digests) {
+    return;
+  }
+  bool evicted = false;
+  if (_insert(e, &evicted)) {
+    _stored++;
+    if (evicted) {
+      _evicted++;
+    }
+  }
+}
+
+
+/*
+* Put an entry in its window. If the slot we pick is written by somebody else
+*   before we can take it, the entry is dropped. This is only a cache.
+* Returns true if the entry was written.
+*/
+bool HashCache::_insert(const Entry& e, bool* evicted) {
+  const uint64_t home = _home(e.dev, e.ino);
+  Slot*    pick      = nullptr;
+  uint64_t pick_seq  = 0;
+  Entry    pick_old  = {};
+  bool     pick_mine = false;
+  for (unsigned int i = 0; i < HASH_CACHE_PROBE; i++) {
+    Slot* slot = &_slots[(home + i) & _mask];
+    Entry old;
+    uint64_t seq;
+    if (!_read(slot, &old, &seq)) {
+      continue;
+    }
+    if ((0 != old.digests) && (old.dev == e.dev) && (old.ino == e.ino)) {
+      pick      = slot;
+      pick_seq  = seq;
+      pick_old  = old;
+      pick_mine = true;
+      break;
+    }
+    if ((nullptr == pick) || ((0 != pick_old.digests) && ((0 == old.digests) || (old.epoch < pick_old.epoch)))) {
+      pick     = slot;
+      pick_seq = seq;
+      pick_old = old;
+    }
+  }
+  if (nullptr == pick) {
+    return false;
+  }
+  Entry merged = e;
+  if (pick_mine && (pick_old.size == e.size) && (pick_old.mtime_ns == e.mtime_ns) && (pick_old.ctime_ns == e.ctime_ns)) {
+    // The same content, hashed for a scan that wanted other digests.
+    if ((pick_old.digests & DIGEST_SHA256) && !(e.digests & DIGEST_SHA256)) {
+      memcpy(merged.hash, pick_old.hash, 32);
+    }
+    if ((pick_old.digests & DIGEST_BLAKE3) && !(e.digests & DIGEST_BLAKE3)) {
+      memcpy(merged.blake3, pick_old.blake3, 32);
+    }
+    merged.digests |= pick_old.digests;
+  }
+  if (!_write(pick, pick_seq, merged)) {
+    return false;
+  }
+  if (0 == pick_old.digests) {
+    _header->used++;
+  }
+  *evicted = (!pick_mine && (0 != pick_old.digests));
+  return true;
+}
+
+
+/*
+* Rewrite the cache into a new file, and swap it into place. Entries not used
+*   by any of the last max_age scans (0 keeps them all) are dropped, as are
+*   slots left mid-write. The new file has the given number of slots, or if 0,
+*   as many as it has now, or enough to keep it half empty, whichever is more.
+*   The most recently used entries are placed first, so that if the new table
+*   is too small, the oldest are the ones lost.
+* This must be the only process with the file open, and no scan may be running.
+* Returns the entries kept, or -1 on failure.
+*/
+long HashCache::compact(uint64_t slots, unsigned int max_age) {
+  if (!isOpen()) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "No hash cache is open.");
+    return -1;
+  }
+  if (0 < ScanScheduler::getInstance()->outstanding()) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Not compacting the hash cache while a scan is running.");
+    return -1;
+  }
+  if (0 != flock(_fd, LOCK_EX | LOCK_NB)) {
+    flock(_fd, LOCK_SH);
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Another process has %s open. Not compacting it.", _path);
+    return -1;
+  }
+
+  const uint64_t epoch = _header->epoch.load();
+  std::vector<Entry> live;
+  for (uint64_t i = 0; i <= _mask; i++) {
+    Entry e;
+    uint64_t seq;
+    if (_read(&_slots[i], &e, &seq) && (0 != e.digests) && ((0 == max_age) || ((uint32_t) epoch - e.epoch) < max_age)) {
+      live.push_back(e);
+    }
+  }
+  if (0 == slots) {
+    slots = _mask + 1;
+    while (slots < (2 * live.size())) {
+      slots <<= 1;
+    }
+  }
+  uint64_t rounded = HASH_CACHE_MIN_SLOTS;
+  while (rounded < slots) {
+    rounded <<= 1;
+  }
+  slots = rounded;
+  std::sort(live.begin(), live.end(), [](const Entry& a, const Entry& b) {  return (a.epoch > b.epoch);  });
+
+  StringBuilder tmp_path;
+  tmp_path.concatf("%s.compact", _path);
+  const int tmp_fd = ::open((const char*) tmp_path.string(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  void*  map = nullptr;
+  size_t len = 0;
+  if ((tmp_fd < 0) || (0 != _map_file(tmp_fd, slots, &map, &len))) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to write %s", (const char*) tmp_path.string());
+    if (0 <= tmp_fd) {
+      ::close(tmp_fd);
+      unlink((const char*) tmp_path.string());
+    }
+    flock(_fd, LOCK_SH);
+    return -1;
+  }
+
+  Header* h = (Header*) map;
+  memcpy(h->magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC));
+  h->version   = HASH_CACHE_VERSION;
+  h->slot_size = sizeof(Slot);
+  h->slots     = slots;
+  h->epoch     = epoch;
+  Slot* new_slots = (Slot*) ((uint8_t*) map + HASH_CACHE_HEADER_SIZE);
+  long kept = 0;
+  for (Entry& e : live) {
+    // Nobody else can see the new table, so an empty slot is ours to take. Two
+    //   processes may have stored one inode in two slots. The newer is kept.
+    const uint64_t home = _home(e.dev, e.ino);
+    for (unsigned int i = 0; i < HASH_CACHE_PROBE; i++) {
+      Slot* slot = &new_slots[(home + i) & (slots - 1)];
+      if ((slot->w[0].load(std::memory_order_relaxed) == e.dev) && (slot->w[1].load(std::memory_order_relaxed) == e.ino) && (0 != slot->w[5].load(std::memory_order_relaxed))) {
+        break;
+      }
+      if (0 == slot->w[5].load(std::memory_order_relaxed)) {
+        _write(slot, 0, e);
+        kept++;
+        break;
+      }
+    }
+  }
+  h->used = (uint64_t) kept;
+
+  const bool synced = (0 == msync(map, len, MS_SYNC)) && (0 == fsync(tmp_fd));
+  munmap(map, len);
+  ::close(tmp_fd);
+  if (!synced || (0 != rename((const char*) tmp_path.string(), _path))) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to replace %s: %s", _path, strerror(errno));
+    unlink((const char*) tmp_path.string());
+    flock(_fd, LOCK_SH);
+    return -1;
+  }
+  c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Kept %ld of %lu entries, in %lu slots.", kept, (unsigned long) live.size(), (unsigned long) slots);
+  char* path = strdup(_path);
+  const int ret = open(path, 0);
+  free(path);
+  return (0 == ret) ? kept : -1;
+}
+
+
+void HashCache::printDebug(StringBuilder* output) {
+  if (!isOpen()) {
+    output->concat("  Hash cache:    none\n");
+    return;
+  }
+  const uint64_t slots = _mask + 1;
+  output->concatf("  Hash cache:    %s, %lu of %lu slots used (%lu MiB), %lu scans\n",
+    _path, (unsigned long) _header->used.load(), (unsigned long) slots,
+    (unsigned long) (_map_len >> 20), (unsigned long) _header->epoch.load()
+  );
+  output->concatf("    Last scan:   %lu hits, %lu misses (%lu changed), %lu stored (%lu evicted), %lu too new to store\n",
+    _hits.load(), _misses.load(), _changed.load(), _stored.load(), _evicted.load(), _unsettled.load()
+  );
+}
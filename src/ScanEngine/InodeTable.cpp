@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+
+
+InodeTable::~InodeTable() {
+  reset();
+}
+
+
+/*
+* Register a link to the object's inode.
+* The first caller for an inode becomes its owner. Anyone else either takes the
+*   published digest, or is parked until the owner publishes.
+*/
+InodeTable::Claim InodeTable::claim(ORMFileData* obj) {
+  const Key k = { obj->device(), obj->inode() };
+  Shard* s = _shard_for(k);
+  std::lock_guard<std::mutex> lock(s->mutex);
+  Entry* e = s->map[k];
+  if (nullptr == e) {
+    s->map[k] = new Entry();
+    return Claim::OWNER;
+  }
+  _reused++;
+  if (e->done) {
+    obj->adoptContent(e->hash, (e->has_blake3) ? e->blake3 : nullptr, e->ok);
+    return Claim::ADOPTED;
+  }
+  e->waiters.push_back(obj);
+  return Claim::PARKED;
+}
+
+
+/*
+* Record the owner's digest, and apply it to every link that was parked behind
+*   it. Those links are returned in waiters, and are the caller's again.
+*/
+void InodeTable::publish(ORMFileData* owner, std::vector<ORMFileData*>* waiters) {
+  const Key k = { owner->device(), owner->inode() };
+  Shard* s = _shard_for(k);
+  std::lock_guard<std::mutex> lock(s->mutex);
+  Entry* e = s->map[k];
+  if (nullptr == e) {
+    return;
+  }
+  e->done = true;
+  e->ok   = (ScanDepth::FULL == owner->tier());
+  memcpy(e->hash, owner->digest(), 32);
+  e->has_blake3 = (nullptr != owner->blake3());
+  if (e->has_blake3) {
+    memcpy(e->blake3, owner->blake3(), 32);
+  }
+  for (ORMFileData* w : e->waiters) {
+    w->adoptContent(e->hash, (e->has_blake3) ? e->blake3 : nullptr, e->ok);
+    waiters->push_back(w);
+  }
+  e->waiters.clear();
+  e->waiters.shrink_to_fit();
+}
+
+
+/*
+* Forget every inode. Anything still parked (only possible if a scan was
+*   abandoned) is freed.
+*/
+void InodeTable::reset() {
+  for (unsigned int i = 0; i < INODE_TABLE_SHARDS; i++) {
+    std::lock_guard<std::mutex> lock(_shards[i].mutex);
+    for (auto& it : _shards[i].map) {
+      for (ORMFileData* w : it.second->waiters) {
+        delete w;
+      }
+      delete it.second;
+    }
+    _shards[i].map.clear();
+  }
+  _reused = 0;
+}
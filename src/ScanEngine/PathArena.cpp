@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include "ScanEngine.h"
+
+
+static SlabAllocator _name_slab(PATH_ARENA_BLOCK_SIZE);
+static thread_local char*  _tl_path_buf = nullptr;
+static thread_local size_t _tl_path_cap = 0;
+
+
+/*
+* Store a name in the calling thread's block, linked to its parent. The parent
+*   gains a reference, which is dropped when the new node is released.
+* Returns nullptr if the name is too long, or on allocation failure.
+*/
+PathNode* PathArena::make(PathNode* parent, const char* name, size_t len) {
+  if (len > 0xFFFF) {
+    return nullptr;
+  }
+  void* mem = _name_slab.alloc(sizeof(PathNode) + len + 1);
+  if (nullptr == mem) {
+    return nullptr;
+  }
+  PathNode* node = new (mem) PathNode(parent, (uint16_t) len);
+  memcpy(node->name, name, len);
+  node->name[len] = '\0';
+  if (parent) {
+    parent->refs++;
+  }
+  return node;
+}
+
+
+/*
+* Drop a reference to a node. Nodes that reach zero release their parents in
+*   turn.
+*/
+void PathArena::release(PathNode* node) {
+  while (node && (0 == --node->refs)) {
+    PathNode* parent = node->parent;
+    _name_slab.release(node);
+    node = parent;
+  }
+}
+
+
+/*
+* Assemble the full path of a node in a buffer owned by the calling thread. The
+*   result is valid until the same thread asks for another path.
+*/
+const char* PathArena::fullPath(PathNode* node) {
+  size_t total = 0;
+  for (PathNode* n = node; n; n = n->parent) {
+    total += n->len;
+    if (n->parent && ('/' != n->parent->name[n->parent->len - 1])) {
+      total++;
+    }
+  }
+  if ((total + 1) > _tl_path_cap) {
+    char* buf = (char*) realloc(_tl_path_buf, total + 1);
+    if (nullptr == buf) {
+      return "";
+    }
+    _tl_path_buf = buf;
+    _tl_path_cap = total + 1;
+  }
+  char* w = _tl_path_buf + total;
+  *w = '\0';
+  for (PathNode* n = node; n; n = n->parent) {
+    w -= n->len;
+    memcpy(w, n->name, n->len);
+    if (n->parent && ('/' != n->parent->name[n->parent->len - 1])) {
+      *(--w) = '/';
+    }
+  }
+  return _tl_path_buf;
+}
+
+
+/*
+* As fullPath(), but relative to the scan root, with no leading '/'. The root
+*   itself is the empty string. Shares fullPath()'s buffer.
+*/
+const char* PathArena::relativePath(PathNode* node) {
+  PathNode* root = node;
+  while (root->parent) {
+    root = root->parent;
+  }
+  const char* full = fullPath(node);
+  if (root == node) {
+    return full + strlen(full);
+  }
+  full += root->len;
+  return ('/' == *full) ? (full + 1) : full;
+}
+
+
+/*
+* Build the nodes for a path relative to the given root, one per component.
+*   The empty path is the root itself. The caller keeps its reference to the
+*   root, and gets one to the node returned.
+* Returns nullptr on failure.
+*/
+PathNode* PathArena::makeRelative(PathNode* root, const char* rel_path) {
+  PathNode* node = root;
+  root->refs++;
+  const char* cur = rel_path;
+  while (node && ('\0' != *cur)) {
+    const char* slash = strchr(cur, '/');
+    const size_t len  = (slash) ? (size_t) (slash - cur) : strlen(cur);
+    if (len > 0) {
+      PathNode* child = make(node, cur, len);
+      release(node);   // The child holds it now.
+      node = child;
+    }
+    cur += len;
+    if ('/' == *cur) {
+      cur++;
+    }
+  }
+  return node;
+}
+
+
+size_t PathArena::bytesHeld() {
+  return _name_slab.bytesHeld();
+}
@@ -0,0 +1,1399 @@
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "LightLinkedList.h"
+#include "StringBuilder.h"
+
+
+#ifndef __SCAN_ENGINE_H__
+#define __SCAN_ENGINE_H__
+
+class ORMFileData;
+class FSOCounts;
+class ScanScheduler;
+class SlabBlock;
+class Chunker;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct statx;
+
+#define SCAN_CHUNK_SIZE         256           // Objects handed off together.
+#define DIR_READ_BUFFER_SIZE    (256 * 1024)  // Bytes per getdents64() call.
+#define INODE_TABLE_SHARDS      64            // Independent locks in the InodeTable.
+#define DEVICE_POOL_MAX_THREADS 64            // Most workers any one device may have.
+#define PATH_ARENA_BLOCK_SIZE   (64 * 1024)   // Bytes per PathArena block. Must be a power of two.
+#define ENTRY_SLAB_BLOCK_SIZE   (256 * 1024)  // Bytes per slab of scanned entries. Must be a power of two.
+#define SLAB_ALLOCATORS_MAX     4             // SlabAllocator instances the process may have.
+#define TUNE_BYTES_PER_FILE     (1024 * 1024) // Bytes hashed that count as much work as one file examined.
+#define HASH_BUFFER_SIZE        (1024 * 1024) // Bytes read per call while hashing.
+#define STREAM_BUFFER_SIZE      (1024 * 1024) // Bytes per buffer of a streamed read. A multiple of STREAM_ALIGN.
+#define STREAM_BUFFERS          4             // Buffers a streamed read cycles through.
+#define STREAM_ALIGN            4096          // Alignment of streamed buffers, for O_DIRECT.
+#define STREAM_MIN_FILE_SIZE    (4 * 1024 * 1024)  // Files this size or larger are read ahead of their hashing.
+#define STREAM_ADVISE_BYTES     (4 * 1024 * 1024)  // Head of the next queued file that we ask the kernel to fetch.
+#define SCAN_HELP_DEPTH_MAX     4             // Directory reads a worker may nest by helping while over budget.
+#define SHA256_MAX_LANES        16            // Most messages a multi-buffer SHA-256 engine hashes in lockstep.
+#define SHA256_SMALL_FILE_SIZE  (16 * 1024)   // Files this size or smaller may be hashed in lockstep with others.
+#define BLAKE3_SEGMENT_SIZE     (16 * 1024 * 1024)  // Bytes of a file per BLAKE3 subtree hashed by one thread. A power of two.
+#define BLAKE3_PARALLEL_MIN_SIZE (64 * 1024 * 1024)  // Files this size or larger may be hashed by several threads at once.
+#define CHUNK_AVG_SIZE_MIN      (16 * 1024)   // Smallest average chunk that may be asked for.
+#define CHUNK_AVG_SIZE_MAX      (16 * 1024 * 1024)  // Largest.
+#define HASH_BATCH_FILES        64            // Small files read before they are hashed together.
+#define HASH_CACHE_SLOTS        (1024 * 1024) // Slots in a new hash cache file, of 128 bytes each. A power of two.
+#define HASH_CACHE_MIN_SLOTS    4096          // Fewest slots compaction will leave a hash cache with.
+#define HASH_CACHE_PROBE        8             // Slots, from its home, that an inode's entry may take.
+#define HASH_CACHE_SETTLE_NS    (2LL * 1000000000LL)  // A file whose ctime is this close to the start of the scan is not cached.
+#define URING_SMALL_FILE_SIZE   (64 * 1024)   // Files this size or smaller may be read whole through io_uring.
+#define WATCH_EVENT_BUFFER_SIZE (64 * 1024)   // Bytes per read() of the fanotify or inotify queue.
+#define WATCH_HOT_MS            (10 * 60000)  // How long a directory stays suspect after an event in it.
+#define WATCH_MAX_DELAY_FACTOR  10            // A path that never goes quiet is applied after this many debounce periods.
+
+// The digests a catalog takes of each regular file.
+#define DIGEST_SHA256      0x01
+#define DIGEST_BLAKE3      0x02
+
+// What a stored row was, for a verify scan.
+#define VERIFY_TYPE_FILE   1
+#define VERIFY_TYPE_DIR    2
+#define VERIFY_TYPE_LINK   3
+#define VERIFY_TYPE_OTHER  4
+
+// What happened to a watched path. Several may be set once events coalesce.
+#define WATCH_EV_CHANGED   0x01  // Written, or its metadata changed.
+#define WATCH_EV_GONE      0x02  // Deleted, or moved away.
+#define WATCH_EV_NEW       0x04  // Created, or moved in.
+#define WATCH_EV_DIR       0x08  // The path is (or was) a directory.
+#define WATCH_EV_OVERFLOW  0x10  // Events were lost. Carries no path.
+#define WATCH_EV_RESCAN    0x20  // Read the whole subtree again.
+
+
+/*
+* How far a scan goes with each object. The value reached by each row is what
+*   lands in the `examined` column of `file_meta`, so that a later pass can
+*   find and upgrade rows that stopped short.
+*/
+enum class ScanDepth : uint8_t {
+  NONE      = 0,  // Nothing could be learned about the object.
+  STRUCTURE = 1,  // Name and type, from the dirent alone. No stat.
+  METADATA  = 2,  // stat() results, but no content hash.
+  FULL      = 3   // Everything, including the hash of regular files.
+};
+
+
+/*
+* The order in which a worker hashes the files of a chunk. Anything other than
+*   READDIR is meant for rotational media, where seeks dominate.
+*/
+enum class HashOrder : uint8_t {
+  READDIR = 0,  // As the directory listed them.
+  INODE   = 1,  // By inode number, which tracks on-disk layout on most filesystems.
+  EXTENT  = 2   // By the physical offset of the first extent (FIEMAP), else by inode.
+};
+
+
+/*
+* The SHA-256 implementation that hashes file content. Every one of them gives
+*   the same digests.
+*/
+enum class HashEngine : uint8_t {
+  AUTO    = 0,  // The fastest that the CPU supports.
+  OPENSSL = 1,  // EVP.
+  SCALAR  = 2,  // Built in, portable.
+  SHA_NI  = 3,  // Built in, with the x86 SHA extensions.
+  AVX2    = 4,  // Built in. Hashes 8 small files at once. Others go to SHA_NI if the CPU has it, or to OPENSSL.
+  AVX512  = 5   // As AVX2, with 16 small files at once.
+};
+
+
+/*
+* How a watch learns of changes.
+*/
+enum class WatchBackend : uint8_t {
+  AUTO     = 0,  // fanotify if we are permitted, otherwise inotify.
+  FANOTIFY = 1,  // Marks on whole filesystems. Needs CAP_SYS_ADMIN.
+  INOTIFY  = 2   // A watch on every directory.
+};
+
+
+/*
+* What backs a device, as far as we can tell. Each class gets its own worker
+*   count, since the right amount of concurrency differs by orders of magnitude.
+*/
+enum class DeviceClass : uint8_t {
+  OTHER   = 0,  // No block device we could find (tmpfs, overlay, btrfs subvolumes...).
+  SSD     = 1,  // Non-rotational block device.
+  HDD     = 2,  // Rotational block device.
+  NETWORK = 3   // NFS, SMB, FUSE, and the like.
+};
+
+
+/*
+* What the rules say about one entry. UNDECIDED means the answer depends on
+*   the entry's type or stat, which were not yet known.
+*/
+enum class RuleVerdict : uint8_t {
+  INCLUDE   = 0,
+  EXCLUDE   = 1,
+  UNDECIDED = 2
+};
+
+/* How a rule's glob is matched. Chosen once, when the rule is compiled. */
+enum class RuleKind : uint8_t {
+  ANY          = 0,  // No glob. Only the predicates decide.
+  NAME_LITERAL = 1,  // Exact name.
+  NAME_SUFFIX  = 2,  // "*" followed by a literal.
+  NAME_GLOB    = 3,  // Anything else, against the name alone.
+  PATH_GLOB    = 4   // Anchored. Against the path relative to the scan root.
+};
+
+#define RULE_PRED_SIZE_GT   0x01
+#define RULE_PRED_SIZE_LT   0x02
+#define RULE_PRED_MTIME_GT  0x04
+#define RULE_PRED_MTIME_LT  0x08
+
+
+/*
+* One include or exclude rule, in .gitignore style, with optional size and
+*   mtime predicates. See ScanRule::compile() for the grammar.
+*/
+class ScanRule {
+  public:
+    ScanRule() {};
+    ~ScanRule();
+
+    int  compile(const char*);
+    bool matchesName(const char* rel_path, const char* name, size_t name_len);
+    bool matchesStat(uint64_t size, time_t mtime);
+
+    inline const char* text() {      return _text;              };
+    inline bool negated() {          return _negate;            };
+    inline bool dirOnly() {          return _dir_only;          };
+    inline bool anchored() {         return _anchored;          };
+    inline bool hasPredicates() {    return (0 != _preds);      };
+
+
+  private:
+    char*    _text       = nullptr;
+    char*    _glob_str   = nullptr;
+    size_t   _suffix_len = 0;
+    uint64_t _size_gt    = 0;
+    uint64_t _size_lt    = 0;
+    time_t   _mtime_gt   = 0;
+    time_t   _mtime_lt   = 0;
+    RuleKind _kind       = RuleKind::ANY;
+    uint8_t  _preds      = 0;
+    bool     _negate     = false;
+    bool     _dir_only   = false;
+    bool     _anchored   = false;
+};
+
+
+/*
+* An ordered list of compiled rules. The last rule to match an entry decides
+*   it. Rules are evaluated against each dirent before anything is allocated
+*   for it, so an excluded directory is never opened.
+*/
+class ScanRules {
+  public:
+    ScanRules() {};
+    ~ScanRules();
+
+    int  add(const char*);
+    void clear();
+    RuleVerdict evaluate(const char* rel_path, const char* name, uint8_t d_type);
+    RuleVerdict evaluate(const char* rel_path, const char* name, bool is_dir, bool is_file, uint64_t size, time_t mtime);
+    void printDebug(StringBuilder*);
+
+    inline unsigned int count() {           return (unsigned int) _rules.size();  };
+    inline bool empty() {                   return _rules.empty();                };
+    inline bool needsRelativePath() {       return _need_rel_path;                };
+    inline const char* text(unsigned int i) {  return _rules[i]->text();          };
+
+
+  private:
+    std::vector<ScanRule*> _rules;
+    bool _need_rel_path = false;   // At least one rule is anchored.
+
+    RuleVerdict _evaluate(const char*, const char*, bool type_known, bool is_dir, bool is_file, bool have_stat, uint64_t size, time_t mtime);
+};
+
+
+/*
+* Per-scan options. Owned by the catalog, and bound to the scheduler for the
+*   duration of a scan.
+*/
+class ScanOptions {
+  public:
+    bool         dirfd_relative = true;  // Resolve children against their parent's fd.
+    unsigned int fd_budget      = 0;     // Directory fds we may hold open. 0 means auto.
+    bool         use_uring      = false; // Batch metadata requests through io_uring.
+    ScanDepth    depth          = ScanDepth::FULL;
+    HashOrder    hash_order     = HashOrder::READDIR;
+    unsigned int spindle_threads = 0;    // Workers allowed to hash from one device at once. 0 is unlimited.
+    bool         hardlinks      = true;  // Hash each multiply-linked inode only once.
+    bool         one_fs         = false; // Do not descend into other filesystems.
+    bool         direct_io      = false; // Stream large files with O_DIRECT, where the filesystem allows it.
+    unsigned int threads_ssd    = 0;     // Workers per device of each class. 0 is one per CPU.
+    unsigned int threads_hdd    = 2;
+    unsigned int threads_net    = 4;
+    unsigned int threads_other  = 6;
+    bool         tune           = true;  // Let the controller resize device pools during the scan.
+    unsigned int tune_min       = 1;     // Bounds for the controller, per device.
+    unsigned int tune_max       = 32;
+    unsigned int tune_interval  = 2000;  // ms between controller samples.
+    unsigned int tune_psi_limit = 60;    // io "some" pressure (%) above which pools only shrink.
+    unsigned int budget_traverse    = 262144;  // Entries read from directories, but not yet examined.
+    unsigned int budget_traverse_mb = 64;
+    unsigned int budget_hash        = 0;       // Files being hashed at once.
+    unsigned int budget_hash_mb     = 64;      // Their read buffers.
+    unsigned int budget_db          = 65536;   // Entries waiting for the DB writer.
+    unsigned int budget_db_mb       = 32;
+    unsigned int checkpoint_secs    = 600;     // Between checkpoints. 0 takes none until the scan ends.
+    unsigned int time_box_secs      = 0;       // Stop at a checkpoint after this long. 0 runs to the end.
+    uint32_t     baseline           = 0;       // Catalog whose digests unchanged files may take. 0 is none.
+    bool         dupes              = false;   // Set for the length of a dupes scan. Files are grouped by size.
+    bool         verify             = false;   // Set for the length of a verify scan. Objects are checked, and not written.
+    unsigned int dupes_sample       = 4096;    // Bytes a dupes scan hashes from each end of a file.
+    uint64_t     dupes_min_size     = 1;       // Smaller files are never counted as duplicates.
+    bool         dupes_confirm      = true;    // Hash in full the files whose samples match.
+    HashEngine   hash_engine        = HashEngine::AUTO;
+    uint8_t      digests            = DIGEST_SHA256;  // Which digests to take. Saved with the catalog.
+    unsigned int blake3_threads     = 0;       // Threads that may share one large file's BLAKE3. 0 is one per CPU.
+    bool         chunks             = false;   // Cut large files into content-defined chunks, and record their digests.
+    unsigned int chunk_avg_size     = 1024 * 1024;  // A power of two. Chunks are a quarter to four times this.
+    bool         hash_cache         = true;    // Consult and fill the host's hash cache, if one is open.
+    WatchBackend watch_backend      = WatchBackend::AUTO;
+    unsigned int watch_debounce_ms  = 2000;    // A path must be quiet this long before a watch applies it.
+    ScanRules    rules;                  // Include/exclude rules for this catalog.
+
+    int  set(const char* key, const char* value);
+    int  setDepth(const char*);
+    void printDebug(StringBuilder*);
+    unsigned int threadsFor(DeviceClass);
+    unsigned int blake3Threads();
+
+    /* Large enough to be cut into chunks, if the scan asks for them. */
+    inline bool chunksFor(uint64_t size) {
+      return (chunks && (size >= STREAM_MIN_FILE_SIZE) && (size >= ((uint64_t) chunk_avg_size << 2)));
+    };
+
+    static const char* depthString(ScanDepth);
+    static const char* hashOrderString(HashOrder);
+    static const char* watchBackendString(WatchBackend);
+    static const char* hashEngineString(HashEngine);
+    static const char* digestsString(uint8_t);
+    static int parseDuration(const char*, unsigned int* secs);
+};
+
+
+/*
+* SHA-256, with its compression function picked at runtime from what the CPU
+*   supports. One engine is in use by the whole process at a time.
+* A multi-buffer engine keeps several messages in flight, one per SIMD lane, and
+*   gives each lane a new message as soon as its last one is done. That is the
+*   fast way to hash many small files on a CPU without SHA extensions.
+* An instance that hashes with OpenSSL holds one EVP context for its lifetime,
+*   rather than making one per message.
+*/
+class Sha256 {
+  public:
+    Sha256();
+    ~Sha256();
+
+    void init();
+    void update(const uint8_t* data, size_t len);
+    void final(uint8_t* digest);
+
+    static int  select(HashEngine);
+    static bool supported(HashEngine);
+    static void digest(const uint8_t* msg, size_t len, uint8_t* digest);
+    static void digestMany(const uint8_t* const* msgs, const size_t* lens, unsigned int count, uint8_t (*digests)[32]);
+    static void benchmark(StringBuilder*, size_t msg_len, size_t total_len);
+
+    static inline HashEngine engine() {   return _engine;  };
+    static inline unsigned int lanes() {  return _lanes;   };
+
+
+  private:
+    uint32_t _state[8];
+    uint8_t  _block[64];
+    size_t   _block_len = 0;
+    uint64_t _total     = 0;
+    void*    _evp       = nullptr;   // EVP_MD_CTX, once this instance has hashed with OpenSSL.
+    bool     _use_evp   = false;     // Fixed at init(), so that a message never changes hands.
+
+    static HashEngine   _engine;
+    static unsigned int _lanes;
+
+    static HashEngine _pick(HashEngine);
+    static bool _self_test(HashEngine);
+};
+
+
+/*
+* BLAKE3, in its plain hashing mode, with a 32-byte digest. Portable, with no
+*   SIMD.
+* A message is hashed as a tree of 1 KiB chunks, so a large file can be cut into
+*   subtrees that are hashed by different threads, and then joined. hashFile()
+*   does that.
+*/
+class Blake3 {
+  public:
+    Blake3() {  init();  };
+
+    void init();
+    void update(const uint8_t* data, size_t len);
+    void final(uint8_t* digest);
+
+    static void digest(const uint8_t* msg, size_t len, uint8_t* digest);
+    static int  hashFile(int fd, uint64_t size, unsigned int threads, uint8_t* digest);
+
+    static unsigned long filesSplit();
+
+
+  private:
+    // A node whose chaining value (or root digest) has not yet been taken.
+    struct Output {
+      uint32_t cv[8];
+      uint32_t block[16];
+      uint64_t counter;
+      uint32_t block_len;
+      uint32_t flags;
+
+      void chainingValue(uint32_t* cv_out) const;
+      void rootBytes(uint8_t* digest) const;
+    };
+
+    uint32_t _cv[8];              // The chaining value of the chunk in progress.
+    uint8_t  _block[64];
+    uint8_t  _block_len   = 0;
+    uint8_t  _blocks_done = 0;    // Blocks of the current chunk already compressed.
+    uint64_t _chunk       = 0;    // Index of the current chunk in the whole message.
+    uint64_t _first_chunk = 0;    // Where this hasher's part of the message starts.
+    uint32_t _stack[54][8];       // Chaining values of finished subtrees.
+    uint8_t  _stack_len   = 0;
+
+    void _init_at(uint64_t first_chunk);
+    void _output(Output*);
+    void _push_chunk(const uint32_t* cv);
+
+    static void _parent(const uint32_t* left, const uint32_t* right, Output*);
+    static int  _hash_segment(int fd, uint64_t offset, uint64_t len, uint8_t* buf, Output*);
+};
+
+
+/*
+* Bump allocation out of large aligned blocks, for things that are made and
+*   retired in waves. Each thread carves from its own block, so allocation takes
+*   no lock. A block counts its live allocations, and is freed as a whole when
+*   the last of them is released after the block has filled. Nothing is ever
+*   returned to the heap individually.
+* Instances must be static, and there may be at most SLAB_ALLOCATORS_MAX.
+*/
+class SlabAllocator {
+  public:
+    SlabAllocator(size_t block_size);
+
+    void* alloc(size_t len);
+    void  release(void*);
+    void  finishThread();
+
+    inline unsigned int blocksHeld() {  return _blocks_held.load();  };
+    inline size_t bytesHeld() {         return (_blocks_held.load() * _block_size);  };
+
+    static void benchmark(StringBuilder*, size_t entry_len, unsigned int threads, size_t count);
+
+
+  private:
+    const size_t       _block_size;
+    const unsigned int _id;
+    std::atomic<unsigned int> _blocks_held{0};
+
+    void _put(SlabBlock*);
+};
+
+
+/*
+* One name in the tree being scanned, with a link to the directory that holds
+*   it. The root's name is the whole root path. A full path is only assembled
+*   when something asks for it.
+* Nodes are reference counted. Each object holds its own node, and each node
+*   holds its parent, so a directory's name outlives its object for as long as
+*   any of its children are still in the pipeline.
+*/
+class PathNode {
+  public:
+    PathNode* const parent;
+    std::atomic<uint32_t> refs{1};
+    const uint16_t len;
+    char name[];
+
+    PathNode(PathNode* p, uint16_t l) : parent(p), len(l) {};
+};
+
+
+/*
+* Allocation of PathNodes, from a SlabAllocator of their own.
+*/
+class PathArena {
+  public:
+    static PathNode* make(PathNode* parent, const char* name, size_t len);
+    static void release(PathNode*);
+    static const char* fullPath(PathNode*);
+    static const char* relativePath(PathNode*);
+    static PathNode* makeRelative(PathNode* root, const char* rel_path);
+    static size_t bytesHeld();
+};
+
+
+/*
+* An open directory, shared by the children that still need to stat or open
+*   themselves relative to it. The fd is closed when the last reference is
+*   dropped. The number of fds held this way is capped by a budget, and
+*   directories opened beyond it are read and closed immediately, leaving
+*   their children to fall back on absolute paths.
+*/
+class ScanDirHandle {
+  public:
+    const int fd;
+
+    inline void take() {    _refs++;    };
+    void release();
+
+    static ScanDirHandle* open(ScanDirHandle* parent, const char* name, const char* path);
+    static bool withinBudget();
+    static void setBudget(unsigned int);
+    static unsigned int budget();
+    static unsigned int openCount();
+
+
+  private:
+    std::atomic<unsigned int> _refs{1};
+
+    ScanDirHandle(int f) : fd(f) {};
+    ~ScanDirHandle();
+};
+
+
+/*
+* Reads a directory with large getdents64() batches. Each worker thread owns one
+*   buffer, which is reused by every directory it reads.
+*/
+class DirReader {
+  public:
+    DirReader() {};
+    ~DirReader();
+
+    int  open(const char* path);
+    int  attach(int fd);
+    int  next(const char** name, uint8_t* d_type);
+    void close();
+
+
+  private:
+    int      _fd  = -1;
+    uint8_t* _buf = nullptr;
+    long     _len = 0;
+    long     _pos = 0;
+    bool     _owns_fd = false;
+
+    int _acquire_buffer();
+};
+
+
+/*
+* A fixed-size group of objects that travels through the deques as one unit.
+*   Large directories are handed off one chunk at a time while they are still
+*   being read.
+*/
+class ScanChunk {
+  public:
+    ScanChunk() {};
+    ~ScanChunk() {};
+
+    inline bool add(ORMFileData* obj) {
+      items[count++] = obj;
+      return (SCAN_CHUNK_SIZE == count);
+    };
+
+    ORMFileData* items[SCAN_CHUNK_SIZE];
+    unsigned int count = 0;
+};
+
+
+/*
+* Caps the number of workers reading from a single device at once. A worker
+*   holds the gate for the whole of a sorted batch, so that the batch is read
+*   close to sequentially, instead of interleaved with other workers' seeks.
+*/
+class DeviceGate {
+  public:
+    static void acquire(dev_t, unsigned int limit);
+    static void release(dev_t, unsigned int limit);
+};
+
+
+/*
+* Tracks regular files with more than one link, keyed on (st_dev, st_ino), so
+*   that each inode is read only once per scan. The first link to claim an
+*   inode hashes it. Links that arrive while that is underway are parked here
+*   rather than blocking a worker, and are handed back when the digest is
+*   published. Links that arrive afterward take the digest immediately.
+* Entries live until the next scan begins.
+*/
+class InodeTable {
+  public:
+    enum class Claim : uint8_t {
+      OWNER   = 0,  // Caller must hash the object, and then publish().
+      ADOPTED = 1,  // The digest was already known, and has been applied.
+      PARKED  = 2   // The object now belongs to the table until publish().
+    };
+
+    InodeTable() {};
+    ~InodeTable();
+
+    Claim claim(ORMFileData*);
+    void  publish(ORMFileData* owner, std::vector<ORMFileData*>* waiters);
+    void  reset();
+
+    inline unsigned long linksReused() {  return _reused.load();  };
+
+
+  private:
+    struct Key {
+      dev_t dev;
+      ino_t ino;
+      bool operator==(const Key& o) const {  return ((dev == o.dev) && (ino == o.ino));  };
+    };
+    struct KeyHash {
+      size_t operator()(const Key& k) const {  return (size_t) (k.ino ^ (k.dev * 0x9E3779B97F4A7C15ULL));  };
+    };
+    struct Entry {
+      bool    done = false;
+      bool    ok   = false;  // The owner's hash succeeded.
+      bool    has_blake3 = false;
+      uint8_t hash[32];
+      uint8_t blake3[32];
+      std::vector<ORMFileData*> waiters;
+    };
+    struct Shard {
+      std::mutex mutex;
+      std::unordered_map<Key, Entry*, KeyHash> map;
+    };
+
+    Shard _shards[INODE_TABLE_SHARDS];
+    std::atomic<unsigned long> _reused{0};
+
+    inline Shard* _shard_for(const Key& k) {  return &_shards[KeyHash()(k) % INODE_TABLE_SHARDS];  };
+};
+
+
+/*
+* Digests from an earlier catalog of the same root, keyed on a hash of each
+*   file's path relative to the root. A file whose size, times, and inode all
+*   match its old row takes the old digest instead of being read again.
+* The table is filled before a scan starts, and only read while it runs, so
+*   lookups take no lock.
+*/
+class BaselineTable {
+  public:
+    BaselineTable() {};
+    ~BaselineTable() {};
+
+    void add(const char* rel_path, uint64_t size, int64_t mtime_ns, int64_t ctime_ns, uint64_t ino, const uint8_t* hash, const uint8_t* blake3);
+    void seal();
+    bool lookup(ORMFileData*, uint8_t* hash, uint8_t* blake3);
+    void reset();
+    void printDebug(StringBuilder*);
+
+    inline bool   empty() {                return _entries.empty();   };
+    inline size_t count() {                return _entries.size();    };
+    inline unsigned long digestsReused() { return _reused.load();     };
+
+    static uint64_t pathKey(const char* rel_path);
+
+
+  private:
+    struct Entry {
+      uint64_t key;
+      uint64_t size;
+      int64_t  mtime_ns;
+      int64_t  ctime_ns;
+      uint64_t ino;
+      uint8_t  hash[32];
+      uint8_t  blake3[32];   // Zeroed, if the baseline took no BLAKE3.
+    };
+
+    std::vector<Entry> _entries;         // Sorted on key by seal().
+    std::atomic<unsigned long> _reused{0};
+    std::atomic<unsigned long> _changed{0};   // Found, but the metadata differed.
+};
+
+
+/*
+* The rows of a stored catalog, for a verify scan to check the tree against.
+*   Rows are keyed on a hash of the path relative to the root, as a baseline's
+*   are. The scan checks each object it would have written a row for, and
+*   marks that row seen. Rows never seen are missing from the tree.
+* The table is filled before the scan starts. Each row is checked by the one
+*   worker that examines its path, so checks take no lock.
+*/
+class VerifyTable {
+  public:
+    VerifyTable() {};
+    ~VerifyTable() {};
+
+    void add(const char* rel_path, uint32_t id, uint8_t type, uint64_t size, int64_t mtime_ns, const uint8_t* digest);
+    void seal(uint8_t digest);
+    void check(ORMFileData*);
+    void unseen(std::vector<uint32_t>* ids);
+    void reset();
+    void printDebug(StringBuilder*);
+
+    inline size_t count() {               return _entries.size();         };
+    inline unsigned long matched() {      return _matched.load();         };
+    inline unsigned long changed() {      return _changed.load();         };
+    inline unsigned long corrupt() {      return _corrupt.load();         };
+    inline unsigned long unreadable() {   return _unreadable.load();      };
+    inline unsigned long newFiles() {     return _new.load();             };
+    inline uint64_t bytesVerified() {     return _bytes.load();           };
+
+
+  private:
+    struct Entry {
+      uint64_t key;
+      uint64_t size;
+      int64_t  mtime_ns;    // 0 if the row has no nanosecond time.
+      uint32_t id;          // Of the row in file_meta.
+      uint8_t  type;        // VERIFY_TYPE_*
+      bool     hashed;      // The row carries a digest.
+      bool     seen;
+      uint8_t  digest[32];
+    };
+
+    std::vector<Entry>    _entries;     // Sorted on key by seal().
+    std::vector<uint64_t> _ambiguous;   // Keys held by more than one row. Sorted.
+    uint8_t               _digest = DIGEST_SHA256;   // Which of an object's digests the rows hold.
+    std::atomic<unsigned long> _matched{0};
+    std::atomic<unsigned long> _changed{0};      // A different type, or different content and metadata.
+    std::atomic<unsigned long> _corrupt{0};      // Different content, with the same size and mtime.
+    std::atomic<unsigned long> _unreadable{0};
+    std::atomic<unsigned long> _new{0};          // In the tree, with no row.
+    std::atomic<unsigned long> _skipped{0};      // Rows that could not be told apart.
+    std::atomic<uint64_t>      _bytes{0};        // Read and compared.
+};
+
+
+/*
+* Digests kept across catalogs by this host, in a file that is mapped into
+*   memory. An entry is keyed on (dev, inode), and only matches a file whose
+*   size, mtime, and ctime (to the nanosecond) are also what they were when it
+*   was hashed. Any catalog after the first can then skip reading what has not
+*   changed, whatever its root, and without a baseline.
+* The file is an open-addressed table of fixed slots. An inode's entry lives in
+*   one of HASH_CACHE_PROBE slots from its home, so a changed file replaces its
+*   own entry, and a full window gives up the entry used longest ago. Each slot
+*   is guarded by a sequence count, so lookups take no lock, and any number of
+*   threads (or processes) may look up and store at once. A slot left mid-write
+*   by a process that died is never read, and is dropped by compaction.
+*/
+class HashCache {
+  public:
+    HashCache() {};
+    ~HashCache();
+
+    int  open(const char* path, uint64_t slots);
+    void close();
+    long compact(uint64_t slots, unsigned int max_age);
+    void beginScan();
+    bool lookup(ORMFileData*, uint8_t digests, uint8_t* hash, uint8_t* blake3);
+    void store(ORMFileData*, uint8_t digests);
+    void printDebug(StringBuilder*);
+
+    inline bool isOpen() {        return (nullptr != _slots);  };
+    inline const char* path() {   return _path;                };
+
+    static HashCache* getInstance();
+
+
+  private:
+    struct Header {
+      char     magic[8];
+      uint32_t version;
+      uint32_t slot_size;
+      uint64_t slots;
+      std::atomic<uint64_t> epoch;   // Scans that have used the file.
+      std::atomic<uint64_t> used;    // Slots holding an entry.
+    };
+    struct Slot {
+      std::atomic<uint64_t> seq;     // Odd while the slot is being written.
+      std::atomic<uint64_t> w[15];
+    };
+    struct Entry {
+      uint64_t dev;
+      uint64_t ino;
+      uint64_t size;
+      int64_t  mtime_ns;
+      int64_t  ctime_ns;
+      uint8_t  digests;   // DIGEST_* flags. 0 for an empty slot.
+      uint32_t epoch;     // The last scan to store or find it.
+      uint8_t  hash[32];
+      uint8_t  blake3[32];
+    };
+
+    int       _fd       = -1;
+    char*     _path     = nullptr;
+    void*     _map      = nullptr;
+    size_t    _map_len  = 0;
+    Header*   _header   = nullptr;
+    Slot*     _slots    = nullptr;
+    uint64_t  _mask     = 0;
+    int64_t   _settled_ns = 0;   // Files with an older ctime may be stored.
+    std::atomic<unsigned long> _hits{0};
+    std::atomic<unsigned long> _misses{0};
+    std::atomic<unsigned long> _changed{0};   // Found, but the metadata differed.
+    std::atomic<unsigned long> _stored{0};
+    std::atomic<unsigned long> _evicted{0};
+    std::atomic<unsigned long> _unsettled{0};
+
+    /* Where an inode's window starts, before it is masked to the table. */
+    static inline uint64_t _home(uint64_t dev, uint64_t ino) {
+      uint64_t h = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+      h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+      return (h ^ (h >> 31));
+    };
+
+    bool _read(Slot*, Entry*, uint64_t* seq);
+    bool _write(Slot*, uint64_t seq, const Entry&);
+    bool _insert(const Entry&, bool* evicted);
+    static int _map_file(int fd, uint64_t slots, void** map, size_t* len);
+};
+
+
+/*
+* Regular files by size, for a dupes scan. Workers add each file as they stat
+*   it. Only sizes held by more than one inode are taken afterward, so a file
+*   with a size of its own is never read. Each entry holds a reference to its
+*   file's PathNode until it is taken or the table is reset.
+*/
+class SizeTable {
+  public:
+    class Entry {
+      public:
+        PathNode* node;
+        dev_t     dev;
+        ino_t     ino;
+    };
+    class Group {
+      public:
+        uint64_t size;
+        std::vector<Entry> members;   // Sorted by (dev, ino).
+    };
+
+    SizeTable() {};
+    ~SizeTable();
+
+    void add(ORMFileData*, uint64_t min_size);
+    void take(std::vector<Group>*);
+    void reset();
+
+    inline unsigned long filesSeen() {  return _files.load();  };
+    inline uint64_t bytesSeen() {       return _bytes.load();  };
+
+
+  private:
+    struct Shard {
+      std::mutex mutex;
+      std::unordered_map<uint64_t, std::vector<Entry>> map;
+    };
+
+    Shard _shards[INODE_TABLE_SHARDS];
+    std::atomic<unsigned long> _files{0};
+    std::atomic<uint64_t>      _bytes{0};
+};
+
+
+/*
+* Finds the files that hold the same content, among those that share a size.
+*   Each inode is read at most twice. The first pass hashes the head and tail of
+*   each file, and only files whose samples still match are hashed in full by
+*   the second. A file no larger than its two samples is read whole in the
+*   first pass, so its sample digest is its SHA-256.
+*/
+class DupeFinder {
+  public:
+    class Group {
+      public:
+        uint64_t size      = 0;
+        bool     confirmed = false;   // The full digests match. Otherwise, only the samples do.
+        uint8_t  hash[32];            // The SHA-256 if confirmed, the digest of the samples if not.
+        unsigned int inodes = 0;      // Distinct inodes among the members. Links share one.
+        std::vector<PathNode*> members;
+    };
+
+    DupeFinder(ScanOptions* opts) : _opts(opts) {};
+    ~DupeFinder();
+
+    int  run(SizeTable*, unsigned int threads);
+    void printDebug(StringBuilder*);
+
+    inline std::vector<Group>* groups() {  return &_groups;  };
+
+
+  private:
+    struct Item {
+      PathNode* node;
+      dev_t     dev;
+      ino_t     ino;
+      uint64_t  size;
+      uint8_t   digest[32];
+      bool      ok;
+    };
+    struct Span {
+      size_t begin;
+      size_t end;
+    };
+
+    ScanOptions*       _opts;
+    std::vector<Item>  _items;
+    std::vector<Group> _groups;
+    unsigned long _files_seen   = 0;
+    uint64_t      _bytes_seen   = 0;
+    unsigned long _files_shared = 0;   // Files with a size held by another inode.
+    std::atomic<unsigned long> _files_sampled{0};
+    std::atomic<unsigned long> _files_hashed{0};
+    std::atomic<unsigned long> _files_failed{0};
+    std::atomic<uint64_t>      _bytes_read{0};
+
+    void _pass(std::vector<Span>*, bool full, unsigned int threads);
+    void _regroup(std::vector<Span>*);
+    void _read(Item*, bool full, Sha256*, std::vector<uint8_t>* buf);
+};
+
+
+/*
+* A change to a watched tree. The path is relative to the root, and belongs to
+*   whoever holds the event, to be released with free().
+*/
+class WatchEvent {
+  public:
+    char*   rel_path = nullptr;
+    uint8_t flags    = 0;
+};
+
+
+/*
+* Subscribes to changes under a root. fanotify marks whole filesystems, so one
+*   mark covers a tree of any size, but it needs CAP_SYS_ADMIN (and
+*   CAP_DAC_READ_SEARCH to turn the directory handles it reports into paths).
+*   Without them, we fall back to an inotify watch on every directory, added
+*   and dropped as directories come and go.
+* Directories that the rules exclude, and other filesystems under one-fs, are
+*   left unwatched.
+*/
+class FsWatcher {
+  public:
+    FsWatcher() {};
+    ~FsWatcher();
+
+    int  open(const char* root, ScanOptions*);
+    void close();
+    int  poll(unsigned int timeout_ms, std::vector<WatchEvent>*);
+    void printDebug(StringBuilder*);
+
+    inline WatchBackend backend() {  return _backend;  };
+
+
+  private:
+    WatchBackend _backend  = WatchBackend::AUTO;
+    int          _fd       = -1;        // The fanotify or inotify instance.
+    int          _mount_fd = -1;        // fanotify: directory handles are opened relative to this.
+    char*        _root     = nullptr;
+    size_t       _root_len = 0;
+    dev_t        _root_dev = 0;
+    ScanOptions* _opts     = nullptr;
+    uint8_t*     _buf      = nullptr;
+    std::map<int, char*> _wd_paths;     // inotify: watch descriptor to relative path.
+    unsigned long _events        = 0;
+    unsigned long _overflows     = 0;
+    unsigned long _watch_failures = 0;  // inotify: directories we could not watch.
+    bool          _told_limit    = false;
+
+    int  _open_fanotify();
+    int  _open_inotify();
+    int  _add_inotify_tree(const char* rel_path);
+    void _drop_inotify_tree(const char* rel_path);
+    void _read_fanotify(std::vector<WatchEvent>*);
+    void _read_inotify(std::vector<WatchEvent>*);
+    const char* _relative(const char* full);
+    void _emit(std::vector<WatchEvent>*, const char* rel_dir, const char* name, uint8_t flags);
+};
+
+
+/*
+* Collects watch events until their paths go quiet. Repeated events on a path
+*   become one entry, and an entry under a directory that will be read again
+*   is dropped in favor of it.
+* Directories that saw events recently are remembered, so that when the queue
+*   overflows, only they need to be read again.
+*/
+class WatchCoalescer {
+  public:
+    WatchCoalescer() {};
+    ~WatchCoalescer();
+
+    void add(WatchEvent*);
+    int  take(uint64_t now_ms, unsigned int debounce_ms, bool all, std::vector<WatchEvent>*);
+
+    inline size_t pending() {  return _pending.size();  };
+
+
+  private:
+    struct Less {
+      bool operator()(const char* a, const char* b) const {  return (strcmp(a, b) < 0);  };
+    };
+    struct Entry {
+      uint8_t  flags;
+      uint64_t first_ms;
+      uint64_t last_ms;
+    };
+
+    std::map<char*, Entry, Less>    _pending;
+    std::map<char*, uint64_t, Less> _hot;    // Directory to the time of its last event.
+    uint64_t _now_ms = 0;                    // As of the last take().
+
+    void _mark(const char* rel_path, uint8_t flags);
+    void _overflow();
+};
+
+
+/*
+* A minimal io_uring, driven by raw syscalls. Each worker thread owns at most
+*   one. If the kernel refuses us (too old, or disabled by policy), io_uring is
+*   marked unavailable for the rest of the process, and callers take their
+*   synchronous paths instead.
+* Reading small files whole needs a sparse file table (Linux 5.19), so that an
+*   openat, read, and close can be linked through a direct descriptor. Without
+*   one, only the stats are batched.
+*/
+class UringQueue {
+  public:
+    UringQueue() {};
+    ~UringQueue();
+
+    int  init(unsigned int entries);
+    struct io_uring_sqe* getSQE();
+    int  submit(unsigned int wait_nr);
+    int  reap(uint64_t* user_data, int32_t* res);
+    int  statChunk(ScanChunk*);
+    int  readFiles(ORMFileData** objs, unsigned int count, const uint8_t** msgs, bool* read_ok);
+
+    static UringQueue* forThisThread();
+    static bool available();
+    static bool readsAvailable();
+    static unsigned long opsCompleted();
+    static unsigned long filesRead();
+
+
+  private:
+    int      _ring_fd    = -1;
+    uint8_t* _sq_ptr     = nullptr;
+    uint8_t* _cq_ptr     = nullptr;
+    size_t   _sq_map_len = 0;
+    size_t   _cq_map_len = 0;
+    struct io_uring_sqe* _sqes = nullptr;
+    size_t   _sqes_len   = 0;
+    unsigned int* _sq_head  = nullptr;
+    unsigned int* _sq_tail  = nullptr;
+    unsigned int* _sq_mask  = nullptr;
+    unsigned int* _sq_array = nullptr;
+    unsigned int* _cq_head  = nullptr;
+    unsigned int* _cq_tail  = nullptr;
+    unsigned int* _cq_mask  = nullptr;
+    struct io_uring_cqe* _cqes = nullptr;
+    unsigned int  _sq_entries = 0;
+    unsigned int  _to_submit  = 0;  // SQEs filled, but not yet handed to the kernel.
+    struct statx* _statx_bufs = nullptr;
+    uint8_t* _file_bufs       = nullptr;  // One slot of URING_SMALL_FILE_SIZE per file in a batch.
+    bool     _bufs_registered = false;    // _file_bufs is registered with the kernel.
+    int      _files_ready     = 0;        // 1 once the file table is registered, -1 if it cannot be.
+
+    int  _setup_files();
+};
+
+
+/*
+* Cuts a stream of bytes into content-defined chunks with FastCDC, and takes
+*   the SHA-256 of each. A boundary falls wherever a rolling gear hash of the
+*   bytes since the last one matches a mask, so an insertion or deletion only
+*   moves the boundaries near it. Chunks are between a quarter and four times
+*   the average size. A stricter mask before the average, and a looser one
+*   after it, keep most chunks close to it.
+* Finding the boundaries and hashing the chunks are separate passes, so that
+*   they may run on different threads. Each is given the stream's bytes in
+*   order, and digest() is given the cuts that scan() found in the same bytes.
+*/
+class Chunker {
+  public:
+    struct Chunk {
+      uint64_t offset;
+      uint32_t size;
+      uint8_t  digest[32];
+    };
+
+    Chunker() {};
+
+    void begin(unsigned int avg_size);
+    void scan(const uint8_t* data, size_t len, std::vector<uint32_t>* cuts);
+    void digest(const uint8_t* data, size_t len, const std::vector<uint32_t>* cuts);
+    void finish();
+
+    inline std::vector<Chunk>* chunks() {  return &_chunks;  };
+
+    static unsigned long filesChunked();
+    static unsigned long chunksCut();
+
+
+  private:
+    // Used by scan().
+    uint64_t _fp      = 0;       // The gear hash, since the chunk's first min bytes.
+    uint32_t _len     = 0;       // Bytes in the current chunk so far.
+    uint32_t _min     = 0;
+    uint32_t _avg     = 0;
+    uint32_t _max     = 0;
+    uint64_t _mask_s  = 0;       // Used before the chunk reaches the average.
+    uint64_t _mask_l  = 0;       // Used after.
+    // Used by digest().
+    Sha256   _hasher;
+    uint64_t _offset  = 0;       // Where the current chunk starts.
+    uint32_t _hashed  = 0;       // Bytes of the current chunk hashed so far.
+    std::vector<Chunk> _chunks;
+
+    void _cut();
+};
+
+
+/*
+* Reads one large file ahead of whoever is hashing it. A helper thread fills
+*   the next buffers while the caller hashes the last one, so that the disk
+*   and the CPU are both kept busy. Each worker thread owns at most one, made
+*   on first use, and its buffers are kept for the life of the thread. They
+*   are aligned, so that the file may be read with O_DIRECT.
+* If given a Chunker, the helper also finds the chunk boundaries in each buffer
+*   as it is read, and a second helper hashes the chunks from the same buffers.
+*   A buffer is filled again only once the caller and the second helper are
+*   both done with it. So chunking a file overlaps with hashing it, and neither
+*   helper does much more work than the caller does.
+*/
+class StreamReader {
+  public:
+    StreamReader() {};
+    ~StreamReader();
+
+    int  begin(int fd, uint64_t size, bool direct, Chunker* chunker = nullptr);
+    const uint8_t* next(size_t* len);
+    int  end();
+
+    static StreamReader* forThisThread();
+    static unsigned long filesStreamed();
+    static unsigned long filesDirect();
+
+
+  private:
+    std::thread*            _thread = nullptr;
+    std::thread*            _chunk_thread = nullptr;   // Made on first use.
+    std::mutex              _mutex;
+    std::condition_variable _cv;
+    uint8_t* _bufs[STREAM_BUFFERS] = {};
+    size_t   _lens[STREAM_BUFFERS] = {};
+    std::vector<uint32_t> _cuts[STREAM_BUFFERS];   // Chunk boundaries found in each buffer.
+    unsigned int _head   = 0;      // Next buffer for the consumer.
+    unsigned int _tail   = 0;      // Next buffer for the helper to fill.
+    unsigned int _filled = 0;      // Buffers filled, and not yet given back by the consumer.
+    unsigned int _chunk_head = 0;  // Next buffer for the chunk helper.
+    unsigned int _unhashed   = 0;  // Buffers filled, and not yet done with by the chunk helper.
+    bool     _held     = false;    // The consumer has the buffer at _head.
+    int      _fd       = -1;
+    uint64_t _size     = 0;
+    uint64_t _offset   = 0;        // Bytes the helper has read so far.
+    bool     _direct   = false;
+    bool     _active   = false;    // A file is being read.
+    bool     _finished = false;    // The helper has read all it will of this file.
+    bool     _failed   = false;
+    bool     _abort    = false;    // The consumer gave up before the end.
+    bool     _quit     = false;
+    Chunker* _chunker  = nullptr;  // Scanned by the helper, and hashed by the chunk helper.
+
+    int  _alloc();
+    void _run();
+    void _run_chunks();
+    ssize_t _fill(uint8_t* buf, size_t len);
+};
+
+
+/*
+* A per-worker deque of chunks awaiting examination.
+* The owning worker pushes and pops at the back, so it proceeds depth-first and
+*   keeps its working set small. Idle workers steal from the front, which is
+*   where the oldest (and usually the largest) subtrees are waiting.
+*/
+class ScanDeque {
+  public:
+    ScanDeque() {};
+    ~ScanDeque() {};
+
+    void push(ScanChunk*);
+    ScanChunk* pop();
+    ScanChunk* steal();
+    size_t size();
+
+
+  private:
+    std::mutex _mutex;
+    std::deque<ScanChunk*> _items;
+};
+
+
+/*
+* The occupancy of one stage of the pipeline, in entries and bytes, against a
+*   budget of each (0 is unlimited). Stages only count. It is up to whoever
+*   feeds a stage to wait for room in it, or to do something more useful.
+*/
+class ScanStage {
+  public:
+    ScanStage(const char* name) : _name(name) {};
+    ~ScanStage() {};
+
+    void setBudget(unsigned long entries, unsigned long bytes);
+    void add(unsigned long entries, unsigned long bytes);
+    void remove(unsigned long entries, unsigned long bytes);
+    void waitForRoom();
+    void resetHighWater();
+    void printBrief(StringBuilder*);
+    void printDebug(StringBuilder*);
+
+    inline bool full() {
+      return (((0 != _max_entries) && (_entries.load() >= _max_entries)) || ((0 != _max_bytes) && (_bytes.load() >= _max_bytes)));
+    };
+
+
+  private:
+    const char* const _name;
+    unsigned long _max_entries = 0;
+    unsigned long _max_bytes   = 0;
+    std::atomic<unsigned long> _entries{0};
+    std::atomic<unsigned long> _bytes{0};
+    std::atomic<unsigned long> _hw_entries{0};
+    std::atomic<unsigned long> _hw_bytes{0};
+    std::atomic<unsigned long> _waits{0};     // Times a producer found us full.
+    std::atomic<unsigned int>  _waiters{0};
+    std::mutex                 _mutex;
+    std::condition_variable    _cv;
+};
+
+
+/*
+* The workers for a single device (st_dev). Every device a scan touches gets a
+*   pool sized for its class, so that a slow disk cannot hold the workers a fast
+*   one needs, and a fast one cannot bury a slow one in concurrent reads.
+* A pool is never shrunk by stopping threads. Workers beyond the active count
+*   park until they are wanted again, and their deques are drained by stealing.
+*/
+class DevicePool {
+  public:
+    DevicePool(ScanScheduler*, dev_t, DeviceClass);
+    ~DevicePool();
+
+    void resize(unsigned int active);
+    void stop();
+    void push(ScanChunk*);
+    bool helpOnce();
+    void tune(ScanOptions*, int io_pressure, double secs);
+    void resetTuning();
+    void printDebug(StringBuilder*);
+
+    inline void creditFiles(unsigned long f) {  _files_done += f;  };
+    inline void creditBytes(unsigned long b) {  _bytes_done += b;  };
+
+    inline dev_t device() {              return _dev;            };
+    inline DeviceClass deviceClass() {   return _class;          };
+    inline long queued() {               return _queued.load();  };
+
+    static DevicePool* current();
+    static DeviceClass classify(dev_t, const char* path);
+    static const char* classString(DeviceClass);
+
+
+  private:
+    ScanScheduler* const _sched;
+    const dev_t       _dev;
+    const DeviceClass _class;
+    ScanDeque                 _deques[DEVICE_POOL_MAX_THREADS];
+    std::vector<std::thread*> _threads;     // Guarded by _ctrl_mutex.
+    std::mutex              _ctrl_mutex;    // Serializes resize() and stop().
+    std::mutex              _wake_mutex;    // Guards sleeping and parked workers.
+    std::condition_variable _work_cv;
+    std::condition_variable _park_cv;
+
+    std::atomic<long>          _queued{0};    // Chunks sitting in a deque.
+    std::atomic<unsigned int>  _spawned{0};   // Threads (and deques) in use.
+    std::atomic<unsigned int>  _active{0};    // Threads allowed to take work.
+    std::atomic<unsigned int>  _sleepers{0};
+    std::atomic<unsigned int>  _next_deque{0};
+    std::atomic<bool>          _running{true};
+    std::atomic<unsigned long> _files_done{0};  // Progress, as seen by the controller.
+    std::atomic<unsigned long> _bytes_done{0};
+
+    // Controller state. Only touched by the controller, and by resetTuning().
+    unsigned long _last_files = 0;
+    unsigned long _last_bytes = 0;
+    std::atomic<double> _last_score{0.0};
+    int           _step_dir   = 1;
+
+    void _worker(unsigned int idx);
+    ScanChunk* _take_work(unsigned int idx);
+};
+
+
+/*
+* Small files that one worker has set aside to read and hash together. They
+*   are batched if the engine can hash several at a time, or if io_uring can
+*   read several at a time.
+*/
+class HashBatch {
+  public:
+    ORMFileData* objs[HASH_BATCH_FILES];
+    unsigned int count = 0;
+};
+
+
+/*
+* The scan scheduler owns a DevicePool per device, a DB writer, and a
+*   controller that sizes the pools. All of them are built on first use, and
+*   reused by every scan.
+*
+* Termination is tracked by counting objects from the moment they are submitted
+*   until the DB writer retires them. Because a directory submits its children
+*   before it is itself handed to the DB writer, the count can only reach zero
+*   when every directory, hash, and row is finished.
+*
+* A checkpoint pauses dives. Directories found after that are set aside
+*   unread, and once everything else has drained, they are all that is left of
+*   the scan.
+*
+* Given a baseline catalog, files that have not changed since it take their
+*   old digests, and are never read. Failing that, so do files the host's hash
+*   cache knows, and every file that is hashed is stored there.
+*
+* A dupes scan goes no deeper than metadata, and files are added to a table by
+*   size as they are stat'd, for a DupeFinder to take once the scan is done.
+*
+* A verify scan reads and hashes everything, but writes nothing. Each object is
+*   checked against a stored catalog's rows as it would have gone to the DB
+*   writer, and then retired.
+*
+* Memory is bounded by budgets on each stage. Hashing and the DB queue make
+*   their producers wait for room. A directory reader that finds too much
+*   unexamined work instead examines some of it, so that readers never wait on
+*   each other.
+*/
+class ScanScheduler {
+  public:
+    ScanScheduler();
+    ~ScanScheduler();
+
+    int  start();
+    void shutdown();
+    int  beginScan(FSOCounts*, LinkedList<StringBuilder*>*, ScanOptions*, dev_t root_dev);
+    void waitForIdle();
+    bool waitForIdle(unsigned int ms);
+    void pauseDives();
+    void resumeDives(std::vector<PathNode*>* deferred);
+    void defer(PathNode* dir);
+    void submit(ORMFileData*);
+    void submit(ScanChunk*, dev_t, PathNode* where);
+    void submitToDB(ORMFileData*);
+    void throttleTraversal();
+    void printOccupancy(StringBuilder*);
+    void printDebug(StringBuilder*);
+
+    inline bool running() {            return _running;                };
+    inline ScanOptions* options() {    return _opts;                   };
+    inline dev_t rootDevice() {        return _root_dev;               };
+    inline long outstanding() {        return _outstanding.load();     };
+    inline bool divesPaused() {        return _dives_paused.load();    };
+    inline unsigned long rowsFailed() {  return _rows_failed.load();   };
+    inline BaselineTable* baseline() {   return &_baseline;            };
+    inline SizeTable* sizes() {          return &_sizes;               };
+    inline VerifyTable* verifier() {     return &_verify;              };
+
+    static ScanScheduler* getInstance();
+
+
+  private:
+    friend class DevicePool;
+    std::mutex                  _pools_mutex;   // Guards _pools.
+    std::vector<DevicePool*>    _pools;
+    std::thread*              _db_thread = nullptr;
+    std::thread*              _tune_thread = nullptr;
+    FSOCounts*                 _stats    = nullptr;
+    LinkedList<StringBuilder*>* _logs    = nullptr;
+    ScanOptions*               _opts     = nullptr;
+    dev_t                      _root_dev = 0;
+    InodeTable                 _inodes;
+    BaselineTable              _baseline;
+    SizeTable                  _sizes;
+    VerifyTable                _verify;
+    HashCache*                 _hash_cache = nullptr;   // The host's cache, if this scan uses it.
+
+    std::mutex              _db_mutex;     // Guards _db_queue.
+    std::condition_variable _db_cv;
+    std::deque<ORMFileData*> _db_queue;
+    std::mutex              _idle_mutex;   // Guards scan completion.
+    std::condition_variable _idle_cv;
+    std::mutex              _tune_mutex;   // Lets shutdown() interrupt the controller.
+    std::condition_variable _tune_cv;
+    std::atomic<int>        _io_pressure{-1};   // Last reading of /proc/pressure/io, or -1.
+    ScanStage               _stage_traverse{"Traverse"};  // Submitted, not yet examined.
+    ScanStage               _stage_hash{"Hash"};          // Being read and hashed.
+    ScanStage               _stage_db{"DB"};              // Examined, waiting for the DB writer.
+    std::mutex              _deferred_mutex;   // Guards _deferred.
+    std::vector<PathNode*>  _deferred;         // Directories left unread by a checkpoint.
+    std::atomic<bool>       _dives_paused{false};
+    size_t                  _batch_max_size = 0;   // Largest file a worker sets aside in a HashBatch. 0 for none.
+
+    std::atomic<long>          _outstanding{0};  // Objects not yet retired.
+    std::atomic<unsigned long> _rows_written{0};
+    std::atomic<unsigned long> _rows_failed{0};
+    std::atomic<unsigned long> _steals{0};
+    std::atomic<bool>          _running{false};
+    std::atomic<bool>          _db_running{false};
+
+    DevicePool* _pool_for(dev_t, PathNode* where);
+    void _db_worker();
+    void _tune_worker();
+    void _examine_chunk(ScanChunk*);
+    void _examine_ordered(ScanChunk*);
+    void _finish_file(ORMFileData*, HashBatch*);
+    void _flush_batch(HashBatch*);
+    void _read_batch(HashBatch*, const uint8_t** msgs, bool* read_ok);
+    bool _reuse_digests(ORMFileData*);
+    bool _from_hash_cache(ORMFileData*);
+    void _remember(ORMFileData*);
+    void _advise_next(ORMFileData*, ORMFileData* next);
+    void _hash(ORMFileData*);
+    void _credit(ORMFileData*);
+    void _retire(std::vector<ORMFileData*>*, bool written);
+};
+
+#endif  // __SCAN_ENGINE_H__
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "ScanEngine.h"
+
+
+/*
+* Set an option by name. Returns 0 on success, -1 for an unknown key.
+*/
+int ScanOptions::set(const char* key, const char* value) {
+  if (0 == strcasecmp(key, "dirfd")) {
+    dirfd_relative = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "fd-budget")) {
+    fd_budget = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "uring")) {
+    use_uring = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "depth")) {
+    return setDepth(value);
+  }
+  else if (0 == strcasecmp(key, "hash-order")) {
+    if (0 == strcasecmp(value, "readdir")) {      hash_order = HashOrder::READDIR;  }
+    else if (0 == strcasecmp(value, "inode")) {   hash_order = HashOrder::INODE;    }
+    else if (0 == strcasecmp(value, "extent")) {  hash_order = HashOrder::EXTENT;   }
+    else {
+      return -1;
+    }
+  }
+  else if (0 == strcasecmp(key, "hash-engine")) {
+    if (0 == strcasecmp(value, "auto")) {          hash_engine = HashEngine::AUTO;     }
+    else if (0 == strcasecmp(value, "openssl")) {  hash_engine = HashEngine::OPENSSL;  }
+    else if (0 == strcasecmp(value, "scalar")) {   hash_engine = HashEngine::SCALAR;   }
+    else if (0 == strcasecmp(value, "sha-ni")) {   hash_engine = HashEngine::SHA_NI;   }
+    else if (0 == strcasecmp(value, "avx2")) {     hash_engine = HashEngine::AVX2;     }
+    else if (0 == strcasecmp(value, "avx512")) {   hash_engine = HashEngine::AVX512;   }
+    else {
+      return -1;
+    }
+  }
+  else if (0 == strcasecmp(key, "spindle-threads")) {
+    spindle_threads = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "dupes-sample")) {
+    const unsigned long v = strtoul(value, nullptr, 10);
+    if ((0 == v) || (v > HASH_BUFFER_SIZE)) {
+      return -1;
+    }
+    dupes_sample = (unsigned int) v;
+  }
+  else if (0 == strcasecmp(key, "dupes-min-size")) {
+    dupes_min_size = strtoull(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "dupes-confirm")) {
+    dupes_confirm = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "digests")) {
+    if (0 == strcasecmp(value, "sha256")) {       digests = DIGEST_SHA256;                    }
+    else if (0 == strcasecmp(value, "blake3")) {  digests = DIGEST_BLAKE3;                    }
+    else if (0 == strcasecmp(value, "both")) {    digests = DIGEST_SHA256 | DIGEST_BLAKE3;    }
+    else {
+      return -1;
+    }
+  }
+  else if (0 == strcasecmp(key, "blake3-threads")) {
+    blake3_threads = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "chunks")) {
+    chunks = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "chunk-avg")) {
+    const unsigned long avg = strtoul(value, nullptr, 10);
+    if ((avg < CHUNK_AVG_SIZE_MIN) || (avg > CHUNK_AVG_SIZE_MAX) || (0 != (avg & (avg - 1)))) {
+      return -1;
+    }
+    chunk_avg_size = (unsigned int) avg;
+  }
+  else if (0 == strcasecmp(key, "hash-cache")) {
+    hash_cache = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "baseline")) {
+    baseline = (uint32_t) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "watch-backend")) {
+    if (0 == strcasecmp(value, "auto")) {           watch_backend = WatchBackend::AUTO;      }
+    else if (0 == strcasecmp(value, "fanotify")) {  watch_backend = WatchBackend::FANOTIFY;  }
+    else if (0 == strcasecmp(value, "inotify")) {   watch_backend = WatchBackend::INOTIFY;   }
+    else {
+      return -1;
+    }
+  }
+  else if (0 == strcasecmp(key, "watch-debounce")) {
+    watch_debounce_ms = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "hardlinks")) {
+    hardlinks = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "one-fs")) {
+    one_fs = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "direct-io")) {
+    direct_io = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "threads-ssd")) {
+    threads_ssd = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "threads-hdd")) {
+    threads_hdd = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "threads-net")) {
+    threads_net = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "threads-other")) {
+    threads_other = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "tune")) {
+    tune = (0 != atoi(value));
+  }
+  else if (0 == strcasecmp(key, "tune-min")) {
+    tune_min = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "tune-max")) {
+    tune_max = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "tune-interval")) {
+    tune_interval = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "tune-psi")) {
+    tune_psi_limit = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "budget-traverse")) {
+    budget_traverse = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "budget-traverse-mb")) {
+    budget_traverse_mb = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "budget-hash")) {
+    budget_hash = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "budget-hash-mb")) {
+    budget_hash_mb = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "budget-db")) {
+    budget_db = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "budget-db-mb")) {
+    budget_db_mb = (unsigned int) strtoul(value, nullptr, 10);
+  }
+  else if (0 == strcasecmp(key, "checkpoint")) {
+    return parseDuration(value, &checkpoint_secs);
+  }
+  else if (0 == strcasecmp(key, "time-box")) {
+    return parseDuration(value, &time_box_secs);
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+* Parse a duration: a number of minutes, or a number followed by s, m, or h.
+* Returns 0 on success, -1 on failure.
+*/
+int ScanOptions::parseDuration(const char* value, unsigned int* secs) {
+  char* end = nullptr;
+  const unsigned long v = strtoul(value, &end, 10);
+  if (end == value) {
+    return -1;
+  }
+  switch (*end) {
+    case 's':   *secs = (unsigned int) v;           break;
+    case '\0':
+    case 'm':   *secs = (unsigned int) (v * 60);    break;
+    case 'h':   *secs = (unsigned int) (v * 3600);  break;
+    default:    return -1;
+  }
+  return 0;
+}
+
+
+/*
+* Set the scan depth by name. Returns 0 on success, -1 for an unknown name.
+*/
+int ScanOptions::setDepth(const char* name) {
+  if (0 == strcasecmp(name, "structure")) {
+    depth = ScanDepth::STRUCTURE;
+  }
+  else if (0 == strcasecmp(name, "metadata")) {
+    depth = ScanDepth::METADATA;
+  }
+  else if (0 == strcasecmp(name, "full")) {
+    depth = ScanDepth::FULL;
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+* The number of workers a device of the given class should get.
+*/
+unsigned int ScanOptions::threadsFor(DeviceClass c) {
+  switch (c) {
+    case DeviceClass::SSD:
+      if (0 == threads_ssd) {
+        const unsigned int cpus = std::thread::hardware_concurrency();
+        return (cpus > 4) ? cpus : 4;
+      }
+      return threads_ssd;
+    case DeviceClass::HDD:      return threads_hdd;
+    case DeviceClass::NETWORK:  return threads_net;
+    default:                    return threads_other;
+  }
+}
+
+
+/*
+* Threads that may share the BLAKE3 of one large file.
+*/
+unsigned int ScanOptions::blake3Threads() {
+  if (0 == blake3_threads) {
+    const unsigned int cpus = std::thread::hardware_concurrency();
+    return (cpus > 1) ? cpus : 1;
+  }
+  return blake3_threads;
+}
+
+
+const char* ScanOptions::hashOrderString(HashOrder o) {
+  switch (o) {
+    case HashOrder::INODE:      return "inode";
+    case HashOrder::EXTENT:     return "extent";
+    default:                    return "readdir";
+  }
+}
+
+
+const char* ScanOptions::hashEngineString(HashEngine e) {
+  switch (e) {
+    case HashEngine::OPENSSL:   return "openssl";
+    case HashEngine::SCALAR:    return "scalar";
+    case HashEngine::SHA_NI:    return "sha-ni";
+    case HashEngine::AVX2:      return "avx2";
+    case HashEngine::AVX512:    return "avx512";
+    default:                    return "auto";
+  }
+}
+
+
+const char* ScanOptions::digestsString(uint8_t d) {
+  switch (d & (DIGEST_SHA256 | DIGEST_BLAKE3)) {
+    case DIGEST_BLAKE3:                    return "blake3";
+    case DIGEST_SHA256 | DIGEST_BLAKE3:    return "both";
+    default:                               return "sha256";
+  }
+}
+
+
+const char* ScanOptions::watchBackendString(WatchBackend b) {
+  switch (b) {
+    case WatchBackend::FANOTIFY:  return "fanotify";
+    case WatchBackend::INOTIFY:   return "inotify";
+    default:                      return "auto";
+  }
+}
+
+
+const char* ScanOptions::depthString(ScanDepth d) {
+  switch (d) {
+    case ScanDepth::STRUCTURE:  return "structure";
+    case ScanDepth::METADATA:   return "metadata";
+    case ScanDepth::FULL:       return "full";
+    default:                    return "none";
+  }
+}
+
+
+void ScanOptions::printDebug(StringBuilder* output) {
+  if (baseline) {
+    output->concatf("  baseline   catalog %u\n", baseline);
+  }
+  output->concatf("  budget     traverse %u / %u MiB, hash %u / %u MiB, db %u / %u MiB (0 is unlimited)\n", budget_traverse, budget_traverse_mb, budget_hash, budget_hash_mb, budget_db, budget_db_mb);
+  if (checkpoint_secs) {
+    output->concatf("  checkpoint every %us\n", checkpoint_secs);
+  }
+  else {
+    output->concat("  checkpoint at the end only\n");
+  }
+  output->concatf("  chunks     %s, averaging %u KiB\n", chunks ? "on" : "off", chunk_avg_size >> 10);
+  output->concatf("  depth      %s\n", depthString(depth));
+  output->concatf("  digests    %s (blake3 on up to %u threads per file)\n", digestsString(digests), blake3Threads());
+  output->concatf("  dirfd      %s\n", dirfd_relative ? "on" : "off");
+  output->concatf("  direct-io  %s\n", direct_io ? "on" : "off");
+  output->concatf("  dupes      sample %u bytes from each end, min size %lu, confirm %s\n", dupes_sample, (unsigned long) dupes_min_size, dupes_confirm ? "on" : "off");
+  if (fd_budget) {
+    output->concatf("  fd-budget  %u\n", fd_budget);
+  }
+  else {
+    output->concat("  fd-budget  auto\n");
+  }
+  output->concatf("  hardlinks  %s\n", hardlinks ? "on" : "off");
+  output->concatf("  hash-cache %s%s\n", hash_cache ? "on" : "off", HashCache::getInstance()->isOpen() ? "" : " (none open)");
+  output->concatf("  hash-order %s\n", hashOrderString(hash_order));
+  output->concatf("  hash-engine %s (in use: %s)\n", hashEngineString(hash_engine), hashEngineString(Sha256::engine()));
+  output->concatf("  one-fs     %s\n", one_fs ? "on" : "off");
+  output->concatf("  rules      %u\n", rules.count());
+  if (spindle_threads) {
+    output->concatf("  spindle-threads %u\n", spindle_threads);
+  }
+  else {
+    output->concat("  spindle-threads unlimited\n");
+  }
+  output->concatf("  threads    ssd %u, hdd %u, net %u, other %u\n", threadsFor(DeviceClass::SSD), threads_hdd, threads_net, threads_other);
+  if (tune) {
+    output->concatf("  tune       %u to %u threads, every %ums, psi limit %u%%\n", tune_min, tune_max, tune_interval, tune_psi_limit);
+  }
+  else {
+    output->concat("  tune       off\n");
+  }
+  if (time_box_secs) {
+    output->concatf("  time-box   %us\n", time_box_secs);
+  }
+  output->concatf("  watch      %s, debounce %ums\n", watchBackendString(watch_backend), watch_debounce_ms);
+  output->concatf("  uring      %s%s\n", use_uring ? "on" : "off", UringQueue::available() ? "" : " (unavailable)");
+}
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "ScanEngine.h"
+
+
+/*
+* Match a glob against a string. Supports *, ?, [...] (with ! or ^ to negate,
+*   and ranges), and backslash escapes. A single * never crosses a '/'. A **
+*   crosses any number of them, and "**" followed by '/' may also match nothing.
+*/
+static bool _glob(const char* p, const char* s) {
+  while (*p) {
+    switch (*p) {
+      case '*':
+        if ('*' == *(p + 1)) {
+          p += 2;
+          if ('/' == *p) {
+            p++;
+            const char* t = s;
+            while (true) {
+              if (_glob(p, t)) {
+                return true;
+              }
+              t = strchr(t, '/');
+              if (nullptr == t) {
+                return false;
+              }
+              t++;
+            }
+          }
+          for (const char* t = s; ; t++) {
+            if (_glob(p, t)) {
+              return true;
+            }
+            if ('\0' == *t) {
+              return false;
+            }
+          }
+        }
+        p++;
+        for (const char* t = s; ; t++) {
+          if (_glob(p, t)) {
+            return true;
+          }
+          if (('\0' == *t) || ('/' == *t)) {
+            return false;
+          }
+        }
+      case '?':
+        if (('\0' == *s) || ('/' == *s)) {
+          return false;
+        }
+        p++;
+        s++;
+        break;
+      case '[':
+        {
+          if (('\0' == *s) || ('/' == *s)) {
+            return false;
+          }
+          const char* q = p + 1;
+          bool neg   = false;
+          bool hit   = false;
+          bool first = true;
+          if (('!' == *q) || ('^' == *q)) {
+            neg = true;
+            q++;
+          }
+          while (('\0' != *q) && (first || (']' != *q))) {
+            first = false;
+            if (('\\' == *q) && ('\0' != *(q + 1))) {
+              q++;
+            }
+            unsigned char lo = (unsigned char) *q;
+            unsigned char hi = lo;
+            if (('-' == *(q + 1)) && ('\0' != *(q + 2)) && (']' != *(q + 2))) {
+              q += 2;
+              if (('\\' == *q) && ('\0' != *(q + 1))) {
+                q++;
+              }
+              hi = (unsigned char) *q;
+            }
+            if ((lo <= (unsigned char) *s) && ((unsigned char) *s <= hi)) {
+              hit = true;
+            }
+            q++;
+          }
+          if (']' != *q) {
+            // Unterminated. Treat the bracket as a literal.
+            if ('[' != *s) {
+              return false;
+            }
+            p++;
+            s++;
+            break;
+          }
+          if (hit == neg) {
+            return false;
+          }
+          p = q + 1;
+          s++;
+        }
+        break;
+      case '\\':
+        if ('\0' != *(p + 1)) {
+          p++;
+        }
+        // Fall through to a literal match.
+      default:
+        if (*p != *s) {
+          return false;
+        }
+        p++;
+        s++;
+        break;
+    }
+  }
+  return ('\0' == *s);
+}
+
+
+static bool _has_glob_chars(const char* s) {
+  return (nullptr != strpbrk(s, "*?[\\"));
+}
+
+
+/*
+* Parse a size with an optional binary suffix (k, M, G, T).
+* Returns 0 on success, -1 on failure.
+*/
+static int _parse_size(const char* s, uint64_t* out) {
+  char* end = nullptr;
+  uint64_t v = strtoull(s, &end, 10);
+  if (end == s) {
+    return -1;
+  }
+  switch (toupper(*end)) {
+    case 'T':  v <<= 10;  // Fall through.
+    case 'G':  v <<= 10;  // Fall through.
+    case 'M':  v <<= 10;  // Fall through.
+    case 'K':  v <<= 10;  end++;  break;
+    case '\0':  break;
+    default:    return -1;
+  }
+  if ('\0' != *end) {
+    return -1;
+  }
+  *out = v;
+  return 0;
+}
+
+
+
+/*******************************************************************************
+* ScanRule
+*******************************************************************************/
+
+ScanRule::~ScanRule() {
+  if (_text) {
+    free(_text);
+    _text = nullptr;
+  }
+  if (_glob_str) {
+    free(_glob_str);
+    _glob_str = nullptr;
+  }
+}
+
+
+/*
+* Compile one rule. The grammar is:
+*   [!]<glob> [<predicate> ...]
+*   [!]<predicate> [<predicate> ...]
+* where a predicate is one of size>N, size<N, mtime>YYYY-MM-DD, mtime<YYYY-MM-DD.
+* Globs follow .gitignore: a trailing '/' restricts the rule to directories,
+*   and a glob containing any other '/' is anchored at the scan root.
+*   Otherwise, it is matched against the name alone, at any depth.
+* Returns 0 on success, -1 on a parse error.
+*/
+int ScanRule::compile(const char* text) {
+  _text = strdup(text);
+  char* work = strdup(text);
+  if ((nullptr == _text) || (nullptr == work)) {
+    free(work);
+    return -1;
+  }
+  int ret = 0;
+  char* save = nullptr;
+  char* tok  = strtok_r(work, " \t", &save);
+  if (tok && ('!' == *tok)) {
+    _negate = true;
+    tok++;
+    if ('\0' == *tok) {
+      tok = strtok_r(nullptr, " \t", &save);
+    }
+  }
+  while (tok && (0 == ret)) {
+    if ((0 == strncmp(tok, "size", 4)) && (('<' == tok[4]) || ('>' == tok[4]))) {
+      uint64_t v = 0;
+      ret = _parse_size(tok + 5, &v);
+      if ('<' == tok[4]) {  _size_lt = v;  _preds |= RULE_PRED_SIZE_LT;  }
+      else {                _size_gt = v;  _preds |= RULE_PRED_SIZE_GT;  }
+    }
+    else if ((0 == strncmp(tok, "mtime", 5)) && (('<' == tok[5]) || ('>' == tok[5]))) {
+      struct tm tm_val;
+      memset(&tm_val, 0, sizeof(tm_val));
+      const char* end = strptime(tok + 6, "%Y-%m-%d", &tm_val);
+      if ((nullptr == end) || ('\0' != *end)) {
+        ret = -1;
+      }
+      else {
+        tm_val.tm_isdst = -1;
+        const time_t t = mktime(&tm_val);
+        if ('<' == tok[5]) {  _mtime_lt = t;  _preds |= RULE_PRED_MTIME_LT;  }
+        else {                _mtime_gt = t;  _preds |= RULE_PRED_MTIME_GT;  }
+      }
+    }
+    else if ((nullptr == _glob_str) && (0 == _preds)) {
+      size_t len = strlen(tok);
+      if ((len > 1) && ('/' == tok[len - 1])) {
+        _dir_only = true;
+        tok[--len] = '\0';
+      }
+      if ('/' == *tok) {
+        _anchored = true;
+        tok++;
+      }
+      else if (nullptr != strchr(tok, '/')) {
+        _anchored = true;
+      }
+      if (0 == strncmp(tok, "**/", 3) && (nullptr == strchr(tok + 3, '/'))) {
+        // Anywhere in the tree is what an unanchored name match already means.
+        _anchored = false;
+        tok += 3;
+      }
+      _glob_str = strdup(tok);
+      if ((nullptr == _glob_str) || ('\0' == *_glob_str)) {
+        ret = -1;
+      }
+      else if (_anchored) {
+        _kind = RuleKind::PATH_GLOB;
+      }
+      else if (!_has_glob_chars(_glob_str)) {
+        _kind = RuleKind::NAME_LITERAL;
+      }
+      else if (('*' == *_glob_str) && !_has_glob_chars(_glob_str + 1)) {
+        _kind = RuleKind::NAME_SUFFIX;
+        _suffix_len = strlen(_glob_str + 1);
+      }
+      else {
+        _kind = RuleKind::NAME_GLOB;
+      }
+    }
+    else {
+      ret = -1;   // A second glob, or a glob after a predicate.
+    }
+    tok = strtok_r(nullptr, " \t", &save);
+  }
+  if ((nullptr == _glob_str) && (0 == _preds)) {
+    ret = -1;   // Nothing to match on.
+  }
+  free(work);
+  return ret;
+}
+
+
+/*
+* Does the rule's glob (if it has one) accept this entry? The relative path
+*   is only needed by anchored rules.
+*/
+bool ScanRule::matchesName(const char* rel_path, const char* name, size_t name_len) {
+  switch (_kind) {
+    case RuleKind::ANY:
+      return true;
+    case RuleKind::NAME_LITERAL:
+      return (0 == strcmp(_glob_str, name));
+    case RuleKind::NAME_SUFFIX:
+      return ((name_len >= _suffix_len) && (0 == memcmp(name + (name_len - _suffix_len), _glob_str + 1, _suffix_len)));
+    case RuleKind::NAME_GLOB:
+      return _glob(_glob_str, name);
+    case RuleKind::PATH_GLOB:
+      return (rel_path && _glob(_glob_str, rel_path));
+  }
+  return false;
+}
+
+
+bool ScanRule::matchesStat(uint64_t size, time_t mtime) {
+  if ((_preds & RULE_PRED_SIZE_GT)  && !(size > _size_gt)) {     return false;  }
+  if ((_preds & RULE_PRED_SIZE_LT)  && !(size < _size_lt)) {     return false;  }
+  if ((_preds & RULE_PRED_MTIME_GT) && !(mtime > _mtime_gt)) {   return false;  }
+  if ((_preds & RULE_PRED_MTIME_LT) && !(mtime < _mtime_lt)) {   return false;  }
+  return true;
+}
+
+
+
+/*******************************************************************************
+* ScanRules
+*******************************************************************************/
+
+ScanRules::~ScanRules() {
+  clear();
+}
+
+
+/*
+* Compile and append a rule.
+* Returns 0 on success, -1 if the rule does not parse.
+*/
+int ScanRules::add(const char* text) {
+  ScanRule* r = new ScanRule();
+  if (0 != r->compile(text)) {
+    delete r;
+    return -1;
+  }
+  _rules.push_back(r);
+  if (r->anchored()) {
+    _need_rel_path = true;
+  }
+  return 0;
+}
+
+
+void ScanRules::clear() {
+  for (ScanRule* r : _rules) {
+    delete r;
+  }
+  _rules.clear();
+  _need_rel_path = false;
+}
+
+
+/*
+* Decide an entry from its dirent, before it has been stat'd. A rule that
+*   needs the entry's type or stat to decide makes the verdict UNDECIDED, and
+*   the entry must be checked again once it has been stat'd.
+*/
+RuleVerdict ScanRules::evaluate(const char* rel_path, const char* name, uint8_t d_type) {
+  return _evaluate(rel_path, name, (DT_UNKNOWN != d_type), (DT_DIR == d_type), (DT_REG == d_type), false, 0, 0);
+}
+
+
+/*
+* Decide an entry that has been stat'd. Never returns UNDECIDED.
+*/
+RuleVerdict ScanRules::evaluate(const char* rel_path, const char* name, bool is_dir, bool is_file, uint64_t size, time_t mtime) {
+  return _evaluate(rel_path, name, true, is_dir, is_file, true, size, mtime);
+}
+
+
+/*
+* The last rule that matches an entry wins. An entry that no rule matches is
+*   included.
+*/
+RuleVerdict ScanRules::_evaluate(const char* rel_path, const char* name, bool type_known, bool is_dir, bool is_file, bool have_stat, uint64_t size, time_t mtime) {
+  const size_t name_len = strlen(name);
+  for (size_t i = _rules.size(); i > 0; i--) {
+    ScanRule* r = _rules[i - 1];
+    if (!r->matchesName(rel_path, name, name_len)) {
+      continue;
+    }
+    if (r->dirOnly()) {
+      if (!type_known) {
+        return RuleVerdict::UNDECIDED;
+      }
+      if (!is_dir) {
+        continue;
+      }
+    }
+    if (r->hasPredicates()) {
+      if (type_known && !is_file) {
+        continue;   // Predicates only apply to regular files.
+      }
+      if (!have_stat) {
+        return RuleVerdict::UNDECIDED;
+      }
+      if (!r->matchesStat(size, mtime)) {
+        continue;
+      }
+    }
+    return r->negated() ? RuleVerdict::INCLUDE : RuleVerdict::EXCLUDE;
+  }
+  return RuleVerdict::INCLUDE;
+}
+
+
+void ScanRules::printDebug(StringBuilder* output) {
+  if (_rules.empty()) {
+    output->concat("  (none)\n");
+    return;
+  }
+  for (size_t i = 0; i < _rules.size(); i++) {
+    output->concatf("  %2u: %s\n", (unsigned int) i, _rules[i]->text());
+  }
+}
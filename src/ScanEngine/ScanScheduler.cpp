@@ -0,0 +1,918 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <algorithm>
+#include <sys/sysmacros.h>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+#include "AbstractPlatform.h"
+
+using namespace std;
+
+
+const int MAX_QUERY_LENGTH = 40000;              // Upper bound on a batched INSERT.
+const unsigned int DB_BATCH_MAX_OBJECTS = 512;   // Objects taken from the queue per pass.
+
+static ScanScheduler* INSTANCE = nullptr;
+
+
+
+/*******************************************************************************
+* ScanDeque
+*******************************************************************************/
+
+void ScanDeque::push(ScanChunk* chunk) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _items.push_back(chunk);
+}
+
+
+ScanChunk* ScanDeque::pop() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  ScanChunk* ret = nullptr;
+  if (!_items.empty()) {
+    ret = _items.back();
+    _items.pop_back();
+  }
+  return ret;
+}
+
+
+ScanChunk* ScanDeque::steal() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  ScanChunk* ret = nullptr;
+  if (!_items.empty()) {
+    ret = _items.front();
+    _items.pop_front();
+  }
+  return ret;
+}
+
+
+size_t ScanDeque::size() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _items.size();
+}
+
+
+
+/*******************************************************************************
+* ScanStage
+*******************************************************************************/
+
+void ScanStage::setBudget(unsigned long entries, unsigned long bytes) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_entries = entries;
+    _max_bytes   = bytes;
+  }
+  _cv.notify_all();
+}
+
+
+void ScanStage::add(unsigned long entries, unsigned long bytes) {
+  const unsigned long e = (_entries += entries);
+  const unsigned long b = (_bytes += bytes);
+  unsigned long hw = _hw_entries.load();
+  while ((e > hw) && !_hw_entries.compare_exchange_weak(hw, e)) {}
+  hw = _hw_bytes.load();
+  while ((b > hw) && !_hw_bytes.compare_exchange_weak(hw, b)) {}
+}
+
+
+void ScanStage::remove(unsigned long entries, unsigned long bytes) {
+  _entries -= entries;
+  _bytes   -= bytes;
+  if (_waiters.load() > 0) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cv.notify_all();
+  }
+}
+
+
+/*
+* Block until the stage is under budget.
+*/
+void ScanStage::waitForRoom() {
+  if (!full()) {
+    return;
+  }
+  _waits++;
+  std::unique_lock<std::mutex> lock(_mutex);
+  _waiters++;
+  _cv.wait(lock, [this]{ return !full(); });
+  _waiters--;
+}
+
+
+void ScanStage::resetHighWater() {
+  _hw_entries = _entries.load();
+  _hw_bytes   = _bytes.load();
+  _waits      = 0;
+}
+
+
+/*
+* Our occupancy and high-water mark, in entries, without a line break.
+*/
+void ScanStage::printBrief(StringBuilder* output) {
+  output->concatf("%s %lu (high %lu)", _name, _entries.load(), _hw_entries.load());
+}
+
+
+void ScanStage::printDebug(StringBuilder* output) {
+  output->concatf("  %-9s %8lu entries, %6lu KiB   (high %lu, %lu KiB)", _name, _entries.load(), (_bytes.load() >> 10), _hw_entries.load(), (_hw_bytes.load() >> 10));
+  if (_waits.load() > 0) {
+    output->concatf("   %lu waits", _waits.load());
+  }
+  output->concat("\n");
+}
+
+
+
+/*******************************************************************************
+* ScanScheduler
+*******************************************************************************/
+
+ScanScheduler* ScanScheduler::getInstance() {
+  if (nullptr == INSTANCE) {
+    INSTANCE = new ScanScheduler();
+  }
+  return INSTANCE;
+}
+
+
+ScanScheduler::ScanScheduler() {}
+
+
+ScanScheduler::~ScanScheduler() {
+  shutdown();
+}
+
+
+/*
+* Start the DB writer. Device pools are started as devices are found. Calling
+*   this on a running scheduler is a no-op.
+* Returns 0 on success, -1 on failure.
+*/
+int ScanScheduler::start() {
+  if (_running) {
+    return 0;
+  }
+  _running    = true;
+  _db_running = true;
+  _db_thread = new std::thread(&ScanScheduler::_db_worker, this);
+  _tune_thread = new std::thread(&ScanScheduler::_tune_worker, this);
+  c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Scan scheduler started.");
+  return 0;
+}
+
+
+/*
+* Stop and join every thread. Anything still queued for the device pools is
+*   discarded. The DB writer drains its queue before it exits.
+*/
+void ScanScheduler::shutdown() {
+  if (!_running) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_tune_mutex);
+    _running = false;
+  }
+  _tune_cv.notify_all();
+  if (_tune_thread) {
+    _tune_thread->join();
+    delete _tune_thread;
+    _tune_thread = nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_pools_mutex);
+    while (_pools.size() > 0) {
+      DevicePool* pool = _pools.back();
+      _pools.pop_back();
+      delete pool;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(_db_mutex);
+    _db_running = false;
+  }
+  _db_cv.notify_all();
+  if (_db_thread) {
+    _db_thread->join();
+    delete _db_thread;
+    _db_thread = nullptr;
+  }
+  _inodes.reset();
+  _baseline.reset();
+  _outstanding = 0;
+}
+
+
+/*
+* Bind the scheduler to the accounting structures of a new scan. Pools left
+*   over from earlier scans are resized to suit the new options.
+* Returns 0 on success, or -1 if a scan is already in progress.
+*/
+int ScanScheduler::beginScan(FSOCounts* stats, LinkedList<StringBuilder*>* logs, ScanOptions* opts, dev_t root_dev) {
+  if (0 != _outstanding.load()) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "A scan is already in progress.");
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(_pools_mutex);
+  _stats    = stats;
+  _logs     = logs;
+  _opts     = opts;
+  _root_dev = root_dev;
+  ScanDirHandle::setBudget(opts->fd_budget);
+  Sha256::select(opts->hash_engine);
+  if (opts->use_uring && UringQueue::readsAvailable()) {
+    _batch_max_size = URING_SMALL_FILE_SIZE;
+  }
+  else {
+    _batch_max_size = ((1 < Sha256::lanes()) && (opts->digests & DIGEST_SHA256)) ? SHA256_SMALL_FILE_SIZE : 0;
+  }
+  _inodes.reset();
+  _baseline.reset();    // The catalog fills it again, if it has a baseline.
+  _hash_cache = nullptr;
+  if (opts->hash_cache && (ScanDepth::FULL == opts->depth) && HashCache::getInstance()->isOpen()) {
+    _hash_cache = HashCache::getInstance();
+    _hash_cache->beginScan();
+  }
+  _sizes.reset();
+  _rows_written = 0;
+  _rows_failed  = 0;
+  _steals       = 0;
+  _stage_traverse.setBudget(opts->budget_traverse, ((unsigned long) opts->budget_traverse_mb << 20));
+  _stage_hash.setBudget(opts->budget_hash, ((unsigned long) opts->budget_hash_mb << 20));
+  _stage_db.setBudget(opts->budget_db, ((unsigned long) opts->budget_db_mb << 20));
+  _stage_traverse.resetHighWater();
+  _stage_hash.resetHighWater();
+  _stage_db.resetHighWater();
+  for (DevicePool* pool : _pools) {
+    pool->resize(opts->threadsFor(pool->deviceClass()));
+    pool->resetTuning();
+  }
+  return 0;
+}
+
+
+/*
+* Blocks until every object submitted since beginScan() has been retired by the
+*   DB writer.
+*/
+void ScanScheduler::waitForIdle() {
+  std::unique_lock<std::mutex> lock(_idle_mutex);
+  _idle_cv.wait(lock, [this]{ return (0 == _outstanding.load()); });
+}
+
+
+/*
+* As above, but gives up after the given number of milliseconds.
+* Returns true if the scan is idle.
+*/
+bool ScanScheduler::waitForIdle(unsigned int ms) {
+  std::unique_lock<std::mutex> lock(_idle_mutex);
+  return _idle_cv.wait_for(lock, std::chrono::milliseconds(ms), [this]{ return (0 == _outstanding.load()); });
+}
+
+
+/*
+* Stop descending. Directories examined from now on are handed to defer()
+*   instead of being read, and the scan drains down to the set of them.
+*/
+void ScanScheduler::pauseDives() {
+  _dives_paused = true;
+}
+
+
+/*
+* Start descending again, and take the directories that were set aside while
+*   dives were paused. Each comes with a reference the caller must release.
+*/
+void ScanScheduler::resumeDives(std::vector<PathNode*>* deferred) {
+  std::lock_guard<std::mutex> lock(_deferred_mutex);
+  _dives_paused = false;
+  deferred->insert(deferred->end(), _deferred.begin(), _deferred.end());
+  _deferred.clear();
+}
+
+
+/*
+* Set aside a directory that was not read because dives are paused.
+*/
+void ScanScheduler::defer(PathNode* dir) {
+  dir->refs++;
+  std::lock_guard<std::mutex> lock(_deferred_mutex);
+  _deferred.push_back(dir);
+}
+
+
+/*
+* Queue a single object for examination, on the pool for its own device.
+*/
+void ScanScheduler::submit(ORMFileData* obj) {
+  ScanChunk* chunk = new ScanChunk();
+  chunk->add(obj);
+  submit(chunk, obj->device(), obj->pathNode());
+}
+
+
+/*
+* Queue a chunk for examination on the pool of the device it was read from. A
+*   device of zero means it is not known (nothing was stat'd), and the chunk
+*   stays with the calling worker's pool.
+*/
+void ScanScheduler::submit(ScanChunk* chunk, dev_t dev, PathNode* where) {
+  unsigned long bytes = 0;
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    bytes += chunk->items[i]->footprint();
+  }
+  _stage_traverse.add(chunk->count, bytes);
+  _outstanding += chunk->count;
+  DevicePool* pool = DevicePool::current();
+  if ((nullptr == pool) || ((0 != dev) && (dev != pool->device()))) {
+    pool = _pool_for(dev, where);
+  }
+  pool->push(chunk);
+}
+
+
+/*
+* Returns the pool for the given device, classifying the device and starting
+*   the pool if this is the first we have seen of it. The node is anywhere on
+*   the device.
+*/
+DevicePool* ScanScheduler::_pool_for(dev_t dev, PathNode* where) {
+  std::lock_guard<std::mutex> lock(_pools_mutex);
+  for (DevicePool* pool : _pools) {
+    if (pool->device() == dev) {
+      return pool;
+    }
+  }
+  const DeviceClass dc = DevicePool::classify(dev, (where) ? PathArena::fullPath(where) : nullptr);
+  const unsigned int threads = _opts->threadsFor(dc);
+  DevicePool* pool = new DevicePool(this, dev, dc);
+  pool->resize(threads);
+  pool->resetTuning();
+  _pools.push_back(pool);
+  c3p_log(LOG_LEV_INFO, __PRETTY_FUNCTION__, "Device %u:%u (%s) gets %u workers.", major(dev), minor(dev), DevicePool::classString(dc), threads);
+  return pool;
+}
+
+
+/*
+* Hand an examined object to the DB writer. The object remains outstanding
+*   until the writer retires it. If the writer is behind by more than its
+*   budget, we wait for it. A verify scan checks the object here, on the
+*   worker that examined it, and the writer then retires it unwritten.
+*/
+void ScanScheduler::submitToDB(ORMFileData* obj) {
+  if (_opts->verify && obj->dirty()) {
+    _verify.check(obj);
+    obj->markClean();
+  }
+  _stage_db.waitForRoom();
+  _stage_db.add(1, obj->footprint());
+  {
+    std::lock_guard<std::mutex> lock(_db_mutex);
+    _db_queue.push_back(obj);
+  }
+  _db_cv.notify_one();
+}
+
+
+/*
+* Called by a directory reader each time it hands off a chunk. While too much
+*   is waiting to be examined, the reader examines queued chunks of its own
+*   pool instead of reading further. The newest chunks come first, and these
+*   are usually the reader's own children.
+* Readers that are already nested SCAN_HELP_DEPTH_MAX deep, or that have
+*   nothing to take, carry on. Nothing here ever waits, so there is no way for
+*   every worker to end up waiting on the others.
+*/
+void ScanScheduler::throttleTraversal() {
+  static thread_local unsigned int help_depth = 0;
+  DevicePool* pool = DevicePool::current();
+  if ((nullptr == pool) || (help_depth >= SCAN_HELP_DEPTH_MAX)) {
+    return;
+  }
+  help_depth++;
+  while (_stage_traverse.full() && pool->helpOnce()) {}
+  help_depth--;
+}
+
+
+/*
+* Called by a device pool's worker for each chunk it takes.
+*/
+void ScanScheduler::_examine_chunk(ScanChunk* chunk) {
+  if (_opts->use_uring) {
+    // Issue the chunk's stats as one batch. Whatever the ring could not
+    //   handle is left pending, and is stat'd synchronously below.
+    UringQueue* ring = UringQueue::forThisThread();
+    if (ring) {
+      ring->statChunk(chunk);
+    }
+  }
+  if ((HashOrder::READDIR == _opts->hash_order) && (0 == _opts->spindle_threads)) {
+    DevicePool* pool = DevicePool::current();
+    HashBatch batch;
+    for (unsigned int i = 0; i < chunk->count; i++) {
+      ORMFileData* obj = chunk->items[i];
+      const size_t footprint = obj->footprint();
+      const int ret = obj->examineMetadata(_stats, _logs);
+      _stage_traverse.remove(1, footprint);
+      if ((1 == ret) && !_reuse_digests(obj)) {
+        _finish_file(obj, &batch);
+      }
+      else {
+        if (_opts->dupes) {
+          _sizes.add(obj, _opts->dupes_min_size);
+        }
+        submitToDB(obj);
+      }
+      if (pool) {
+        pool->creditFiles(1);
+      }
+    }
+    _flush_batch(&batch);
+  }
+  else {
+    _examine_ordered(chunk);
+  }
+}
+
+
+/*
+* Examine a chunk in two passes. Everything is stat'd and tallied first, and the
+*   files that still need hashing are then sorted by device and physical
+*   position, and hashed in that order under their device's gate.
+*/
+void ScanScheduler::_examine_ordered(ScanChunk* chunk) {
+  struct OrderKey {
+    dev_t        dev;
+    uint8_t      key_class;   // 0 for a physical offset, 1 for an inode number.
+    uint64_t     key;
+    ORMFileData* obj;
+  };
+  std::vector<OrderKey> owed;
+  DevicePool* pool = DevicePool::current();
+  if (pool) {
+    pool->creditFiles(chunk->count);
+  }
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    ORMFileData* obj = chunk->items[i];
+    const size_t footprint = obj->footprint();
+    const int ret = obj->examineMetadata(_stats, _logs);
+    _stage_traverse.remove(1, footprint);
+    if ((1 == ret) && !_reuse_digests(obj)) {
+      OrderKey k = { obj->device(), 1, (uint64_t) obj->inode(), obj };
+      uint64_t offset = 0;
+      if ((HashOrder::EXTENT == _opts->hash_order) && (0 == obj->physicalOffset(&offset))) {
+        k.key_class = 0;
+        k.key       = offset;
+      }
+      owed.push_back(k);
+    }
+    else {
+      if (_opts->dupes) {
+        _sizes.add(obj, _opts->dupes_min_size);
+      }
+      submitToDB(obj);
+    }
+  }
+  if (owed.empty()) {
+    return;
+  }
+
+  if (HashOrder::READDIR != _opts->hash_order) {
+    std::sort(owed.begin(), owed.end(), [](const OrderKey& a, const OrderKey& b) {
+      if (a.dev != b.dev) {               return (a.dev < b.dev);              }
+      if (a.key_class != b.key_class) {   return (a.key_class < b.key_class);  }
+      return (a.key < b.key);
+    });
+  }
+  const unsigned int limit = _opts->spindle_threads;
+  HashBatch batch;
+  dev_t gated_dev = owed[0].dev;
+  DeviceGate::acquire(gated_dev, limit);
+  for (size_t i = 0; i < owed.size(); i++) {
+    OrderKey& k = owed[i];
+    if (k.dev != gated_dev) {
+      _flush_batch(&batch);
+      DeviceGate::release(gated_dev, limit);
+      gated_dev = k.dev;
+      DeviceGate::acquire(gated_dev, limit);
+    }
+    if ((i + 1) < owed.size()) {
+      _advise_next(k.obj, owed[i + 1].obj);
+    }
+    _finish_file(k.obj, &batch);
+  }
+  _flush_batch(&batch);
+  DeviceGate::release(gated_dev, limit);
+}
+
+
+/*
+* Hash a file that is owed one, and hand it to the DB writer. A file with other
+*   links is hashed only by the first of them to arrive. The rest take its
+*   digest, and may be handed to the DB writer later, by whoever publishes it.
+* If the engine hashes several files at once, or io_uring reads them, a small
+*   file with one link is set aside in the batch instead. The caller flushes the
+*   batch when it is done.
+*/
+void ScanScheduler::_finish_file(ORMFileData* obj, HashBatch* batch) {
+  const bool linked = _opts->hardlinks && (obj->linkCount() > 1);
+  if (!linked && (0 < _batch_max_size) && (obj->size() <= _batch_max_size)) {
+    batch->objs[batch->count++] = obj;
+    if (HASH_BATCH_FILES == batch->count) {
+      _flush_batch(batch);
+    }
+    return;
+  }
+  if (linked) {
+    switch (_inodes.claim(obj)) {
+      case InodeTable::Claim::OWNER:
+        {
+          if (!_from_hash_cache(obj)) {
+            _hash(obj);
+            _remember(obj);
+          }
+          std::vector<ORMFileData*> waiters;
+          _inodes.publish(obj, &waiters);
+          submitToDB(obj);
+          for (ORMFileData* w : waiters) {
+            submitToDB(w);
+          }
+        }
+        return;
+      case InodeTable::Claim::ADOPTED:
+        submitToDB(obj);
+        return;
+      case InodeTable::Claim::PARKED:
+        return;
+    }
+  }
+  _hash(obj);
+  _remember(obj);
+  submitToDB(obj);
+}
+
+
+/*
+* Read the small files set aside in a batch, and hash them all at once. BLAKE3,
+*   if it is wanted, takes each file in turn.
+*/
+void ScanScheduler::_flush_batch(HashBatch* batch) {
+  if (0 == batch->count) {
+    return;
+  }
+  const uint8_t* msgs[HASH_BATCH_FILES];
+  size_t  lens[HASH_BATCH_FILES];
+  bool    read_ok[HASH_BATCH_FILES];
+  uint8_t digests[HASH_BATCH_FILES][32];
+  uint8_t b3_digests[HASH_BATCH_FILES][32];
+  const bool want_sha = (0 != (_opts->digests & DIGEST_SHA256));
+  const bool want_b3  = (0 != (_opts->digests & DIGEST_BLAKE3));
+  const size_t buffers = HASH_BATCH_FILES * _batch_max_size;
+  _stage_hash.waitForRoom();
+  _stage_hash.add(batch->count, buffers);
+  _read_batch(batch, msgs, read_ok);
+  for (unsigned int i = 0; i < batch->count; i++) {
+    lens[i] = (read_ok[i]) ? (size_t) batch->objs[i]->size() : 0;
+  }
+  if (want_sha) {
+    Sha256::digestMany(msgs, lens, batch->count, digests);
+  }
+  for (unsigned int i = 0; i < batch->count; i++) {
+    ORMFileData* obj = batch->objs[i];
+    if (want_b3 && read_ok[i]) {
+      Blake3::digest(msgs[i], lens[i], b3_digests[i]);
+    }
+    obj->acceptContent((read_ok[i] && want_sha) ? digests[i] : nullptr, (read_ok[i] && want_b3) ? b3_digests[i] : nullptr);
+    _remember(obj);
+    _credit(obj);
+    submitToDB(obj);
+  }
+  _stage_hash.remove(batch->count, buffers);
+  batch->count = 0;
+}
+
+
+/*
+* Read every file in a batch whole. If io_uring can, it reads the whole batch
+*   at once, into its ring's buffers. Otherwise each thread reads into a buffer
+*   of its own, which it keeps.
+*/
+void ScanScheduler::_read_batch(HashBatch* batch, const uint8_t** msgs, bool* read_ok) {
+  if (_opts->use_uring) {
+    UringQueue* ring = UringQueue::forThisThread();
+    if (ring && (0 == ring->readFiles(batch->objs, batch->count, msgs, read_ok))) {
+      return;
+    }
+  }
+  static thread_local std::vector<uint8_t> space;
+  if (space.size() < (HASH_BATCH_FILES * _batch_max_size)) {
+    space.resize(HASH_BATCH_FILES * _batch_max_size);
+  }
+  for (unsigned int i = 0; i < batch->count; i++) {
+    uint8_t* buf = &space[i * _batch_max_size];
+    read_ok[i] = (0 == batch->objs[i]->readContent(buf, _batch_max_size));
+    msgs[i]    = buf;
+  }
+}
+
+
+/*
+* Give a file owed a hash its digests from the baseline, or from the host's hash
+*   cache, if it is unchanged since they were taken. This comes before ordering,
+*   so that no reused file costs a FIEMAP, or a place in line for its device. A
+*   file with other links only asks the cache once it owns its inode, so that
+*   the others still take their digest from it.
+* Returns true if the file is finished, and should go to the DB writer.
+*/
+bool ScanScheduler::_reuse_digests(ORMFileData* obj) {
+  uint8_t hash[32];
+  uint8_t b3[32];
+  if (!_baseline.empty() && _baseline.lookup(obj, hash, b3)) {
+    obj->reuseContent(hash, (_opts->digests & DIGEST_BLAKE3) ? b3 : nullptr);
+    _remember(obj);
+    return true;
+  }
+  if (_opts->hardlinks && (obj->linkCount() > 1)) {
+    return false;
+  }
+  return _from_hash_cache(obj);
+}
+
+
+/*
+* Give a file its digests from the host's hash cache. A file that would be cut
+*   into chunks is always read.
+* Returns true if the cache had them.
+*/
+bool ScanScheduler::_from_hash_cache(ORMFileData* obj) {
+  uint8_t hash[32];
+  uint8_t b3[32];
+  if (!_hash_cache || _opts->chunksFor(obj->size()) || !_hash_cache->lookup(obj, _opts->digests, hash, b3)) {
+    return false;
+  }
+  obj->reuseContent(hash, (_opts->digests & DIGEST_BLAKE3) ? b3 : nullptr);
+  return true;
+}
+
+
+/*
+* Keep the digests just taken of a file in the host's hash cache.
+*/
+void ScanScheduler::_remember(ORMFileData* obj) {
+  if (_hash_cache && (ScanDepth::FULL == obj->tier())) {
+    _hash_cache->store(obj, _opts->digests);
+  }
+}
+
+
+/*
+* While a large file streams, have the kernel fetch the head of the file next
+*   in line on the same device. A file that will be read with O_DIRECT would
+*   not find it in the cache, and is skipped.
+*/
+void ScanScheduler::_advise_next(ORMFileData* obj, ORMFileData* next) {
+  if ((obj->size() < STREAM_MIN_FILE_SIZE) || (obj->device() != next->device())) {
+    return;
+  }
+  if (_opts->direct_io && (next->size() >= STREAM_MIN_FILE_SIZE)) {
+    return;
+  }
+  next->adviseContent();
+}
+
+
+/*
+* Read and hash a file, once there is budget for its read buffers.
+*/
+void ScanScheduler::_hash(ORMFileData* obj) {
+  size_t buffers = (obj->size() >= STREAM_MIN_FILE_SIZE) ? (STREAM_BUFFERS * STREAM_BUFFER_SIZE) : HASH_BUFFER_SIZE;
+  if ((DIGEST_BLAKE3 == _opts->digests) && (obj->size() >= BLAKE3_PARALLEL_MIN_SIZE)) {
+    buffers = _opts->blake3Threads() * HASH_BUFFER_SIZE;   // One per thread sharing the file.
+  }
+  _stage_hash.waitForRoom();
+  _stage_hash.add(1, buffers);
+  obj->examineContent();
+  _stage_hash.remove(1, buffers);
+  _credit(obj);
+}
+
+
+/*
+* Count a file's bytes toward its device pool's throughput.
+*/
+void ScanScheduler::_credit(ORMFileData* obj) {
+  DevicePool* pool = DevicePool::current();
+  if (pool && (ScanDepth::FULL == obj->tier())) {
+    pool->creditBytes(obj->size());
+  }
+}
+
+
+/*
+* Reads the 10-second "some" average from /proc/pressure/io, as a whole
+*   percentage. Returns -1 if the kernel does not report pressure.
+*/
+static int _read_io_pressure() {
+  FILE* f = fopen("/proc/pressure/io", "r");
+  if (nullptr == f) {
+    return -1;
+  }
+  float avg10 = -1.0f;
+  if (1 != fscanf(f, "some avg10=%f", &avg10)) {
+    avg10 = -1.0f;
+  }
+  fclose(f);
+  return (avg10 < 0.0f) ? -1 : (int) avg10;
+}
+
+
+/*
+* The controller. While a scan is running, it samples every pool's throughput
+*   and the system's io pressure, and lets each pool take a step.
+*/
+void ScanScheduler::_tune_worker() {
+  auto last = std::chrono::steady_clock::now();
+  unsigned int interval = 2000;
+  std::unique_lock<std::mutex> lock(_tune_mutex);
+  while (_running) {
+    _tune_cv.wait_for(lock, std::chrono::milliseconds(interval), [this]{ return !_running; });
+    if (!_running) {
+      break;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const double secs = std::chrono::duration<double>(now - last).count();
+    last = now;
+    std::lock_guard<std::mutex> p_lock(_pools_mutex);   // Also keeps _opts steady.
+    if ((nullptr == _opts) || !_opts->tune || (0 == _outstanding.load())) {
+      continue;
+    }
+    interval = (_opts->tune_interval > 0) ? _opts->tune_interval : 2000;
+    _io_pressure = _read_io_pressure();
+    for (DevicePool* pool : _pools) {
+      pool->tune(_opts, _io_pressure, secs);
+    }
+  }
+}
+
+
+/*
+* Writes examined objects to the database in batched INSERTs. Only this thread
+*   frees objects that made it into the pipeline.
+*/
+void ScanScheduler::_db_worker() {
+  LibrarianDB* _db = LibrarianDB::getInstance();
+  std::vector<ORMFileData*> batch;
+  std::vector<ORMFileData*> objs_in_query;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_db_mutex);
+      _db_cv.wait(lock, [this]{ return (!_db_queue.empty() || !_db_running); });
+      if (_db_queue.empty()) {
+        break;   // Shutdown was requested, and we have drained the queue.
+      }
+      while (!_db_queue.empty() && (batch.size() < DB_BATCH_MAX_OBJECTS)) {
+        batch.push_back(_db_queue.front());
+        _db_queue.pop_front();
+      }
+    }
+
+    StringBuilder insert_query;
+    for (size_t i = 0; i < batch.size(); i++) {
+      ORMFileData* cur = batch[i];
+      if (cur->dirty()) {
+        if (objs_in_query.empty()) {
+          cur->generateInsertQuery(&insert_query, nullptr);
+        }
+        else {
+          insert_query.concat(",\n");
+        }
+        cur->generateInsertQuery(nullptr, &insert_query);
+        objs_in_query.push_back(cur);
+      }
+      else {
+        std::vector<ORMFileData*> clean(1, cur);
+        _retire(&clean, false);
+      }
+
+      if (!objs_in_query.empty() && ((insert_query.length() >= MAX_QUERY_LENGTH) || ((i + 1) == batch.size()))) {
+        insert_query.concat(";");
+        if (1 == _db->r_query(insert_query.string())) {
+          // A row whose chunks were not saved is incomplete, and counts as failed.
+          std::vector<ORMFileData*> chunks_failed;
+          for (size_t j = 0; j < objs_in_query.size(); ) {
+            if (0 != objs_in_query[j]->writeChunks(_db)) {
+              chunks_failed.push_back(objs_in_query[j]);
+              objs_in_query.erase(objs_in_query.begin() + j);
+            }
+            else {
+              j++;
+            }
+          }
+          _retire(&objs_in_query, true);
+          if (!chunks_failed.empty()) {
+            _retire(&chunks_failed, false);
+          }
+        }
+        else {
+          c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to save %u records to database.", (unsigned int) objs_in_query.size());
+          _retire(&objs_in_query, false);
+        }
+        insert_query.clear();
+      }
+    }
+    batch.clear();
+  }
+}
+
+
+/*
+* Free a set of objects that have left the pipeline, and signal the scan's
+*   completion if they were the last ones outstanding.
+*/
+void ScanScheduler::_retire(std::vector<ORMFileData*>* objs, bool written) {
+  const long count = objs->size();
+  unsigned long bytes = 0;
+  for (ORMFileData* cur : *objs) {
+    if (written) {
+      cur->markClean();
+    }
+    else if (cur->dirty()) {
+      _rows_failed++;
+    }
+    bytes += cur->footprint();
+    delete cur;
+  }
+  objs->clear();
+  _stage_db.remove(count, bytes);
+  if (written) {
+    _rows_written += count;
+  }
+  if (0 == (_outstanding -= count)) {
+    std::lock_guard<std::mutex> lock(_idle_mutex);
+    _idle_cv.notify_all();
+  }
+}
+
+
+/*
+* One line on how full each stage is, for printing while a scan runs.
+*/
+void ScanScheduler::printOccupancy(StringBuilder* output) {
+  output->concatf("  %lu rows written. ", _rows_written.load());
+  _stage_traverse.printBrief(output);
+  output->concat(", ");
+  _stage_hash.printBrief(output);
+  output->concat(", ");
+  _stage_db.printBrief(output);
+  output->concat("\n");
+}
+
+
+void ScanScheduler::printDebug(StringBuilder* output) {
+  output->concatf("Scan scheduler (%s)\n", _running ? "running" : "stopped");
+  output->concatf("  Outstanding:   %ld\n", _outstanding.load());
+  if (_io_pressure.load() >= 0) {
+    output->concatf("  io pressure:   %d%%\n", _io_pressure.load());
+  }
+  {
+    std::lock_guard<std::mutex> lock(_db_mutex);
+    output->concatf("  Queued (DB):   %u\n", (unsigned int) _db_queue.size());
+  }
+  output->concatf("  Rows written:  %lu\n", _rows_written.load());
+  output->concatf("  Rows failed:   %lu\n", _rows_failed.load());
+  output->concatf("  Steals:        %lu\n", _steals.load());
+  output->concatf("  Links reused:  %lu\n", _inodes.linksReused());
+  if (!_baseline.empty()) {
+    _baseline.printDebug(output);
+  }
+  if (HashCache::getInstance()->isOpen()) {
+    HashCache::getInstance()->printDebug(output);
+  }
+  output->concatf("  Dir fds held:  %u of %u\n", ScanDirHandle::openCount(), ScanDirHandle::budget());
+  output->concatf("  Name arena:    %u KiB\n", (unsigned int) (PathArena::bytesHeld() >> 10));
+  output->concatf("  Entry slabs:   %u KiB\n", (unsigned int) (ORMFileData::slabBytesHeld() >> 10));
+  output->concatf("  io_uring ops:  %lu (%lu files read)\n", UringQueue::opsCompleted(), UringQueue::filesRead());
+  output->concatf("  Streamed:      %lu files (%lu with O_DIRECT)\n", StreamReader::filesStreamed(), StreamReader::filesDirect());
+  output->concatf("  BLAKE3 split:  %lu files\n", Blake3::filesSplit());
+  output->concatf("  Chunked:       %lu files, %lu chunks\n", Chunker::filesChunked(), Chunker::chunksCut());
+  output->concat("  Stage occupancy:\n");
+  _stage_traverse.printDebug(output);
+  _stage_hash.printDebug(output);
+  _stage_db.printDebug(output);
+  std::lock_guard<std::mutex> lock(_pools_mutex);
+  for (DevicePool* pool : _pools) {
+    pool->printDebug(output);
+  }
+}
@@ -0,0 +1,732 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <openssl/evp.h>
+#if defined(__x86_64__)
+  #include <cpuid.h>
+  #include <immintrin.h>
+#endif
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+
+typedef void (*CompressOne)(uint32_t* state, const uint8_t* blocks, size_t count);
+typedef void (*CompressLanes)(uint32_t (*state)[SHA256_MAX_LANES], const uint8_t* const* blocks);
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+
+static inline uint32_t _rot_right(uint32_t x, unsigned int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t _load_be32(const uint8_t* p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline void _store_be32(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t) (v >> 24);
+  p[1] = (uint8_t) (v >> 16);
+  p[2] = (uint8_t) (v >> 8);
+  p[3] = (uint8_t) v;
+}
+
+
+/*
+* Write the padded end of a message into tail, given the bytes that did not
+*   fill a block, and the length of the whole message.
+* Returns the number of blocks written to tail, which is 1 or 2.
+*/
+static unsigned int _pad(const uint8_t* rest, size_t rest_len, uint64_t total_len, uint8_t* tail) {
+  const unsigned int blocks = (rest_len < 56) ? 1 : 2;
+  memset(tail, 0, blocks * 64);
+  memcpy(tail, rest, rest_len);
+  tail[rest_len] = 0x80;
+  const uint64_t bits = total_len << 3;
+  _store_be32(tail + (blocks * 64) - 8, (uint32_t) (bits >> 32));
+  _store_be32(tail + (blocks * 64) - 4, (uint32_t) bits);
+  return blocks;
+}
+
+
+/*******************************************************************************
+* Compression functions
+*******************************************************************************/
+
+static void _compress_scalar(uint32_t* state, const uint8_t* blocks, size_t count) {
+  uint32_t w[64];
+  while (count--) {
+    for (int t = 0; t < 16; t++) {
+      w[t] = _load_be32(blocks + (t * 4));
+    }
+    for (int t = 16; t < 64; t++) {
+      const uint32_t s0 = _rot_right(w[t - 15], 7) ^ _rot_right(w[t - 15], 18) ^ (w[t - 15] >> 3);
+      const uint32_t s1 = _rot_right(w[t - 2], 17) ^ _rot_right(w[t - 2], 19) ^ (w[t - 2] >> 10);
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; t++) {
+      const uint32_t t1 = h + (_rot_right(e, 6) ^ _rot_right(e, 11) ^ _rot_right(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+      const uint32_t t2 = (_rot_right(a, 2) ^ _rot_right(a, 13) ^ _rot_right(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;  state[1] += b;  state[2] += c;  state[3] += d;
+    state[4] += e;  state[5] += f;  state[6] += g;  state[7] += h;
+    blocks += 64;
+  }
+}
+
+
+#if defined(__x86_64__)
+/*
+* The SHA extensions keep the state as two vectors, ABEF and CDGH, and run two
+*   rounds per instruction.
+*/
+__attribute__((target("sha,sse4.1")))
+static void _compress_sha_ni(uint32_t* state, const uint8_t* blocks, size_t count) {
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp    = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xB1);  // CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1B);  // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);      // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);            // CDGH
+
+  while (count--) {
+    const __m128i abef_save = state0;
+    const __m128i cdgh_save = state1;
+    __m128i w[4];
+    #pragma GCC unroll 16
+    for (int g = 0; g < 16; g++) {
+      if (g < 4) {
+        w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (blocks + (g * 16))), bswap);
+      }
+      else {
+        // Words 4g to 4g+3, from the four groups before them.
+        __m128i m = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+        m = _mm_add_epi32(m, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+        w[g & 3] = _mm_sha256msg2_epu32(m, w[(g + 3) & 3]);
+      }
+      __m128i msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i*) &K[g * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg    = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+    blocks += 64;
+  }
+
+  tmp    = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+  _mm_storeu_si128((__m128i*) &state[0], state0);
+  _mm_storeu_si128((__m128i*) &state[4], state1);
+}
+
+
+#define ROTR256(x, n)  _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define XOR3_256(x, y, z)  _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+
+/*
+* One block from each of 8 messages. Lane l of state[i] is word i of message
+*   l's state.
+*/
+__attribute__((target("avx2")))
+static void _compress_avx2(uint32_t (*state)[SHA256_MAX_LANES], const uint8_t* const* blocks) {
+  const __m256i bswap = _mm256_set_epi8(
+    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3
+  );
+  __m256i w[16];
+  for (int half = 0; half < 2; half++) {
+    // Eight words from each lane, transposed into one word from every lane.
+    __m256i r[8];
+    for (int l = 0; l < 8; l++) {
+      r[l] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (blocks[l] + (half * 32))), bswap);
+    }
+    const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    w[(half * 8) + 0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    w[(half * 8) + 1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    w[(half * 8) + 2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    w[(half * 8) + 3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    w[(half * 8) + 4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    w[(half * 8) + 5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    w[(half * 8) + 6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    w[(half * 8) + 7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+  }
+
+  __m256i a = _mm256_loadu_si256((const __m256i*) state[0]);
+  __m256i b = _mm256_loadu_si256((const __m256i*) state[1]);
+  __m256i c = _mm256_loadu_si256((const __m256i*) state[2]);
+  __m256i d = _mm256_loadu_si256((const __m256i*) state[3]);
+  __m256i e = _mm256_loadu_si256((const __m256i*) state[4]);
+  __m256i f = _mm256_loadu_si256((const __m256i*) state[5]);
+  __m256i g = _mm256_loadu_si256((const __m256i*) state[6]);
+  __m256i h = _mm256_loadu_si256((const __m256i*) state[7]);
+  #pragma GCC unroll 64
+  for (int t = 0; t < 64; t++) {
+    if (t >= 16) {
+      const __m256i w15 = w[(t - 15) & 15];
+      const __m256i w2  = w[(t - 2) & 15];
+      const __m256i s0  = XOR3_256(ROTR256(w15, 7), ROTR256(w15, 18), _mm256_srli_epi32(w15, 3));
+      const __m256i s1  = XOR3_256(ROTR256(w2, 17), ROTR256(w2, 19), _mm256_srli_epi32(w2, 10));
+      w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+    }
+    const __m256i ch  = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+    const __m256i maj = _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+    const __m256i t1  = _mm256_add_epi32(
+      _mm256_add_epi32(h, XOR3_256(ROTR256(e, 6), ROTR256(e, 11), ROTR256(e, 25))),
+      _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32((int) K[t]), w[t & 15]))
+    );
+    const __m256i t2  = _mm256_add_epi32(XOR3_256(ROTR256(a, 2), ROTR256(a, 13), ROTR256(a, 22)), maj);
+    h = g;
+    g = f;
+    f = e;
+    e = _mm256_add_epi32(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm256_add_epi32(t1, t2);
+  }
+  const __m256i out[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; i++) {
+    _mm256_storeu_si256((__m256i*) state[i], _mm256_add_epi32(_mm256_loadu_si256((const __m256i*) state[i]), out[i]));
+  }
+}
+
+
+/*
+* One block from each of 16 messages, as _compress_avx2(). The words are
+*   gathered straight from the blocks, and AVX-512 has rotates and three-input
+*   logic of its own.
+*/
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"   // GCC 12's own AVX-512 headers trip this (PR 105593).
+__attribute__((target("avx512f,avx512bw")))
+static void _compress_avx512(uint32_t (*state)[SHA256_MAX_LANES], const uint8_t* const* blocks) {
+  const __m512i bswap  = _mm512_broadcast_i32x4(_mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+  const __m512i ptr_lo = _mm512_loadu_si512((const void*) &blocks[0]);
+  const __m512i ptr_hi = _mm512_loadu_si512((const void*) &blocks[8]);
+  __m512i w[16];
+  for (int t = 0; t < 16; t++) {
+    const __m512i off = _mm512_set1_epi64(t * 4);
+    const __m256i lo  = _mm512_i64gather_epi32(_mm512_add_epi64(ptr_lo, off), nullptr, 1);
+    const __m256i hi  = _mm512_i64gather_epi32(_mm512_add_epi64(ptr_hi, off), nullptr, 1);
+    w[t] = _mm512_shuffle_epi8(_mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1), bswap);
+  }
+
+  __m512i a = _mm512_loadu_si512((const void*) state[0]);
+  __m512i b = _mm512_loadu_si512((const void*) state[1]);
+  __m512i c = _mm512_loadu_si512((const void*) state[2]);
+  __m512i d = _mm512_loadu_si512((const void*) state[3]);
+  __m512i e = _mm512_loadu_si512((const void*) state[4]);
+  __m512i f = _mm512_loadu_si512((const void*) state[5]);
+  __m512i g = _mm512_loadu_si512((const void*) state[6]);
+  __m512i h = _mm512_loadu_si512((const void*) state[7]);
+  #pragma GCC unroll 64
+  for (int t = 0; t < 64; t++) {
+    if (t >= 16) {
+      const __m512i w15 = w[(t - 15) & 15];
+      const __m512i w2  = w[(t - 2) & 15];
+      const __m512i s0  = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18), _mm512_srli_epi32(w15, 3), 0x96);
+      const __m512i s1  = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19), _mm512_srli_epi32(w2, 10), 0x96);
+      w[t & 15] = _mm512_add_epi32(_mm512_add_epi32(w[t & 15], s0), _mm512_add_epi32(w[(t - 7) & 15], s1));
+    }
+    const __m512i ch  = _mm512_ternarylogic_epi32(e, f, g, 0xCA);   // e ? f : g
+    const __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);   // Majority.
+    const __m512i t1  = _mm512_add_epi32(
+      _mm512_add_epi32(h, _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25), 0x96)),
+      _mm512_add_epi32(ch, _mm512_add_epi32(_mm512_set1_epi32((int) K[t]), w[t & 15]))
+    );
+    const __m512i t2  = _mm512_add_epi32(_mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22), 0x96), maj);
+    h = g;
+    g = f;
+    f = e;
+    e = _mm512_add_epi32(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm512_add_epi32(t1, t2);
+  }
+  const __m512i out[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; i++) {
+    _mm512_storeu_si512((void*) state[i], _mm512_add_epi32(_mm512_loadu_si512((const void*) state[i]), out[i]));
+  }
+}
+#pragma GCC diagnostic pop
+#endif  // __x86_64__
+
+
+/*******************************************************************************
+* Engine selection
+*******************************************************************************/
+
+HashEngine   Sha256::_engine = HashEngine::SCALAR;
+unsigned int Sha256::_lanes  = 1;
+static CompressOne   _compress_one   = _compress_scalar;
+static CompressLanes _compress_lanes = nullptr;
+static bool          _single_evp     = false;   // Single messages go to OpenSSL.
+
+
+/*
+* Ask the CPU (and the OS, for the wider registers) what it can run.
+*/
+bool Sha256::supported(HashEngine e) {
+  switch (e) {
+    case HashEngine::AUTO:
+    case HashEngine::OPENSSL:
+    case HashEngine::SCALAR:
+      return true;
+    default:
+      break;
+  }
+#if defined(__x86_64__)
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  const bool sse41   = (0 != (ecx & bit_SSE4_1)) && (0 != (ecx & bit_SSSE3));
+  uint64_t   xcr0    = 0;
+  if (0 != (ecx & bit_OSXSAVE)) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    xcr0 = ((uint64_t) hi << 32) | lo;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  switch (e) {
+    case HashEngine::SHA_NI:  return sse41 && (0 != (ebx & bit_SHA));
+    case HashEngine::AVX2:    return (0 != (ebx & bit_AVX2)) && (0x06 == (xcr0 & 0x06));
+    case HashEngine::AVX512:  return (0 != (ebx & bit_AVX512F)) && (0 != (ebx & bit_AVX512BW)) && (0xE6 == (xcr0 & 0xE6));
+    default:                  break;
+  }
+#endif
+  return false;
+}
+
+
+/*
+* The widest lanes the CPU has, unless the SHA extensions hash faster one block
+*   at a time. Which of those wins depends on the microarchitecture, so when
+*   there is a choice, a few hundred blocks are timed each way, once.
+*/
+HashEngine Sha256::_pick(HashEngine want) {
+  static HashEngine chosen = HashEngine::AUTO;
+  if (HashEngine::AUTO != want) {
+    return want;
+  }
+  if (HashEngine::AUTO != chosen) {
+    return chosen;
+  }
+  const HashEngine lanes = supported(HashEngine::AVX512) ? HashEngine::AVX512 : (supported(HashEngine::AVX2) ? HashEngine::AVX2 : HashEngine::AUTO);
+  const bool sha_ni = supported(HashEngine::SHA_NI);
+  if (HashEngine::AUTO == lanes) {
+    chosen = (sha_ni) ? HashEngine::SHA_NI : HashEngine::OPENSSL;
+  }
+  else if (!sha_ni) {
+    chosen = lanes;
+  }
+#if defined(__x86_64__)
+  else {
+    const unsigned int width = (HashEngine::AVX512 == lanes) ? 16 : 8;
+    const CompressLanes wide = (HashEngine::AVX512 == lanes) ? _compress_avx512 : _compress_avx2;
+    const unsigned int rounds = 64;
+    static const uint8_t data[64 * 16] = {0};
+    const uint8_t* blocks[SHA256_MAX_LANES];
+    for (unsigned int l = 0; l < SHA256_MAX_LANES; l++) {
+      blocks[l] = &data[(l & 15) * 64];
+    }
+    uint32_t one[8];
+    uint32_t many[8][SHA256_MAX_LANES];
+    memcpy(one, IV, sizeof(one));
+    memset(many, 0, sizeof(many));
+    struct timespec a, b, c;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (unsigned int r = 0; r < rounds; r++) {
+      _compress_sha_ni(one, data, 16);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    for (unsigned int r = 0; r < ((rounds * 16) / width); r++) {
+      wide(many, blocks);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &c);
+    const long single_ns = ((b.tv_sec - a.tv_sec) * 1000000000L) + (b.tv_nsec - a.tv_nsec);
+    const long lanes_ns  = ((c.tv_sec - b.tv_sec) * 1000000000L) + (c.tv_nsec - b.tv_nsec);
+    chosen = (lanes_ns < single_ns) ? lanes : HashEngine::SHA_NI;
+  }
+#endif
+  return chosen;
+}
+
+
+/*
+* Set the engine for every hash that follows. Only call this while nothing is
+*   being hashed. An engine the CPU cannot run is passed over for the best one
+*   that it can. An engine that fails its self-test is passed over for OpenSSL.
+* A multi-buffer engine hashes single messages with the SHA extensions if it
+*   can, and with OpenSSL if not.
+* Returns 0 if the engine asked for is in use, or -1 if another one had to be.
+*/
+int Sha256::select(HashEngine want) {
+  int ret = 0;
+  if (!supported(want)) {
+    c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "This CPU cannot run the %s SHA-256 engine.", ScanOptions::hashEngineString(want));
+    want = HashEngine::AUTO;
+    ret  = -1;
+  }
+  const HashEngine pick = _pick(want);
+  _engine         = pick;
+  _lanes          = 1;
+  _compress_one   = _compress_scalar;
+  _compress_lanes = nullptr;
+  _single_evp     = (HashEngine::OPENSSL == pick);
+#if defined(__x86_64__)
+  const bool sha_ni = supported(HashEngine::SHA_NI);
+  switch (pick) {
+    case HashEngine::SHA_NI:
+      _compress_one = _compress_sha_ni;
+      break;
+    case HashEngine::AVX2:
+    case HashEngine::AVX512:
+      _compress_lanes = (HashEngine::AVX512 == pick) ? _compress_avx512 : _compress_avx2;
+      _lanes          = (HashEngine::AVX512 == pick) ? 16 : 8;
+      _compress_one   = (sha_ni) ? _compress_sha_ni : _compress_scalar;
+      _single_evp     = !sha_ni;
+      break;
+    default:
+      break;
+  }
+#endif
+  if ((HashEngine::OPENSSL != pick) && !_self_test(pick)) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "The %s SHA-256 engine gave a wrong digest. Using OpenSSL instead.", ScanOptions::hashEngineString(pick));
+    _engine         = HashEngine::OPENSSL;
+    _lanes          = 1;
+    _compress_one   = _compress_scalar;
+    _compress_lanes = nullptr;
+    _single_evp     = true;
+    ret = -1;
+  }
+  return ret;
+}
+
+
+/*
+* Compare the engine in use against OpenSSL, over lengths that land on either
+*   side of each padding boundary, one message at a time and all at once.
+*/
+bool Sha256::_self_test(HashEngine e) {
+  const size_t lens[] = {0, 1, 3, 55, 56, 63, 64, 65, 111, 119, 120, 127, 128, 129, 200, 1000, 4103, 3, 64, 56};
+  const unsigned int count = sizeof(lens) / sizeof(lens[0]);
+  uint8_t msg[4103];
+  for (size_t i = 0; i < sizeof(msg); i++) {
+    msg[i] = (uint8_t) ((i * 131) ^ (i >> 3));
+  }
+  const uint8_t* msgs[count];
+  uint8_t ref[count][32];
+  uint8_t one[32];
+  uint8_t many[count][32];
+  bool ok = true;
+  for (unsigned int i = 0; i < count; i++) {
+    msgs[i] = msg + (i & 7);
+    unsigned int md_len = 32;
+    EVP_Digest(msgs[i], lens[i], ref[i], &md_len, EVP_sha256(), nullptr);
+    digest(msgs[i], lens[i], one);
+    ok = ok && (0 == memcmp(one, ref[i], 32));
+  }
+  digestMany(msgs, lens, count, many);
+  for (unsigned int i = 0; i < count; i++) {
+    ok = ok && (0 == memcmp(many[i], ref[i], 32));
+  }
+  return ok;
+}
+
+
+/*******************************************************************************
+* Hashing
+*******************************************************************************/
+
+Sha256::Sha256() {
+  memcpy(_state, IV, sizeof(_state));
+}
+
+
+Sha256::~Sha256() {
+  if (_evp) {
+    EVP_MD_CTX_destroy((EVP_MD_CTX*) _evp);
+    _evp = nullptr;
+  }
+}
+
+
+void Sha256::init() {
+  _block_len = 0;
+  _total     = 0;
+  _use_evp   = _single_evp;
+  if (_use_evp) {
+    if (nullptr == _evp) {
+      _evp = EVP_MD_CTX_create();
+    }
+    _use_evp = (nullptr != _evp) && (1 == EVP_DigestInit_ex((EVP_MD_CTX*) _evp, EVP_sha256(), nullptr));
+  }
+  memcpy(_state, IV, sizeof(_state));
+}
+
+
+void Sha256::update(const uint8_t* data, size_t len) {
+  if (_use_evp) {
+    EVP_DigestUpdate((EVP_MD_CTX*) _evp, data, len);
+    return;
+  }
+  _total += len;
+  if (0 < _block_len) {
+    const size_t take = ((64 - _block_len) < len) ? (64 - _block_len) : len;
+    memcpy(_block + _block_len, data, take);
+    _block_len += take;
+    data       += take;
+    len        -= take;
+    if (64 > _block_len) {
+      return;
+    }
+    _compress_one(_state, _block, 1);
+    _block_len = 0;
+  }
+  const size_t whole = len >> 6;
+  if (0 < whole) {
+    _compress_one(_state, data, whole);
+    data += (whole << 6);
+    len  -= (whole << 6);
+  }
+  memcpy(_block, data, len);
+  _block_len = len;
+}
+
+
+void Sha256::final(uint8_t* digest) {
+  if (_use_evp) {
+    unsigned int md_len = 32;
+    EVP_DigestFinal_ex((EVP_MD_CTX*) _evp, digest, &md_len);
+    return;
+  }
+  uint8_t tail[128];
+  _compress_one(_state, tail, _pad(_block, _block_len, _total, tail));
+  for (int i = 0; i < 8; i++) {
+    _store_be32(digest + (i * 4), _state[i]);
+  }
+}
+
+
+/*
+* Hash one whole message.
+*/
+void Sha256::digest(const uint8_t* msg, size_t len, uint8_t* digest) {
+  if (_single_evp) {
+    unsigned int md_len = 32;
+    EVP_Digest(msg, len, digest, &md_len, EVP_sha256(), nullptr);
+    return;
+  }
+  uint32_t state[8];
+  uint8_t  tail[128];
+  memcpy(state, IV, sizeof(state));
+  const size_t whole = len >> 6;
+  _compress_one(state, msg, whole);
+  _compress_one(state, tail, _pad(msg + (whole << 6), len & 63, len, tail));
+  for (int i = 0; i < 8; i++) {
+    _store_be32(digest + (i * 4), state[i]);
+  }
+}
+
+
+/*
+* Hash a set of whole messages. With a multi-buffer engine, each lane takes the
+*   next message as soon as it finishes one, so messages of mixed lengths keep
+*   the lanes full until the last few.
+*/
+void Sha256::digestMany(const uint8_t* const* msgs, const size_t* lens, unsigned int count, uint8_t (*digests)[32]) {
+  if ((nullptr == _compress_lanes) || (2 > count)) {
+    for (unsigned int i = 0; i < count; i++) {
+      digest(msgs[i], lens[i], digests[i]);
+    }
+    return;
+  }
+  struct Lane {
+    const uint8_t* msg;
+    size_t  whole;       // Blocks taken straight from the message.
+    size_t  blocks;      // Those, and the padded tail.
+    size_t  next;        // The next block to compress.
+    int     job;         // Index of the message, or -1 if the lane is idle.
+    uint8_t tail[128];
+  };
+  static const uint8_t idle_block[64] = {0};
+  Lane lane[SHA256_MAX_LANES];
+  uint32_t state[8][SHA256_MAX_LANES];
+  const uint8_t* blocks[SHA256_MAX_LANES];
+  unsigned int next_job = 0;
+  for (unsigned int l = 0; l < SHA256_MAX_LANES; l++) {
+    lane[l].job = -1;
+    blocks[l]   = idle_block;
+  }
+  while (true) {
+    unsigned int busy = 0;
+    for (unsigned int l = 0; l < _lanes; l++) {
+      Lane* ln = &lane[l];
+      if ((0 > ln->job) && (next_job < count)) {
+        ln->job    = (int) next_job;
+        ln->msg    = msgs[next_job];
+        ln->whole  = lens[next_job] >> 6;
+        ln->blocks = ln->whole + _pad(ln->msg + (ln->whole << 6), lens[next_job] & 63, lens[next_job], ln->tail);
+        ln->next   = 0;
+        for (int i = 0; i < 8; i++) {
+          state[i][l] = IV[i];
+        }
+        next_job++;
+      }
+      if (0 <= ln->job) {
+        blocks[l] = (ln->next < ln->whole) ? (ln->msg + (ln->next << 6)) : (ln->tail + ((ln->next - ln->whole) << 6));
+        busy++;
+      }
+      else {
+        blocks[l] = idle_block;
+      }
+    }
+    if (0 == busy) {
+      break;
+    }
+    _compress_lanes(state, blocks);
+    for (unsigned int l = 0; l < _lanes; l++) {
+      Lane* ln = &lane[l];
+      if ((0 <= ln->job) && (++ln->next == ln->blocks)) {
+        for (int i = 0; i < 8; i++) {
+          _store_be32(digests[ln->job] + (i * 4), state[i][l]);
+        }
+        ln->job = -1;
+      }
+    }
+  }
+}
+
+
+/*******************************************************************************
+* Benchmark
+*******************************************************************************/
+
+static double _seconds_since(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start->tv_sec) + ((double) (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+
+/*
+* Hash the same messages with EVP, as files were hashed before there was an
+*   engine (a fresh context for each), and then with each engine that this CPU
+*   can run. Every digest is checked against EVP's. The engine in use before is
+*   restored afterward.
+*/
+void Sha256::benchmark(StringBuilder* output, size_t msg_len, size_t total_len) {
+  const size_t count = (total_len > msg_len) ? (total_len / msg_len) : 1;
+  std::vector<uint8_t>        data(count * msg_len);
+  std::vector<const uint8_t*> msgs(count);
+  std::vector<size_t>         lens(count, msg_len);
+  std::vector<uint8_t>        ref(count * 32);
+  std::vector<uint8_t>        got(count * 32);
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < data.size(); i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    data[i] = (uint8_t) x;
+  }
+  for (size_t i = 0; i < count; i++) {
+    msgs[i] = &data[i * msg_len];
+  }
+  const double mib = (double) (count * msg_len) / (1024.0 * 1024.0);
+  output->concatf("SHA-256 throughput, %lu messages of %lu bytes (%.1f MiB):\n", (unsigned long) count, (unsigned long) msg_len, mib);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < count; i++) {
+    EVP_MD_CTX* cntxt = EVP_MD_CTX_create();
+    unsigned int md_len = 32;
+    EVP_DigestInit(cntxt, EVP_sha256());
+    EVP_DigestUpdate(cntxt, msgs[i], msg_len);
+    EVP_DigestFinal_ex(cntxt, &ref[i * 32], &md_len);
+    EVP_MD_CTX_destroy(cntxt);
+  }
+  double secs = _seconds_since(&start);
+  output->concatf("  %-26s %9.1f MiB/s %11.0f msgs/s\n", "evp (context per message)", mib / secs, count / secs);
+
+  const HashEngine prior = _engine;
+  const HashEngine engines[] = {HashEngine::OPENSSL, HashEngine::SCALAR, HashEngine::SHA_NI, HashEngine::AVX2, HashEngine::AVX512};
+  for (HashEngine e : engines) {
+    if (!supported(e) || (0 != select(e))) {
+      output->concatf("  %-26s unsupported\n", ScanOptions::hashEngineString(e));
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (1 < _lanes) {
+      for (size_t i = 0; i < count; i += HASH_BATCH_FILES) {
+        const unsigned int n = ((count - i) < HASH_BATCH_FILES) ? (unsigned int) (count - i) : HASH_BATCH_FILES;
+        digestMany(&msgs[i], &lens[i], n, (uint8_t (*)[32]) &got[i * 32]);
+      }
+    }
+    else {
+      Sha256 hasher;
+      for (size_t i = 0; i < count; i++) {
+        hasher.init();
+        hasher.update(msgs[i], msg_len);
+        hasher.final(&got[i * 32]);
+      }
+    }
+    secs = _seconds_since(&start);
+    size_t wrong = 0;
+    for (size_t i = 0; i < count; i++) {
+      wrong += (0 != memcmp(&got[i * 32], &ref[i * 32], 32)) ? 1 : 0;
+    }
+    output->concatf("  %-26s %9.1f MiB/s %11.0f msgs/s", ScanOptions::hashEngineString(e), mib / secs, count / secs);
+    if (0 < wrong) {
+      output->concatf("   %lu WRONG DIGESTS", (unsigned long) wrong);
+    }
+    output->concat("\n");
+  }
+  select(prior);
+  output->concatf("  In use: %s\n", ScanOptions::hashEngineString(_engine));
+}
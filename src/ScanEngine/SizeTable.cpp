@@ -0,0 +1,81 @@
+#include <string.h>
+#include <algorithm>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+
+
+SizeTable::~SizeTable() {
+  reset();
+}
+
+
+/*
+* Note a regular file that was stat'd, and will get a row. Empty files, and
+*   those below the minimum size, are left out.
+*/
+void SizeTable::add(ORMFileData* obj, uint64_t min_size) {
+  if (!obj->isFile() || !obj->dirty() || (ScanDepth::METADATA != obj->tier())) {
+    return;
+  }
+  const uint64_t size = obj->size();
+  _files++;
+  _bytes += size;
+  if ((0 == size) || (size < min_size)) {
+    return;
+  }
+  PathNode* node = obj->pathNode();
+  node->refs++;
+  const Entry e = { node, obj->device(), obj->inode() };
+  Shard* s = &_shards[((size * 0x9E3779B97F4A7C15ULL) >> 32) % INODE_TABLE_SHARDS];
+  std::lock_guard<std::mutex> lock(s->mutex);
+  s->map[size].push_back(e);
+}
+
+
+/*
+* Move out every size held by more than one inode, and forget the rest. The
+*   caller takes the references of the entries it is given.
+*/
+void SizeTable::take(std::vector<Group>* groups) {
+  for (unsigned int i = 0; i < INODE_TABLE_SHARDS; i++) {
+    Shard* s = &_shards[i];
+    std::lock_guard<std::mutex> lock(s->mutex);
+    for (auto& kv : s->map) {
+      std::vector<Entry>* members = &kv.second;
+      std::sort(members->begin(), members->end(), [](const Entry& a, const Entry& b) {
+        return (a.dev != b.dev) ? (a.dev < b.dev) : (a.ino < b.ino);
+      });
+      const Entry& first = members->front();
+      const Entry& last  = members->back();
+      if ((first.dev != last.dev) || (first.ino != last.ino)) {
+        Group g;
+        g.size = kv.first;
+        g.members.swap(*members);
+        groups->push_back(std::move(g));
+      }
+      else {
+        for (Entry& e : *members) {
+          PathArena::release(e.node);
+        }
+      }
+    }
+    s->map.clear();
+  }
+}
+
+
+void SizeTable::reset() {
+  for (unsigned int i = 0; i < INODE_TABLE_SHARDS; i++) {
+    Shard* s = &_shards[i];
+    std::lock_guard<std::mutex> lock(s->mutex);
+    for (auto& kv : s->map) {
+      for (Entry& e : kv.second) {
+        PathArena::release(e.node);
+      }
+    }
+    s->map.clear();
+  }
+  _files = 0;
+  _bytes = 0;
+}
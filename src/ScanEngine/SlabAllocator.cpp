@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <time.h>
+#include <new>
+
+#include "ScanEngine.h"
+
+
+/* The header at the start of every block. Allocations follow it. */
+class SlabBlock {
+  public:
+    std::atomic<uint32_t> live{1};   // Allocations not yet released, plus one while a thread allocates from us.
+    uint32_t used = 0;
+};
+
+#define SLAB_HEADER_SIZE  ((sizeof(SlabBlock) + 15) & ~((size_t) 15))
+
+// Each thread's current block, for each allocator.
+static thread_local SlabBlock* _tl_blocks[SLAB_ALLOCATORS_MAX];
+static std::atomic<unsigned int> _next_id{0};
+
+
+SlabAllocator::SlabAllocator(size_t block_size) : _block_size(block_size), _id(_next_id++) {}
+
+
+void SlabAllocator::_put(SlabBlock* b) {
+  if (0 == --b->live) {
+    b->~SlabBlock();
+    free(b);
+    _blocks_held--;
+  }
+}
+
+
+/*
+* Carve len bytes out of the calling thread's block, starting a new block if
+*   it is full. The result is 16-byte aligned.
+* Returns nullptr if len cannot fit in a block, or on allocation failure.
+*/
+void* SlabAllocator::alloc(size_t len) {
+  const size_t need = (len + 15) & ~((size_t) 15);
+  if ((need + SLAB_HEADER_SIZE) > _block_size) {
+    return nullptr;
+  }
+  SlabBlock* cur = _tl_blocks[_id];
+  if ((nullptr == cur) || ((cur->used + need) > _block_size)) {
+    void* mem = aligned_alloc(_block_size, _block_size);
+    if (nullptr == mem) {
+      return nullptr;
+    }
+    _blocks_held++;
+    if (cur) {
+      _put(cur);   // Full. It now lives only as long as its allocations.
+    }
+    cur = new (mem) SlabBlock();
+    cur->used = SLAB_HEADER_SIZE;
+    _tl_blocks[_id] = cur;
+  }
+  void* ret = ((uint8_t*) cur) + cur->used;
+  cur->used += need;
+  cur->live++;
+  return ret;
+}
+
+
+/*
+* Release one allocation. Any thread may do this.
+*/
+void SlabAllocator::release(void* ptr) {
+  if (ptr) {
+    _put((SlabBlock*) (((uintptr_t) ptr) & ~((uintptr_t) _block_size - 1)));
+  }
+}
+
+
+/*
+* Give up the calling thread's block, for a thread that is about to exit. The
+*   block is freed once its allocations are.
+*/
+void SlabAllocator::finishThread() {
+  SlabBlock* cur = _tl_blocks[_id];
+  if (cur) {
+    _tl_blocks[_id] = nullptr;
+    _put(cur);
+  }
+}
+
+
+/*******************************************************************************
+* Benchmark
+*******************************************************************************/
+
+#define SLAB_BENCH_QUEUE_MAX  64   // Batches a benchmark lets wait for the freeing thread.
+
+/* Batches of allocations on their way from the producers to the freeing thread. */
+struct SlabBenchQueue {
+  std::mutex              mutex;
+  std::condition_variable cv;
+  std::deque<std::vector<void*>*> batches;
+  unsigned int producing = 0;
+};
+
+
+/*
+* One timed pass. Each producer makes its share of the entries, and hands them
+*   off SCAN_CHUNK_SIZE at a time. The calling thread frees them. With no slab,
+*   the heap is used.
+* Returns the seconds taken.
+*/
+static double _bench_pass(SlabAllocator* slab, size_t entry_len, unsigned int threads, size_t count) {
+  SlabBenchQueue sbq;
+  sbq.producing = threads;
+  struct timespec start;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::vector<std::thread*> producers;
+  for (unsigned int t = 0; t < threads; t++) {
+    const size_t share = (count / threads) + ((t < (count % threads)) ? 1 : 0);
+    producers.push_back(new std::thread([&sbq, slab, entry_len, share]() {
+      std::vector<void*>* batch = new std::vector<void*>();
+      for (size_t i = 0; i < share; i++) {
+        void* mem = (slab) ? slab->alloc(entry_len) : ::operator new(entry_len);
+        if (mem) {
+          *((size_t*) mem) = i;   // Touch it, as a constructor would.
+          batch->push_back(mem);
+        }
+        if ((SCAN_CHUNK_SIZE <= batch->size()) || ((i + 1) == share)) {
+          std::unique_lock<std::mutex> lock(sbq.mutex);
+          sbq.cv.wait(lock, [&sbq] { return (sbq.batches.size() < SLAB_BENCH_QUEUE_MAX); });
+          sbq.batches.push_back(batch);
+          sbq.cv.notify_all();
+          batch = new std::vector<void*>();
+        }
+      }
+      delete batch;
+      if (slab) {
+        slab->finishThread();
+      }
+      std::lock_guard<std::mutex> lock(sbq.mutex);
+      sbq.producing--;
+      sbq.cv.notify_all();
+    }));
+  }
+  while (true) {
+    std::vector<void*>* batch = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(sbq.mutex);
+      sbq.cv.wait(lock, [&sbq] { return (!sbq.batches.empty() || (0 == sbq.producing)); });
+      if (sbq.batches.empty()) {
+        break;
+      }
+      batch = sbq.batches.front();
+      sbq.batches.pop_front();
+      sbq.cv.notify_all();
+    }
+    for (void* mem : *batch) {
+      if (slab) {
+        slab->release(mem);
+      }
+      else {
+        ::operator delete(mem);
+      }
+    }
+    delete batch;
+  }
+  for (std::thread* t : producers) {
+    t->join();
+    delete t;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start.tv_sec) + ((double) (now.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+
+/*
+* Time entries made from a slab against new and delete, in the shape a scan
+*   makes them. Several threads allocate, and one other thread frees, as the
+*   workers and the DB writer do.
+*/
+void SlabAllocator::benchmark(StringBuilder* output, size_t entry_len, unsigned int threads, size_t count) {
+  static SlabAllocator bench_slab(ENTRY_SLAB_BLOCK_SIZE);
+  output->concatf("Allocation throughput, %u threads making %lu entries of %lu bytes, freed by one other thread:\n",
+    threads, (unsigned long) count, (unsigned long) entry_len
+  );
+  const double heap_secs = _bench_pass(nullptr, entry_len, threads, count);
+  output->concatf("  %-12s %9.2f M/s   %8.1f ms\n", "new/delete", ((double) count / heap_secs) / 1e6, heap_secs * 1000.0);
+  const double slab_secs = _bench_pass(&bench_slab, entry_len, threads, count);
+  output->concatf("  %-12s %9.2f M/s   %8.1f ms\n", "slab", ((double) count / slab_secs) / 1e6, slab_secs * 1000.0);
+  output->concatf("  Slab blocks still held: %u\n", bench_slab.blocksHeld());
+}
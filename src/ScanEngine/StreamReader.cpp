@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory>
+
+#include "ScanEngine.h"
+#include "AbstractPlatform.h"
+
+
+static std::atomic<unsigned long> _files_streamed{0};
+static std::atomic<unsigned long> _files_direct{0};
+
+static thread_local std::unique_ptr<StreamReader> _tl_stream;
+
+
+/*
+* Returns the calling thread's reader, creating it on first use. Returns
+*   nullptr if its buffers or its helper thread could not be had, in which case
+*   the caller should read synchronously.
+*/
+StreamReader* StreamReader::forThisThread() {
+  if (!_tl_stream) {
+    StreamReader* r = new StreamReader();
+    if (0 != r->_alloc()) {
+      delete r;
+      return nullptr;
+    }
+    _tl_stream.reset(r);
+  }
+  return _tl_stream.get();
+}
+
+
+unsigned long StreamReader::filesStreamed() {  return _files_streamed.load();  }
+unsigned long StreamReader::filesDirect() {    return _files_direct.load();    }
+
+
+StreamReader::~StreamReader() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _quit = true;
+  }
+  _cv.notify_all();
+  if (_thread) {
+    _thread->join();
+    delete _thread;
+  }
+  if (_chunk_thread) {
+    _chunk_thread->join();
+    delete _chunk_thread;
+  }
+  for (unsigned int i = 0; i < STREAM_BUFFERS; i++) {
+    free(_bufs[i]);
+  }
+}
+
+
+/*
+* Allocate our buffers, and start the helper.
+* Returns 0 on success, -1 on failure.
+*/
+int StreamReader::_alloc() {
+  for (unsigned int i = 0; i < STREAM_BUFFERS; i++) {
+    void* mem = nullptr;
+    if (0 != posix_memalign(&mem, STREAM_ALIGN, STREAM_BUFFER_SIZE)) {
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate %u bytes for a streamed read.", STREAM_BUFFER_SIZE);
+      return -1;
+    }
+    _bufs[i] = (uint8_t*) mem;
+  }
+  _thread = new std::thread(&StreamReader::_run, this);
+  return 0;
+}
+
+
+/*
+* Start reading the given file, which the caller keeps open until end(). If
+*   direct is set, and the filesystem allows it, the page cache is bypassed.
+*   Otherwise, the kernel is told that we will read from start to finish. A
+*   chunker, if given, is run over every byte read, in order. The caller
+*   finishes it after end().
+* Returns 0 on success.
+*/
+int StreamReader::begin(int fd, uint64_t size, bool direct, Chunker* chunker) {
+  if (chunker && (nullptr == _chunk_thread)) {
+    _chunk_thread = new std::thread(&StreamReader::_run_chunks, this);
+  }
+  bool use_direct = false;
+  if (direct) {
+    const int flags = fcntl(fd, F_GETFL);
+    use_direct = ((flags >= 0) && (0 == fcntl(fd, F_SETFL, flags | O_DIRECT)));
+  }
+  if (!use_direct) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  _files_streamed++;
+  if (use_direct) {
+    _files_direct++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _fd       = fd;
+    _size     = size;
+    _offset   = 0;
+    _direct   = use_direct;
+    _head     = 0;
+    _tail     = 0;
+    _filled   = 0;
+    _chunk_head = 0;
+    _unhashed   = 0;
+    _held     = false;
+    _finished = (0 == size);
+    _failed   = false;
+    _abort    = false;
+    _chunker  = chunker;
+    _active   = true;
+  }
+  _cv.notify_all();
+  return 0;
+}
+
+
+/*
+* Give back the buffer returned by the last call, and wait for the next one.
+* Returns the buffer, with its length in len, or nullptr once the file has been
+*   read to its end (or could not be).
+*/
+const uint8_t* StreamReader::next(size_t* len) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_held) {
+    _held = false;
+    _head = (_head + 1) % STREAM_BUFFERS;
+    _filled--;
+    _cv.notify_all();
+  }
+  _cv.wait(lock, [this] { return ((_filled > 0) || _finished); });
+  if (0 == _filled) {
+    return nullptr;
+  }
+  _held = true;
+  *len  = _lens[_head];
+  return _bufs[_head];
+}
+
+
+/*
+* Finish with the current file, whether or not it was read to its end. The
+*   helper is stopped before we return, so the caller may close the fd.
+* Returns 0 if every read succeeded, -1 otherwise.
+*/
+int StreamReader::end() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _abort = true;
+  _cv.notify_all();
+  _cv.wait(lock, [this] { return (_finished && (0 == _unhashed)); });
+  _active  = false;
+  _fd      = -1;
+  _chunker = nullptr;
+  return (_failed) ? -1 : 0;
+}
+
+
+/*
+* The helper. Fills free buffers in order, for as long as there is a file to
+*   read, and the consumer has not given up on it.
+*/
+void StreamReader::_run() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_quit) {
+    if (!_active || _finished) {
+      _cv.wait(lock);
+      continue;
+    }
+    if (_abort) {
+      _finished = true;
+      _cv.notify_all();
+      continue;
+    }
+    if ((_filled >= STREAM_BUFFERS) || (_unhashed >= STREAM_BUFFERS)) {
+      _cv.wait(lock);
+      continue;
+    }
+    uint8_t* buf = _bufs[_tail];
+    std::vector<uint32_t>* cuts = &_cuts[_tail];
+    Chunker* chunker = _chunker;
+    lock.unlock();
+    const ssize_t r_len = _fill(buf, STREAM_BUFFER_SIZE);
+    cuts->clear();
+    if (chunker && (r_len > 0)) {
+      chunker->scan(buf, (size_t) r_len, cuts);
+    }
+    lock.lock();
+    if (r_len < 0) {
+      _failed   = true;
+      _finished = true;
+    }
+    else if (0 == r_len) {
+      _finished = true;   // The file is shorter than it was when stat'd.
+    }
+    else {
+      _lens[_tail] = (size_t) r_len;
+      _tail = (_tail + 1) % STREAM_BUFFERS;
+      _filled++;
+      if (chunker) {
+        _unhashed++;
+      }
+      _offset += (uint64_t) r_len;
+      _finished = (_offset >= _size);
+    }
+    _cv.notify_all();
+  }
+}
+
+
+/*
+* The chunk helper. Hashes the chunks in each filled buffer, in the order the
+*   buffers were filled, and gives the buffer back.
+*/
+void StreamReader::_run_chunks() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_quit) {
+    if (0 == _unhashed) {
+      _cv.wait(lock);
+      continue;
+    }
+    const unsigned int idx = _chunk_head;
+    Chunker* chunker = _chunker;
+    lock.unlock();
+    chunker->digest(_bufs[idx], _lens[idx], &_cuts[idx]);
+    lock.lock();
+    _chunk_head = (_chunk_head + 1) % STREAM_BUFFERS;
+    _unhashed--;
+    _cv.notify_all();
+  }
+}
+
+
+/*
+* Read the next piece of the file into a buffer, without holding the lock.
+*   Without O_DIRECT, we stop at the size the file was stat'd with. With it,
+*   the length must stay a multiple of the alignment, and the kernel stops us
+*   at the real end of the file. If the filesystem turns down a direct read, we
+*   carry on through the page cache.
+* Returns the bytes read, 0 at the end of the file, or -1 on error.
+*/
+ssize_t StreamReader::_fill(uint8_t* buf, size_t len) {
+  const uint64_t remaining = _size - _offset;
+  size_t want = len;
+  if (remaining < want) {
+    want = (_direct) ? (size_t) ((remaining + STREAM_ALIGN - 1) & ~((uint64_t) STREAM_ALIGN - 1)) : (size_t) remaining;
+  }
+  size_t got = 0;
+  while (got < want) {
+    const ssize_t r_len = pread(_fd, buf + got, want - got, (off_t) (_offset + got));
+    if (r_len < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EINVAL == errno) && _direct) {
+        const int flags = fcntl(_fd, F_GETFL);
+        if ((flags >= 0) && (0 == fcntl(_fd, F_SETFL, flags & ~O_DIRECT))) {
+          c3p_log(LOG_LEV_DEBUG, __PRETTY_FUNCTION__, "Direct read refused. Reading through the page cache instead.");
+          _direct = false;
+          continue;
+        }
+      }
+      c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Read failed at offset %lu: %s", (unsigned long) (_offset + got), strerror(errno));
+      return -1;
+    }
+    if (0 == r_len) {
+      break;
+    }
+    got += (size_t) r_len;
+    if (_direct && (0 != (r_len % STREAM_ALIGN))) {
+      break;   // A short direct read only happens at the end of the file.
+    }
+  }
+  return (ssize_t) got;
+}
@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+#include "AbstractPlatform.h"
+
+
+// Cleared for the whole process the first time the kernel turns us away.
+static std::atomic<bool> _uring_usable{true};
+static std::atomic<unsigned long> _uring_ops{0};
+// Cleared the first time the kernel cannot give us a sparse file table.
+static std::atomic<bool> _reads_usable{true};
+static std::atomic<unsigned long> _files_read{0};
+
+static thread_local std::unique_ptr<UringQueue> _tl_ring;
+
+
+static inline int _uring_setup(unsigned int entries, struct io_uring_params* p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int _uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static inline int _uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/*
+* Returns the calling thread's ring, creating it on first use. Returns nullptr
+*   if io_uring cannot be used.
+*/
+UringQueue* UringQueue::forThisThread() {
+  if (!_uring_usable) {
+    return nullptr;
+  }
+  if (!_tl_ring) {
+    UringQueue* q = new UringQueue();
+    if (0 != q->init(SCAN_CHUNK_SIZE)) {
+      delete q;
+      if (_uring_usable.exchange(false)) {
+        c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "io_uring is unavailable (%s). Falling back to synchronous I/O.", strerror(errno));
+      }
+      return nullptr;
+    }
+    _tl_ring.reset(q);
+  }
+  return _tl_ring.get();
+}
+
+
+bool UringQueue::available() {             return _uring_usable.load();  }
+bool UringQueue::readsAvailable() {         return (_uring_usable.load() && _reads_usable.load());  }
+unsigned long UringQueue::opsCompleted() {  return _uring_ops.load();     }
+unsigned long UringQueue::filesRead() {     return _files_read.load();    }
+
+
+UringQueue::~UringQueue() {
+  if (_sqes) {
+    munmap(_sqes, _sqes_len);
+  }
+  if (_cq_ptr && (_cq_ptr != _sq_ptr)) {
+    munmap(_cq_ptr, _cq_map_len);
+  }
+  if (_sq_ptr) {
+    munmap(_sq_ptr, _sq_map_len);
+  }
+  if (_ring_fd >= 0) {
+    close(_ring_fd);
+  }
+  if (_statx_bufs) {
+    free(_statx_bufs);
+  }
+  if (_file_bufs) {
+    free(_file_bufs);
+  }
+}
+
+
+/*
+* Set up the ring and map its queues. Returns 0 on success, -1 on failure.
+*/
+int UringQueue::init(unsigned int entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  _ring_fd = _uring_setup(entries, &p);
+  if (_ring_fd < 0) {
+    return -1;
+  }
+  _sq_map_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+  _cq_map_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    _sq_map_len = (_cq_map_len > _sq_map_len) ? _cq_map_len : _sq_map_len;
+    _cq_map_len = _sq_map_len;
+  }
+  void* sq = mmap(nullptr, _sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == sq) {
+    return -1;
+  }
+  _sq_ptr = (uint8_t*) sq;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    _cq_ptr = _sq_ptr;
+  }
+  else {
+    void* cq = mmap(nullptr, _cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == cq) {
+      return -1;
+    }
+    _cq_ptr = (uint8_t*) cq;
+  }
+  _sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, _sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+  if (MAP_FAILED == sqes) {
+    return -1;
+  }
+  _sqes = (struct io_uring_sqe*) sqes;
+
+  _sq_head  = (unsigned int*) (_sq_ptr + p.sq_off.head);
+  _sq_tail  = (unsigned int*) (_sq_ptr + p.sq_off.tail);
+  _sq_mask  = (unsigned int*) (_sq_ptr + p.sq_off.ring_mask);
+  _sq_array = (unsigned int*) (_sq_ptr + p.sq_off.array);
+  _cq_head  = (unsigned int*) (_cq_ptr + p.cq_off.head);
+  _cq_tail  = (unsigned int*) (_cq_ptr + p.cq_off.tail);
+  _cq_mask  = (unsigned int*) (_cq_ptr + p.cq_off.ring_mask);
+  _cqes     = (struct io_uring_cqe*) (_cq_ptr + p.cq_off.cqes);
+  _sq_entries = p.sq_entries;
+
+  _statx_bufs = (struct statx*) malloc(sizeof(struct statx) * SCAN_CHUNK_SIZE);
+  return (nullptr != _statx_bufs) ? 0 : -1;
+}
+
+
+/*
+* Returns a zeroed SQE, or nullptr if the submission queue is full.
+*/
+struct io_uring_sqe* UringQueue::getSQE() {
+  const unsigned int head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+  const unsigned int tail = *_sq_tail + _to_submit;
+  if ((tail - head) >= _sq_entries) {
+    return nullptr;
+  }
+  const unsigned int idx = tail & *_sq_mask;
+  struct io_uring_sqe* sqe = &_sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  _sq_array[idx] = idx;
+  _to_submit++;
+  return sqe;
+}
+
+
+/*
+* Hand every filled SQE to the kernel, and wait until at least wait_nr
+*   completions are ready.
+* Returns the number of SQEs submitted, or -errno on failure.
+*/
+int UringQueue::submit(unsigned int wait_nr) {
+  __atomic_store_n(_sq_tail, *_sq_tail + _to_submit, __ATOMIC_RELEASE);
+  const unsigned int to_submit = _to_submit;
+  unsigned int submitted = 0;
+  int ret = 0;
+  do {
+    ret = _uring_enter(_ring_fd, to_submit - submitted, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+      submitted += ret;
+    }
+  } while (((ret > 0) && (submitted < to_submit)) || ((ret < 0) && (EINTR == errno)));
+  _to_submit = 0;
+  return (ret < 0) ? -errno : (int) submitted;
+}
+
+
+/*
+* Pop one completion, if there is one.
+* Returns 1 if a completion was produced, 0 otherwise.
+*/
+int UringQueue::reap(uint64_t* user_data, int32_t* res) {
+  const unsigned int head = *_cq_head;
+  if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  struct io_uring_cqe* cqe = &_cqes[head & *_cq_mask];
+  *user_data = cqe->user_data;
+  *res       = cqe->res;
+  __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+  _uring_ops++;
+  return 1;
+}
+
+
+/*
+* Issue one statx per pending object in the chunk, and wait for all of them.
+*   Results are applied to the objects as they complete. Objects are left
+*   pending if their request could not be issued, if they have no stable
+*   target (see ORMFileData::statTarget()), or if the kernel does not support
+*   IORING_OP_STATX.
+* Returns the number of objects whose stat was resolved, or -1 on failure.
+*/
+int UringQueue::statChunk(ScanChunk* chunk) {
+  unsigned int issued = 0;
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    ORMFileData* obj = chunk->items[i];
+    int dirfd = AT_FDCWD;
+    const char* path = nullptr;
+    if (obj->statPending() && (0 == obj->statTarget(&dirfd, &path))) {
+      struct io_uring_sqe* sqe = getSQE();
+      if (nullptr == sqe) {
+        break;
+      }
+      sqe->opcode      = IORING_OP_STATX;
+      sqe->fd          = dirfd;
+      sqe->addr        = (uint64_t) (uintptr_t) path;
+      sqe->len         = STATX_BASIC_STATS;
+      sqe->addr2       = (uint64_t) (uintptr_t) &_statx_bufs[i];
+      sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+      sqe->user_data   = i;
+      issued++;
+    }
+  }
+  if (0 == issued) {
+    return 0;
+  }
+  int submitted = submit(issued);
+  if (submitted < (int) issued) {
+    // The ring is in an unknown state. Collect what was submitted, and never
+    //   use io_uring again.
+    if (_uring_usable.exchange(false)) {
+      c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "io_uring_enter() failed (%s). Falling back to synchronous I/O.", strerror((submitted < 0) ? -submitted : EAGAIN));
+    }
+    issued = (submitted > 0) ? (unsigned int) submitted : 0;
+  }
+
+  int resolved = 0;
+  unsigned int reaped = 0;
+  while (reaped < issued) {
+    uint64_t idx = 0;
+    int32_t  res = 0;
+    if (0 == reap(&idx, &res)) {
+      if ((0 > _uring_enter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS)) && (EINTR != errno)) {
+        return -1;
+      }
+      continue;
+    }
+    reaped++;
+    ORMFileData* obj = chunk->items[idx];
+    if (0 == res) {
+      struct statx* stx = &_statx_bufs[idx];
+      struct stat64 statbuf;
+      memset((void*) &statbuf, 0, sizeof(struct stat64));
+      statbuf.st_mode  = stx->stx_mode;
+      statbuf.st_uid   = stx->stx_uid;
+      statbuf.st_gid   = stx->stx_gid;
+      statbuf.st_size  = stx->stx_size;
+      statbuf.st_ino   = stx->stx_ino;
+      statbuf.st_nlink = stx->stx_nlink;
+      statbuf.st_dev   = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+      statbuf.st_mtim.tv_sec  = stx->stx_mtime.tv_sec;
+      statbuf.st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+      statbuf.st_ctim.tv_sec  = stx->stx_ctime.tv_sec;
+      statbuf.st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+      obj->applyStat(&statbuf);
+      resolved++;
+    }
+    else if (-EINVAL == res) {
+      // The kernel has io_uring, but not IORING_OP_STATX.
+      if (_uring_usable.exchange(false)) {
+        c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "io_uring does not support statx here. Falling back to synchronous I/O.");
+      }
+    }
+    else {
+      obj->statFailed(-res);
+    }
+  }
+  return resolved;
+}
+
+
+/*
+* Give the ring a sparse table of HASH_BATCH_FILES direct descriptors, and the
+*   buffers that files are read into. The buffers are registered too, if the
+*   kernel will take them, so that reads need not map them each time.
+* Returns 0 on success, -1 if files cannot be read through this ring.
+*/
+int UringQueue::_setup_files() {
+  if (0 != _files_ready) {
+    return (_files_ready > 0) ? 0 : -1;
+  }
+  _files_ready = -1;
+  if (!_reads_usable) {
+    return -1;
+  }
+  struct io_uring_rsrc_register reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.nr    = HASH_BATCH_FILES;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  if (0 > _uring_register(_ring_fd, IORING_REGISTER_FILES2, &reg, sizeof(reg))) {
+    if (_reads_usable.exchange(false)) {
+      c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "io_uring cannot open files here (%s). Small files will be read synchronously.", strerror(errno));
+    }
+    return -1;
+  }
+  void* mem = nullptr;
+  const size_t len = HASH_BATCH_FILES * URING_SMALL_FILE_SIZE;
+  if (0 != posix_memalign(&mem, 4096, len)) {
+    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to allocate %u bytes for io_uring reads.", (unsigned int) len);
+    return -1;
+  }
+  _file_bufs = (uint8_t*) mem;
+  struct iovec iov = { mem, len };
+  _bufs_registered = (0 <= _uring_register(_ring_fd, IORING_REGISTER_BUFFERS, &iov, 1));
+  _files_ready = 1;
+  return 0;
+}
+
+
+/*
+* Read a batch of small files whole. Each file is an openat into a direct
+*   descriptor, a read into its own slot of our buffers, and a close, linked
+*   together, so that the whole batch costs one trip into the kernel rather than
+*   three per file. The read is hard-linked to the close, so that a short read
+*   still frees its descriptor. Files with no stable target (see
+*   ORMFileData::statTarget()) are read synchronously, into the same slots.
+* msgs is filled with each file's buffer, and read_ok with whether exactly its
+*   size was read.
+* Returns 0 if the batch was read, or -1 if the caller must read it some other
+*   way.
+*/
+int UringQueue::readFiles(ORMFileData** objs, unsigned int count, const uint8_t** msgs, bool* read_ok) {
+  if ((count > HASH_BATCH_FILES) || (0 != _setup_files())) {
+    return -1;
+  }
+  unsigned int issued = 0;
+  int first_sqe[HASH_BATCH_FILES];   // Where each file's requests begin, or -1.
+  for (unsigned int i = 0; i < count; i++) {
+    ORMFileData* obj = objs[i];
+    uint8_t* buf = _file_bufs + (i * URING_SMALL_FILE_SIZE);
+    msgs[i]      = buf;
+    read_ok[i]   = false;
+    first_sqe[i] = -1;
+    int dirfd = AT_FDCWD;
+    const char* path = nullptr;
+    if ((obj->size() > URING_SMALL_FILE_SIZE) || (0 != obj->statTarget(&dirfd, &path))) {
+      read_ok[i] = (0 == obj->readContent(buf, URING_SMALL_FILE_SIZE));
+      continue;
+    }
+    first_sqe[i] = (int) issued;
+    // Three SQEs per file. A full batch fits in the ring with room to spare.
+    struct io_uring_sqe* sqe = getSQE();
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->flags      = IOSQE_IO_LINK;
+    sqe->fd         = dirfd;
+    sqe->addr       = (uint64_t) (uintptr_t) path;
+    sqe->open_flags = O_RDONLY | ((AT_FDCWD == dirfd) ? 0 : O_NOFOLLOW);
+    sqe->file_index = i + 1;
+    sqe->user_data  = (i * 3);
+
+    sqe = getSQE();
+    sqe->opcode     = (_bufs_registered) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->flags      = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd         = (int) i;
+    sqe->addr       = (uint64_t) (uintptr_t) buf;
+    sqe->len        = (uint32_t) obj->size();
+    sqe->off        = 0;
+    sqe->buf_index  = 0;
+    sqe->user_data  = (i * 3) + 1;
+
+    sqe = getSQE();
+    sqe->opcode     = IORING_OP_CLOSE;
+    sqe->file_index = i + 1;
+    sqe->user_data  = (i * 3) + 2;
+    issued += 3;
+  }
+  if (0 == issued) {
+    return 0;
+  }
+  int submitted = submit(issued);
+  if (submitted < (int) issued) {
+    if (_uring_usable.exchange(false)) {
+      c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "io_uring_enter() failed (%s). Falling back to synchronous I/O.", strerror((submitted < 0) ? -submitted : EAGAIN));
+    }
+    issued = (submitted > 0) ? (unsigned int) submitted : 0;
+  }
+
+  unsigned int reaped = 0;
+  while (reaped < issued) {
+    uint64_t tag = 0;
+    int32_t  res = 0;
+    if (0 == reap(&tag, &res)) {
+      if ((0 > _uring_enter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS)) && (EINTR != errno)) {
+        return -1;
+      }
+      continue;
+    }
+    reaped++;
+    ORMFileData* obj = objs[tag / 3];
+    switch (tag % 3) {
+      case 0:
+        if (res < 0) {
+          c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to open path for hashing: %s (%s)", obj->path(), strerror(-res));
+        }
+        break;
+      case 1:
+        if ((res >= 0) && ((uint64_t) res == obj->size())) {
+          read_ok[tag / 3] = true;
+          _files_read++;
+        }
+        else if (-ECANCELED != res) {
+          c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Failed to run the hash on %s", obj->path());
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  // Files whose requests were not all submitted are read the slow way.
+  for (unsigned int i = 0; i < count; i++) {
+    if ((0 <= first_sqe[i]) && ((unsigned int) (first_sqe[i] + 3) > issued)) {
+      read_ok[i] = (0 == objs[i]->readContent((uint8_t*) msgs[i], URING_SMALL_FILE_SIZE));
+    }
+  }
+  return 0;
+}
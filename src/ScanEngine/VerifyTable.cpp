@@ -0,0 +1,151 @@
+#include <string.h>
+#include <algorithm>
+
+#include "ScanEngine.h"
+#include "MySQLConnector/DBAbstractions/ORM.h"
+#include "AbstractPlatform.h"
+
+
+static uint8_t _type_of(ORMFileData* obj) {
+  if (obj->isFile()) {        return VERIFY_TYPE_FILE;  }
+  if (obj->isDirectory()) {   return VERIFY_TYPE_DIR;   }
+  if (obj->isLink()) {        return VERIFY_TYPE_LINK;  }
+  return VERIFY_TYPE_OTHER;
+}
+
+
+/*
+* Add a row of the stored catalog. The digest is null if the row was never
+*   hashed. Only call this before seal().
+*/
+void VerifyTable::add(const char* rel_path, uint32_t id, uint8_t type, uint64_t size, int64_t mtime_ns, const uint8_t* digest) {
+  Entry e;
+  e.key      = BaselineTable::pathKey(rel_path);
+  e.size     = size;
+  e.mtime_ns = mtime_ns;
+  e.id       = id;
+  e.type     = type;
+  e.hashed   = (nullptr != digest);
+  e.seen     = false;
+  if (digest) {
+    memcpy(e.digest, digest, 32);
+  }
+  else {
+    memset(e.digest, 0, 32);
+  }
+  _entries.push_back(e);
+}
+
+
+/*
+* Sort the table for lookup, and note which digest its rows hold. Keys held by
+*   more than one row are set aside, and paths with those keys are not checked.
+*/
+void VerifyTable::seal(uint8_t digest) {
+  _digest = digest;
+  std::sort(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) {  return (a.key < b.key);  });
+  size_t w = 0;
+  for (size_t r = 0; r < _entries.size(); ) {
+    size_t end = r + 1;
+    while ((end < _entries.size()) && (_entries[end].key == _entries[r].key)) {
+      end++;
+    }
+    if (1 == (end - r)) {
+      _entries[w++] = _entries[r];
+    }
+    else {
+      _ambiguous.push_back(_entries[r].key);
+      _skipped += (end - r);
+    }
+    r = end;
+  }
+  _entries.resize(w);
+  _entries.shrink_to_fit();
+}
+
+
+/*
+* Check an examined object against its row, and tally the result. Anything that
+*   does not match is logged with its path.
+*/
+void VerifyTable::check(ORMFileData* obj) {
+  const uint64_t key = BaselineTable::pathKey(PathArena::relativePath(obj->pathNode()));
+  auto it = std::lower_bound(_entries.begin(), _entries.end(), key, [](const Entry& e, uint64_t k) {  return (e.key < k);  });
+  if ((it == _entries.end()) || (it->key != key)) {
+    if (!std::binary_search(_ambiguous.begin(), _ambiguous.end(), key)) {
+      _new++;
+      c3p_log(LOG_LEV_NOTICE, __PRETTY_FUNCTION__, "New: %s", obj->path());
+    }
+    return;
+  }
+  it->seen = true;
+  if (it->type != _type_of(obj)) {
+    _changed++;
+    c3p_log(LOG_LEV_NOTICE, __PRETTY_FUNCTION__, "Changed type: %s", obj->path());
+    return;
+  }
+  if (!obj->isFile() || !it->hashed) {
+    _matched++;
+    return;
+  }
+  if (ScanDepth::FULL != obj->tier()) {
+    _unreadable++;
+    c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "Unreadable: %s", obj->path());
+    return;
+  }
+  _bytes += obj->size();
+  const uint8_t* digest = (DIGEST_BLAKE3 == _digest) ? obj->blake3() : obj->digest();
+  if (digest && (0 == memcmp(digest, it->digest, 32))) {
+    _matched++;
+  }
+  else if ((it->size == obj->size()) && (0 != it->mtime_ns) && (it->mtime_ns == obj->mtimeNs())) {
+    // Nothing that writes a file through the filesystem leaves its mtime alone.
+    _corrupt++;
+    c3p_log(LOG_LEV_WARN, __PRETTY_FUNCTION__, "Content differs, with the same size and mtime: %s", obj->path());
+  }
+  else {
+    _changed++;
+    c3p_log(LOG_LEV_NOTICE, __PRETTY_FUNCTION__, "Changed: %s", obj->path());
+  }
+}
+
+
+/*
+* Collect the IDs of the rows that no object was checked against.
+*/
+void VerifyTable::unseen(std::vector<uint32_t>* ids) {
+  for (Entry& e : _entries) {
+    if (!e.seen) {
+      ids->push_back(e.id);
+    }
+  }
+}
+
+
+void VerifyTable::reset() {
+  _entries.clear();
+  _entries.shrink_to_fit();
+  _ambiguous.clear();
+  _ambiguous.shrink_to_fit();
+  _matched    = 0;
+  _changed    = 0;
+  _corrupt    = 0;
+  _unreadable = 0;
+  _new        = 0;
+  _skipped    = 0;
+  _bytes      = 0;
+}
+
+
+void VerifyTable::printDebug(StringBuilder* output) {
+  output->concatf("Verification\n");
+  output->concatf("  Rows:          %lu (%lu KiB), %lu that could not be told apart\n",
+    (unsigned long) _entries.size(), (unsigned long) ((_entries.capacity() * sizeof(Entry)) >> 10), _skipped.load()
+  );
+  output->concatf("  Matched:       %lu\n", _matched.load());
+  output->concatf("  Changed:       %lu\n", _changed.load());
+  output->concatf("  Corrupt:       %lu\n", _corrupt.load());
+  output->concatf("  Unreadable:    %lu\n", _unreadable.load());
+  output->concatf("  New:           %lu\n", _new.load());
+  output->concatf("  Compared:      %lu MiB\n", (unsigned long) (_bytes.load() >> 20));
+}
@@ -169,11 +169,11 @@ void cleanupCatalog() {
 /*
 * start cataloging the files recursively.
 */
-long startCatalogScan() {
+long startCatalogScan(ScanDepth depth) {
   long return_value = 0;
   if (root_catalog) {
-    return_value = root_catalog->scan();
-    printf("Scan finished.\n");
+    return_value = root_catalog->scan(depth);
+    printf("%s\n", (1 == return_value) ? "Scan stopped." : ((0 == return_value) ? "Scan finished." : "Scan failed."));
     printCatalogInfo();
   }
   else {
@@ -184,6 +184,109 @@ long startCatalogScan() {
 }
 
 
+/*
+* Load a saved catalog, and continue its scan from the last checkpoint. Any
+*   options given are applied to the loaded catalog first.
+*/
+long resumeCatalog(uint32_t catalog, StringBuilder* opts) {
+  if (nullptr != root_catalog) {
+    cleanupCatalog();
+  }
+  root_catalog = ORMDatahiveVersion::load(catalog);
+  if (nullptr == root_catalog) {
+    printf("No saved catalog with ID %u.\n", catalog);
+    return -1;
+  }
+  for (int i = 0; (i + 1) < opts->count(); i += 2) {
+    if (0 != root_catalog->scanOptions()->set(opts->position(i), opts->position(i+1))) {
+      printf("Unknown scan option: %s\n", opts->position(i));
+    }
+  }
+  StringBuilder tmp("Loaded catalog:\n");
+  root_catalog->printDebug(&tmp);
+  printf("%s\n", tmp.string());
+  long return_value = root_catalog->resume();
+  printf("%s\n", (1 == return_value) ? "Scan stopped." : ((0 == return_value) ? "Scan finished." : "Scan failed."));
+  printCatalogInfo();
+  return return_value;
+}
+
+
+/*
+* Load a saved catalog, and check its tree against it. Any options given are
+*   applied to the loaded catalog first. The catalog's rows are not changed.
+*/
+long verifyCatalog(uint32_t catalog, StringBuilder* opts) {
+  if (nullptr != root_catalog) {
+    cleanupCatalog();
+  }
+  root_catalog = ORMDatahiveVersion::load(catalog);
+  if (nullptr == root_catalog) {
+    printf("No saved catalog with ID %u.\n", catalog);
+    return -1;
+  }
+  for (int i = 0; (i + 1) < opts->count(); i += 2) {
+    if (0 != root_catalog->scanOptions()->set(opts->position(i), opts->position(i+1))) {
+      printf("Unknown scan option: %s\n", opts->position(i));
+    }
+  }
+  long return_value = root_catalog->verify();
+  if (0 <= return_value) {
+    printf("%s\n", (1 == return_value) ? "Verification stopped." : "Verification finished.");
+  }
+  return return_value;
+}
+
+
+/*
+* SIGINT during a watch stops the watch, rather than the program.
+*/
+static void watch_sigint_handler(int sig) {
+  ORMDatahiveVersion::stopWatching();
+}
+
+
+/*
+* Keep a catalog current by following changes to its tree. With a catalog ID,
+*   that catalog is loaded first. Otherwise the current catalog is watched.
+*   Any options given are applied first. Blocks until interrupted.
+*/
+long watchCatalog(StringBuilder* args) {
+  if ((0 < args->count()) && isdigit(*(args->position(0)))) {
+    uint32_t catalog = (uint32_t) args->position_as_int(0);
+    args->drop_position(0);
+    if (nullptr != root_catalog) {
+      cleanupCatalog();
+    }
+    root_catalog = ORMDatahiveVersion::load(catalog);
+    if (nullptr == root_catalog) {
+      printf("No saved catalog with ID %u.\n", catalog);
+      return -1;
+    }
+  }
+  if (nullptr == root_catalog) {
+    printf("No catalog.\n");
+    return -1;
+  }
+  for (int i = 0; (i + 1) < args->count(); i += 2) {
+    if (0 != root_catalog->scanOptions()->set(args->position(i), args->position(i+1))) {
+      printf("Unknown scan option: %s\n", args->position(i));
+    }
+  }
+  struct sigaction act;
+  struct sigaction old_act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = watch_sigint_handler;
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGINT, &act, &old_act);
+  printf("Press Ctrl-C to stop watching.\n");
+  long return_value = root_catalog->watch();
+  sigaction(SIGINT, &old_act, nullptr);
+  printf("Watch stopped.\n");
+  return return_value;
+}
+
+
 /*
 * Given a path, create a new catalog.
 */
@@ -272,6 +375,7 @@ void printCatalogInfo() {
   if (root_catalog) {
     StringBuilder tmp;
     root_catalog->printDebug(&tmp);
+    ScanScheduler::getInstance()->printDebug(&tmp);
     printf("%s\n", tmp.string());
   }
   else {
@@ -290,6 +394,7 @@ void printUsage() {
   printf("    --verbosity     How noisy should we be in the logs?\n");
   printf("-c  --conf          Manually specify a file containing the database connection parameters.\n");
   printf("                      Default value if not supplied is %s.\n", DEFAULT_CONF_FILE);
+  printf("    --hash-cache    A file in which this host keeps the digests of files it has hashed.\n");
   printf("\n\n");
 }
 
@@ -323,7 +428,154 @@ int callback_catalog_info(StringBuilder* text_return, StringBuilder* args) {
 }
 
 int callback_start_scan(StringBuilder* text_return, StringBuilder* args) {
-  startCatalogScan(); // Accumulate metadata.
+  ScanOptions depth_parse;
+  int arg = 0;
+  if ((arg < args->count()) && !isdigit(*(args->position(arg)))) {
+    if (0 != depth_parse.setDepth(args->position(arg))) {
+      text_return->concatf("Unknown scan depth: %s\n", args->position(arg));
+      return 0;
+    }
+    arg++;
+  }
+  if (arg < args->count()) {
+    if (nullptr == root_catalog) {
+      text_return->concat("No catalog.\n");
+      return 0;
+    }
+    root_catalog->scanOptions()->baseline = (uint32_t) args->position_as_int(arg);
+  }
+  startCatalogScan(depth_parse.depth); // Accumulate metadata.
+  return 0;
+}
+
+int callback_resume(StringBuilder* text_return, StringBuilder* args) {
+  if (0 < args->count()) {
+    uint32_t catalog = (uint32_t) args->position_as_int(0);
+    args->drop_position(0);
+    resumeCatalog(catalog, args);
+  }
+  else {
+    text_return->concat("resume needs a catalog ID.\n");
+  }
+  return 0;
+}
+
+int callback_verify(StringBuilder* text_return, StringBuilder* args) {
+  if (0 < args->count()) {
+    uint32_t catalog = (uint32_t) args->position_as_int(0);
+    args->drop_position(0);
+    verifyCatalog(catalog, args);
+  }
+  else {
+    text_return->concat("verify needs a catalog ID.\n");
+  }
+  return 0;
+}
+
+int callback_hash_bench(StringBuilder* text_return, StringBuilder* args) {
+  const int msg_len = (0 < args->count()) ? args->position_as_int(0) : 4096;
+  const int total   = (1 < args->count()) ? args->position_as_int(1) : 256;
+  if ((0 >= msg_len) || (0 >= total)) {
+    text_return->concat("hash-bench needs a message size in bytes, and a total in MiB.\n");
+    return 0;
+  }
+  Sha256::benchmark(text_return, (size_t) msg_len, ((size_t) total << 20));
+  return 0;
+}
+
+int callback_order_bench(StringBuilder* text_return, StringBuilder* args) {
+  if (1 > args->count()) {
+    text_return->concat("order-bench needs a directory on the disk to test.\n");
+    return 0;
+  }
+  const int files = (1 < args->count()) ? args->position_as_int(1) : 1000;
+  const int kib   = (2 < args->count()) ? args->position_as_int(2) : 128;
+  if ((0 >= files) || (0 >= kib)) {
+    text_return->concat("order-bench needs a file count, and a file size in KiB.\n");
+    return 0;
+  }
+  ORMFileData::orderBenchmark(text_return, args->position(0), (unsigned int) files, (unsigned int) kib);
+  return 0;
+}
+
+int callback_alloc_bench(StringBuilder* text_return, StringBuilder* args) {
+  const unsigned int cpus = std::thread::hardware_concurrency();
+  const int threads = (0 < args->count()) ? args->position_as_int(0) : ((cpus > 1) ? (int) cpus : 2);
+  const int entries = (1 < args->count()) ? args->position_as_int(1) : 4096;
+  if ((0 >= threads) || (0 >= entries)) {
+    text_return->concat("alloc-bench needs a thread count, and a number of entries in thousands.\n");
+    return 0;
+  }
+  SlabAllocator::benchmark(text_return, sizeof(ORMFileData), (unsigned int) threads, ((size_t) entries * 1000));
+  return 0;
+}
+
+int callback_hash_cache(StringBuilder* text_return, StringBuilder* args) {
+  HashCache* cache = HashCache::getInstance();
+  char* cmd = (0 < args->count()) ? args->position(0) : (char*) "info";
+  if (0 == strcasecmp(cmd, "open")) {
+    if (2 > args->count()) {
+      text_return->concat("open needs a path.\n");
+      return 0;
+    }
+    const uint64_t slots = (2 < args->count()) ? strtoull(args->position(2), nullptr, 10) : 0;
+    if (0 != cache->open(args->position(1), slots)) {
+      text_return->concatf("Failed to open %s as a hash cache.\n", args->position(1));
+    }
+  }
+  else if (0 == strcasecmp(cmd, "close")) {
+    cache->close();
+  }
+  else if (0 == strcasecmp(cmd, "compact")) {
+    const unsigned int max_age = (1 < args->count()) ? (unsigned int) args->position_as_int(1) : 0;
+    const uint64_t     slots   = (2 < args->count()) ? strtoull(args->position(2), nullptr, 10) : 0;
+    const long kept = cache->compact(slots, max_age);
+    if (0 > kept) {
+      text_return->concat("The hash cache was not compacted.\n");
+    }
+    else {
+      text_return->concatf("Kept %ld entries.\n", kept);
+    }
+  }
+  else if (0 != strcasecmp(cmd, "info")) {
+    text_return->concatf("Unknown hash-cache command: %s\n", cmd);
+    return 0;
+  }
+  cache->printDebug(text_return);
+  return 0;
+}
+
+int callback_rescan(StringBuilder* text_return, StringBuilder* args) {
+  if (nullptr == root_catalog) {
+    text_return->concat("No catalog.\n");
+  }
+  else if (0 < args->count()) {
+    if (0 == root_catalog->rescan(args->position(0))) {
+      printCatalogInfo();
+    }
+  }
+  else {
+    text_return->concat("rescan needs a path within the catalog.\n");
+  }
+  return 0;
+}
+
+int callback_dupes_scan(StringBuilder* text_return, StringBuilder* args) {
+  if (nullptr == root_catalog) {
+    text_return->concat("No catalog.\n");
+  }
+  else {
+    const int ret = root_catalog->scanDupes();
+    if (0 <= ret) {
+      printf("%s\n", (1 == ret) ? "Scan stopped." : "Scan finished.");
+      printCatalogInfo();
+    }
+  }
+  return 0;
+}
+
+int callback_watch(StringBuilder* text_return, StringBuilder* args) {
+  watchCatalog(args);
   return 0;
 }
 
@@ -349,7 +601,9 @@ int callback_max_print_width(StringBuilder* text_return, StringBuilder* args) {
 
 int callback_new_catalog(StringBuilder* text_return, StringBuilder* args) {
   if (0 < args->count()) {
-    newCatalogPath(args->position(0));
+    if ((0 == newCatalogPath(args->position(0))) && (1 < args->count())) {
+      root_catalog->scanOptions()->baseline = (uint32_t) args->position_as_int(1);
+    }
   }
   else {
     text_return->concat("Catalog needs a path to take as a root.\n");
@@ -358,6 +612,67 @@ int callback_new_catalog(StringBuilder* text_return, StringBuilder* args) {
 }
 
 
+int callback_scan_opts(StringBuilder* text_return, StringBuilder* args) {
+  if (nullptr != root_catalog) {
+    ScanOptions* opts = root_catalog->scanOptions();
+    for (int i = 0; (i + 1) < args->count(); i += 2) {
+      if (0 != opts->set(args->position(i), args->position(i+1))) {
+        text_return->concatf("Unknown scan option: %s\n", args->position(i));
+      }
+    }
+    text_return->concat("Scan options:\n");
+    opts->printDebug(text_return);
+  }
+  else {
+    text_return->concat("No catalog.\n");
+  }
+  return 0;
+}
+
+
+int callback_rules(StringBuilder* text_return, StringBuilder* args) {
+  if (nullptr == root_catalog) {
+    text_return->concat("No catalog.\n");
+    return 0;
+  }
+  char* cmd = (0 < args->count()) ? args->position(0) : (char*) "list";
+  if (0 == strcasecmp(cmd, "add")) {
+    if (2 > args->count()) {
+      text_return->concat("add needs a rule.\n");
+      return 0;
+    }
+    args->drop_position(0);
+    args->implode(" ");
+    if (0 != root_catalog->addRule(args->string())) {
+      text_return->concatf("Rule was not added: %s\n", args->string());
+    }
+  }
+  else if (0 == strcasecmp(cmd, "clear")) {
+    root_catalog->clearRules();
+  }
+  else if (0 == strcasecmp(cmd, "copy")) {
+    if (2 > args->count()) {
+      text_return->concat("copy needs a catalog ID.\n");
+      return 0;
+    }
+    int copied = root_catalog->copyRules((uint32_t) args->position_as_int(1));
+    if (0 > copied) {
+      text_return->concat("Failed to read the rules of that catalog.\n");
+    }
+    else {
+      text_return->concatf("Copied %d rules.\n", copied);
+    }
+  }
+  else if (0 != strcasecmp(cmd, "list")) {
+    text_return->concatf("Unknown rules command: %s\n", cmd);
+    return 0;
+  }
+  text_return->concat("Rules (the last match wins):\n");
+  root_catalog->scanOptions()->rules.printDebug(text_return);
+  return 0;
+}
+
+
 int callback_set_tag(StringBuilder* text_return, StringBuilder* args) {
   if (nullptr != root_catalog) {
     root_catalog->setTag(args);
@@ -402,7 +717,7 @@ int main(int argc, char *argv[]) {
   // Parse through all the command line arguments and flags...
   // Please note that the order matters. Put all the most-general matches at the bottom of the loop.
   for (int i = 1; i < argc; i++) {
-    if ((strcasestr(argv[i], "--help")) || (strcasestr(argv[i], "-h"))) {
+    if ((0 == strcasecmp(argv[i], "--help")) || (0 == strcmp(argv[i], "-h"))) {
       printUsage();
       exit(0);
     }
@@ -428,7 +743,7 @@ int main(int argc, char *argv[]) {
       }
     }
     else if (argc - i >= 2) {    // Compound arguments go in this case block...
-      if ((strcasestr(argv[i], "--conf")) || (strcasestr(argv[i], "-c"))) {
+      if ((0 == strcasecmp(argv[i], "--conf")) || (0 == strcmp(argv[i], "-c"))) {
         if (argc - i < 2) {  // Mis-use of flag...
           printUsage();
           exit(1);
@@ -467,6 +782,10 @@ int main(int argc, char *argv[]) {
     c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Couldn't parse DB conf from %s. Stopping...", ((db_conf_filename == NULL) ? DEFAULT_CONF_FILE : db_conf_filename));
   }
 
+  if (conf.configKeyExists("hash-cache")) {
+    HashCache::getInstance()->open(conf.getConfigStringByKey("hash-cache"), 0);
+  }
+
   //// Alright... we are done loading configuration. Now let's make sure it is complete...
   //if (!conf.isConfigComplete()) {
   //    c3p_log(LOG_LEV_ERROR, __PRETTY_FUNCTION__, "Configuration is incomplete. Shutting down...");
@@ -524,10 +843,21 @@ int main(int argc, char *argv[]) {
   console.defineCommand("console",     '\0', "Console conf.", "[echo|prompt|force|rxterm|txterm]", 0, callback_console_tools);
   console.defineCommand("pfinfo",      '\0', "Platform information", "[subgroup]", 0, callback_platform_info);
   console.defineCommand("info",        'i',  "Print the catalog's vital stats.", "", 0, callback_catalog_info);
-  console.defineCommand("scan",        '\0', "Read the filesystem to fill out the catalog.", "", 0, callback_start_scan);
+  console.defineCommand("scan",        '\0', "Read the filesystem to fill out the catalog.", "[structure|metadata|full] [<baseline-id>]", 0, callback_start_scan);
+  console.defineCommand("scan-opts",   '\0', "View or set options for the next scan.", "[<key> <value> ...]", 0, callback_scan_opts);
+  console.defineCommand("resume",      '\0', "Continue a catalog's scan from its last checkpoint.", "<catalog-id> [<key> <value> ...]", 1, callback_resume);
+  console.defineCommand("verify",      '\0', "Check a catalog's tree against its rows, without changing them.", "<catalog-id> [<key> <value> ...]", 1, callback_verify);
+  console.defineCommand("rescan",      '\0', "Scan a subtree of the catalog again, and replace its rows.", "<path>", 1, callback_rescan);
+  console.defineCommand("dupes-scan",  '\0', "Scan the catalog for metadata, and find the files that hold the same content.", "", 0, callback_dupes_scan);
+  console.defineCommand("watch",       '\0', "Keep a finished catalog current by following changes to its tree.", "[<catalog-id>] [<key> <value> ...]", 0, callback_watch);
+  console.defineCommand("rules",       '\0', "View or change the catalog's include/exclude rules.", "[list|add <rule>|clear|copy <catalog-id>]", 0, callback_rules);
+  console.defineCommand("hash-cache",  '\0', "View, open, or compact this host's cache of file digests.", "[info|open <path> [<slots>]|close|compact [<max-age-scans> [<slots>]]]", 0, callback_hash_cache);
+  console.defineCommand("hash-bench",  '\0', "Compare the SHA-256 engines this CPU can run against OpenSSL.", "[<message-bytes> [<total-MiB>]]", 0, callback_hash_bench);
+  console.defineCommand("order-bench", '\0', "Time hashing a synthetic tree in each hash-order, from a cold cache.", "<dir> [<files> [<KiB>]]", 1, callback_order_bench);
+  console.defineCommand("alloc-bench", '\0', "Compare scanned entries made from a slab against new and delete.", "[<threads> [<thousands>]]", 0, callback_alloc_bench);
   console.defineCommand("unload",      '\0', "Discard the current catalog.", "", 0, callback_unload);
   console.defineCommand("max-print",   '\0', "Sets the maximum print width.", "", 0, callback_max_print_width);
-  console.defineCommand("catalog",     '\0', "Create a new catalog at the given path.", "", 1, callback_new_catalog);
+  console.defineCommand("catalog",     '\0', "Create a new catalog at the given path.", "<path> [<baseline-id>]", 1, callback_new_catalog);
   console.defineCommand("tag",         '\0', "Set a tag for the catalog.", "", 1, callback_set_tag);
   console.defineCommand("notes",       '\0', "Set the notes on the catalog.", "", 1, callback_set_notes);
   console.defineCommand("quit",        'Q',  "Commit sudoku.", "", 0, callback_program_quit);
@@ -549,6 +879,7 @@ int main(int argc, char *argv[]) {
     delete root_catalog;
     root_catalog = nullptr;
   }
+  ScanScheduler::getInstance()->shutdown();   // Join the scan pool.
 
   console.emitPrompt(false);  // Avoid a trailing prompt.
   console_adapter.poll();
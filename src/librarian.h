@@ -26,6 +26,7 @@
 #include <Linux.h>
 
 #include "MySQLConnector/DBAbstractions/ORM.h"
+#include "ScanEngine/ScanEngine.h"
 #include "ConfigManager/ConfigManager.h"
 
 
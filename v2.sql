@@ -0,0 +1,144 @@
+-- Migration from schema version 1 to version 2.
+-- Apply after v1.sql. Safe to run only once.
+USE `datahive_versions`;
+
+
+-- Hard links: every link to an inode gets its own row, and the rows are tied
+--   together by (st_dev, st_ino). Only the first link found is read and hashed.
+--   The others take its digest, and are marked with `hardlink` = 1.
+ALTER TABLE `file_meta`
+  ADD COLUMN `st_dev` BIGINT unsigned NOT NULL DEFAULT 0 COMMENT 'Device of the filesystem holding the object.' AFTER `perms`,
+  ADD COLUMN `st_ino` BIGINT unsigned NOT NULL DEFAULT 0 COMMENT 'Inode number on that device.' AFTER `st_dev`,
+  ADD COLUMN `nlink` int(10) unsigned NOT NULL DEFAULT 0 COMMENT 'Hard link count at the time of the scan.' AFTER `st_ino`,
+  ADD COLUMN `hardlink` tinyint(1) NOT NULL DEFAULT 0 COMMENT '1 if the digest was taken from another link to the same inode.' AFTER `nlink`,
+  ADD KEY `snapshot_inode` (`id_dh_snapshot`, `st_dev`, `st_ino`);
+
+
+-- Include/exclude rules, saved with the catalog they were written for. They
+--   are applied in `ordinal` order, and the last rule to match an entry wins.
+CREATE TABLE `scan_rules` (
+  `id` int(10) unsigned NOT NULL AUTO_INCREMENT,
+  `id_dh_snapshot` int(10) unsigned NOT NULL COMMENT 'The catalog the rule belongs to.',
+  `ordinal` int(10) unsigned NOT NULL COMMENT 'Position of the rule in the catalog''s list.',
+  `rule` varchar(1024) NOT NULL,
+  PRIMARY KEY (`id`),
+  KEY `snapshot_ordinal` (`id_dh_snapshot`, `ordinal`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+
+-- Checkpoints of a scan in progress. `last_row_id` is the newest file_meta row
+--   that the checkpoint accounts for. Rows past it are discarded on resume.
+CREATE TABLE `scan_checkpoint` (
+  `id_dh_snapshot` int(10) unsigned NOT NULL COMMENT 'The catalog being scanned.',
+  `datetime_taken` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,
+  `depth` tinyint(3) unsigned NOT NULL COMMENT 'The depth the scan was started with.',
+  `last_row_id` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_files` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_links` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_directories` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_excluded` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `complete` tinyint(1) NOT NULL DEFAULT 0 COMMENT '1 once the scan has read everything.',
+  PRIMARY KEY (`id_dh_snapshot`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+-- Directories that have rows, but were not yet read when the checkpoint was
+--   taken. Paths are relative to the catalog's root.
+CREATE TABLE `scan_frontier` (
+  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,
+  `id_dh_snapshot` int(10) unsigned NOT NULL,
+  `rel_path` mediumblob NOT NULL,
+  PRIMARY KEY (`id`),
+  KEY `snapshot` (`id_dh_snapshot`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+
+-- Timestamps to the nanosecond. A new catalog given a baseline takes the old
+--   digest of any file whose size, times, and inode are unchanged. Rows from
+--   before these columns existed hold 0, and never match.
+ALTER TABLE `file_meta`
+  ADD COLUMN `ctime_ns` BIGINT NOT NULL DEFAULT 0 COMMENT 'ctime, in ns since the epoch.' AFTER `mtime`,
+  ADD COLUMN `mtime_ns` BIGINT NOT NULL DEFAULT 0 COMMENT 'mtime, in ns since the epoch.' AFTER `ctime_ns`;
+
+
+-- Rows beneath a path are found with a prefix LIKE on `rel_path`, for subtree
+--   rescans and watches.
+ALTER TABLE `file_meta`
+  ADD KEY `snapshot_path` (`id_dh_snapshot`, `rel_path`(255));
+
+
+-- Groups of files with the same content, found by a dupes-scan. A catalog's
+--   groups are replaced each time it is scanned for duplicates. The digest is
+--   that of the whole content if the group is confirmed, and of its sampled
+--   head and tail otherwise.
+CREATE TABLE `dupe_group` (
+  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,
+  `id_dh_snapshot` int(10) unsigned NOT NULL,
+  `size` bigint(20) unsigned NOT NULL COMMENT 'The size of each member, in bytes.',
+  `digest` varchar(64) NOT NULL,
+  `confirmed` tinyint(1) NOT NULL DEFAULT 0 COMMENT '1 if every member was hashed in full.',
+  `members` int(10) unsigned NOT NULL COMMENT 'Rows in the group, counting every hard link.',
+  `inodes` int(10) unsigned NOT NULL COMMENT 'Distinct inodes in the group.',
+  PRIMARY KEY (`id`),
+  KEY `snapshot` (`id_dh_snapshot`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+ALTER TABLE `file_meta`
+  ADD COLUMN `dupe_group` bigint(20) unsigned NOT NULL DEFAULT 0 COMMENT 'The dupe_group this file belongs to, or 0.' AFTER `hardlink`,
+  ADD KEY `snapshot_dupe_group` (`id_dh_snapshot`, `dupe_group`);
+
+
+-- BLAKE3, beside SHA-256. Each catalog records which of the two it takes
+--   (1 is SHA-256, 2 is BLAKE3, 3 is both). A digest that was not taken is
+--   left empty (BLAKE3) or zeroed (SHA-256).
+ALTER TABLE `file_meta`
+  ADD COLUMN `blake3` varchar(64) NOT NULL DEFAULT '' AFTER `sha256`;
+
+ALTER TABLE `datahive_version`
+  ADD COLUMN `digests` tinyint(3) unsigned NOT NULL DEFAULT 1 COMMENT 'The digests taken of each file. 1 is SHA-256, 2 is BLAKE3.';
+
+
+-- Content-defined chunks of large files, cut with FastCDC. A chunk is keyed by
+--   the SHA-256 of its content, and has one row however many files hold it.
+--   Where it falls in each file is in `file_chunk`.
+CREATE TABLE `chunk` (
+  `digest` char(64) NOT NULL,
+  `size` int(10) unsigned NOT NULL,
+  PRIMARY KEY (`digest`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+CREATE TABLE `file_chunk` (
+  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,
+  `id_dh_snapshot` int(10) unsigned NOT NULL,
+  `rel_path` mediumblob NOT NULL COMMENT 'As in file_meta.',
+  `ordinal` int(10) unsigned NOT NULL COMMENT 'The chunk''s place in the file, from 0.',
+  `offset` bigint(20) unsigned NOT NULL,
+  `size` int(10) unsigned NOT NULL,
+  `digest` char(64) NOT NULL,
+  PRIMARY KEY (`id`),
+  KEY `snapshot_path` (`id_dh_snapshot`, `rel_path`(255)),
+  KEY `digest` (`digest`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+
+-- One row per run of `verify`, which checks a catalog against its tree without
+--   changing it. Missing files are only counted if the run read the whole tree.
+CREATE TABLE `verification` (
+  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,
+  `id_dh_snapshot` int(10) unsigned NOT NULL,
+  `datetime_created` datetime NOT NULL DEFAULT current_timestamp(),
+  `seconds` int(10) unsigned NOT NULL COMMENT 'How long the run took.',
+  `complete` tinyint(1) NOT NULL DEFAULT 0 COMMENT '0 if the time box closed before the whole tree was read.',
+  `count_matched` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_changed` bigint(20) unsigned NOT NULL DEFAULT 0 COMMENT 'A different type, or different content and metadata.',
+  `count_corrupt` bigint(20) unsigned NOT NULL DEFAULT 0 COMMENT 'Different content, with the same size and mtime.',
+  `count_unreadable` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_missing` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `count_new` bigint(20) unsigned NOT NULL DEFAULT 0,
+  `bytes_verified` bigint(20) unsigned NOT NULL DEFAULT 0,
+  PRIMARY KEY (`id`),
+  KEY `snapshot` (`id_dh_snapshot`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+
+INSERT INTO `db_version` (`version`, `log`) VALUES
+(2, 'Hard link tracking in file_meta. Per-catalog scan rules. Resumable scan checkpoints. Nanosecond times for incremental scans. Path index for subtree rescans. Duplicate groups. BLAKE3 digests. Content-defined chunks. Verification runs.');